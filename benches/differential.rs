@@ -0,0 +1,718 @@
+use std::fmt::Write;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::process::ExitCode;
+use std::time::{Duration, Instant};
+
+use tml::bytecode as bc;
+use tml::checkpoint::{self, Checkpoint};
+use tml::compile::{self, Compiled};
+use tml::error::Error;
+use tml::parse::{self, State, Symbol};
+use tml::vm::{Machine, Simulated};
+use tml::{cache, cycle, ffi, inline, lex, optimize, specialize, vm};
+
+/// Machines generated if no count is given
+const MACHINES: usize = 300;
+/// Initial tapes each machine runs on
+const TAPES: usize = 3;
+/// Most moves per run, since most random machines never halt
+const MAX_MOVES: usize = 20_000;
+/// Most moves per run with `--fast-forward`, which only looks for cycles
+/// every 16384 moves at first
+const FAST_FORWARD_MOVES: usize = 1 << 18;
+/// Cells `--until-digits` can watch, a few more than a tape has
+const WATCHED_CELLS: usize = 16;
+/// The default `--specialize-limit`
+const SPECIALIZE_LIMIT: usize = 4096;
+/// Mismatches printed in full, the rest are only counted
+const SHOWN: usize = 5;
+/// Cells of a tape printed with a mismatch
+const SHOWN_CELLS: usize = 40;
+
+const SYMBOLS: [&str; 4] = ["''", "'0'", "'1'", "'x'"];
+const STATE_PARAMS: [&str; 2] = ["A", "B"];
+const SYMBOL_PARAMS: [&str; 2] = ["x", "y"];
+/// The name the catchall arms bind
+const BOUND: &str = "c";
+
+/// A xorshift generator, so a run can be repeated from its seed.
+struct Rng(u64);
+
+impl Rng {
+    fn next(&mut self) -> u64 {
+        self.0 ^= self.0 << 13;
+        self.0 ^= self.0 >> 7;
+        self.0 ^= self.0 << 17;
+        self.0
+    }
+
+    fn below(&mut self, n: usize) -> usize {
+        (self.next() % n as u64) as usize
+    }
+
+    fn one_in(&mut self, n: usize) -> bool {
+        self.below(n) == 0
+    }
+}
+
+/// The names an arm can use: the parameters of its state and, in a catchall
+/// arm, the symbol it matched.
+struct Scope {
+    states: usize,
+    symbols: usize,
+    bound: bool,
+}
+
+impl Scope {
+    fn symbol(&self, rng: &mut Rng) -> &'static str {
+        let names = SYMBOLS.len() + self.symbols + self.bound as usize;
+        match rng.below(names) {
+            i if i < SYMBOLS.len() => SYMBOLS[i],
+            i if i < SYMBOLS.len() + self.symbols => SYMBOL_PARAMS[i - SYMBOLS.len()],
+            _ => BOUND,
+        }
+    }
+}
+
+/// A machine with up to 6 states besides `start`, each with up to 2 state
+/// and 2 symbol parameters. `signatures` are the parameter counts of `s0`,
+/// `s1` and so on, which every call matches, so only arms the compiler finds
+/// too complicated get a machine rejected.
+fn generate_machine(rng: &mut Rng) -> String {
+    let signatures: Vec<_> = (0..1 + rng.below(6))
+        .map(|_| (rng.below(3), rng.below(3)))
+        .collect();
+
+    let start = Scope {
+        states: 0,
+        symbols: 0,
+        bound: false,
+    };
+    let mut code = format!(
+        "start {{\n    _ |{}| {},\n}}\n",
+        ops(rng, &start),
+        to_state(rng, &signatures, &start, 2)
+    );
+    for (i, &(states, symbols)) in signatures.iter().enumerate() {
+        let params = args(&STATE_PARAMS[..states], &SYMBOL_PARAMS[..symbols]);
+        writeln!(code, "\ns{i}{params} {{").unwrap();
+
+        let arms = 1 + rng.below(4);
+        for arm in 0..arms {
+            let catchall = arm == arms - 1 && !rng.one_in(3);
+            let scope = Scope {
+                states,
+                symbols,
+                bound: catchall,
+            };
+            let pattern = if catchall {
+                BOUND
+            } else if symbols > 0 && rng.one_in(3) {
+                SYMBOL_PARAMS[rng.below(symbols)]
+            } else {
+                SYMBOLS[rng.below(SYMBOLS.len())]
+            };
+            let to_state = to_state(rng, &signatures, &scope, 2);
+            writeln!(code, "    {pattern} |{}| {to_state},", ops(rng, &scope)).unwrap();
+        }
+        code.push_str("}\n");
+    }
+    code
+}
+
+/// The ops of an arm, with the spaces around them.
+fn ops(rng: &mut Rng, scope: &Scope) -> String {
+    let mut ops = String::from(" ");
+    for _ in 0..rng.below(5) {
+        ops.push_str(match rng.below(4) {
+            0 => "<",
+            1 => ">",
+            _ => scope.symbol(rng),
+        });
+        ops.push(' ');
+    }
+    ops
+}
+
+/// A state to go to, with state arguments nested at most `depth` deep.
+fn to_state(rng: &mut Rng, signatures: &[(usize, usize)], scope: &Scope, depth: usize) -> String {
+    if rng.one_in(8) {
+        return "!".to_string();
+    }
+    if scope.states > 0 && rng.one_in(3) {
+        return STATE_PARAMS[rng.below(scope.states)].to_string();
+    }
+
+    let targets: Vec<_> = (0..signatures.len())
+        .filter(|&i| depth > 0 || signatures[i].0 == 0)
+        .collect();
+    if targets.is_empty() {
+        return "!".to_string();
+    }
+    let target = targets[rng.below(targets.len())];
+    let (states, symbols) = signatures[target];
+    let states: Vec<_> = (0..states)
+        .map(|_| to_state(rng, signatures, scope, depth - 1))
+        .collect();
+    let symbols: Vec<_> = (0..symbols).map(|_| scope.symbol(rng)).collect();
+    format!("s{target}{}", args(&states, &symbols))
+}
+
+/// The parameter or argument list of a state, like `(A; x, y)`.
+fn args(states: &[impl AsRef<str>], symbols: &[impl AsRef<str>]) -> String {
+    match (states.is_empty(), symbols.is_empty()) {
+        (true, true) => String::new(),
+        (false, true) => format!("({})", join(states)),
+        _ => format!("({}; {})", join(states), join(symbols)),
+    }
+}
+
+fn join(names: &[impl AsRef<str>]) -> String {
+    let names: Vec<_> = names.iter().map(AsRef::as_ref).collect();
+    names.join(", ")
+}
+
+fn generate_tape(rng: &mut Rng) -> String {
+    let cells: Vec<_> = (0..rng.below(12))
+        .map(|_| SYMBOLS[rng.below(SYMBOLS.len())])
+        .collect();
+    cells.join(" ")
+}
+
+fn leak(code: String) -> &'static str {
+    Box::leak(code.into_boxed_str())
+}
+
+fn parse_machine(code: &'static str) -> Result<Vec<State>, Error> {
+    let path: &'static Path = Path::new("generated.tml");
+    parse::parse(lex::Tokens::new(code, path, false)?)
+}
+
+fn parse_tape(code: &'static str) -> Result<Vec<Symbol>, Error> {
+    if code.is_empty() {
+        return Ok(Vec::new());
+    }
+    let path: &'static Path = Path::new("generated.tape");
+    parse::parse_tape(lex::Tokens::new(code, path, false)?)
+}
+
+/// The compile options `tml` has flags for.
+#[derive(Clone, Copy)]
+struct Mode {
+    opt_level: u8,
+    inline: bool,
+    specialize: bool,
+}
+
+impl Mode {
+    fn all() -> Vec<Mode> {
+        let mut modes = Vec::new();
+        for inline in [false, true] {
+            for specialize in [false, true] {
+                for opt_level in 0..=2 {
+                    modes.push(Mode {
+                        opt_level,
+                        inline,
+                        specialize,
+                    });
+                }
+            }
+        }
+        modes
+    }
+
+    fn name(&self) -> String {
+        let mut name = format!("-O{}", self.opt_level);
+        if self.inline {
+            name.push_str(" --inline");
+        }
+        if self.specialize {
+            name.push_str(" --specialize");
+        }
+        name
+    }
+
+    /// Compiles `unit` like `tml` does with these options. With `files`, the
+    /// machine comes out of a cache entry, like in a later `tml --cache` run.
+    fn compile(
+        &self,
+        unit: &[State],
+        tape: &[Symbol],
+        files: Option<&Files>,
+    ) -> Result<Compiled, Error> {
+        let mut unit = unit.to_vec();
+        if self.inline {
+            inline::inline(&mut unit);
+        }
+        let mut compiled = if self.specialize {
+            specialize::compile(unit, tape, SPECIALIZE_LIMIT)?
+        } else {
+            compile::compile(unit, tape)?
+        };
+        compiled.tape = compiled.intern(tape)?;
+        optimize::optimize(&mut compiled, self.opt_level);
+
+        let Some(files) = files else {
+            return Ok(compiled);
+        };
+        let entry = cache::Entry::new(
+            &files.dir,
+            &files.machine,
+            files.tape.as_deref(),
+            false,
+            self.specialize.then_some(SPECIALIZE_LIMIT),
+            self.opt_level,
+            self.inline,
+        )?;
+        entry.store(&compiled)?;
+        entry
+            .load()
+            .ok_or_else(|| Error::new("the cache entry didn't load".to_string(), None))
+    }
+}
+
+/// A directory for the files of a run, for `--cache` and checkpoints.
+struct Files {
+    dir: PathBuf,
+    machine: PathBuf,
+    tape: Option<PathBuf>,
+    checkpoint: PathBuf,
+}
+
+impl Files {
+    fn new(dir: PathBuf, machine: &str, tape: &str) -> Self {
+        let write = |name: &str, contents: &str| {
+            let path = dir.join(name);
+            fs::write(&path, contents).expect("the temporary directory is writable");
+            path
+        };
+        Files {
+            machine: write("generated.tml", machine),
+            tape: (!tape.is_empty()).then(|| write("generated.tape", tape)),
+            checkpoint: dir.join("generated.checkpoint"),
+            dir,
+        }
+    }
+}
+
+/// The options `tml` has for how far a machine runs and how it gets there.
+/// Each is picked at random for a run, and every mode and VM has to end it
+/// the same way as the Rust VM at `-O0` running it in one go.
+#[derive(Clone, Copy)]
+struct Case {
+    max_moves: usize,
+    /// Moves before the run is checkpointed and resumed from the checkpoint
+    resume_after: Option<usize>,
+    fast_forward: bool,
+    /// The cell `--until-digits` stops after
+    watch: Option<usize>,
+    cache: bool,
+}
+
+impl Case {
+    fn generate(rng: &mut Rng) -> Self {
+        let fast_forward = rng.one_in(4);
+        let most = if fast_forward {
+            FAST_FORWARD_MOVES
+        } else {
+            MAX_MOVES
+        };
+        // short runs stop in the middle of inlined arms and the first few
+        // moves, where the C VM runs moves one at a time
+        let max_moves = match rng.below(4) {
+            0 => rng.below(65),
+            1 => rng.below(1 << 10),
+            _ => rng.below(most + 1),
+        };
+        Case {
+            max_moves,
+            resume_after: rng.one_in(3).then(|| rng.below(max_moves + 1)),
+            fast_forward,
+            watch: rng.one_in(4).then(|| rng.below(WATCHED_CELLS)),
+            cache: rng.one_in(8),
+        }
+    }
+
+    /// The same run in one go.
+    fn reference(&self) -> Self {
+        Case {
+            resume_after: None,
+            fast_forward: false,
+            cache: false,
+            ..*self
+        }
+    }
+
+    /// Whether the VM does all the work, without a checkpoint to write or
+    /// periods to skip.
+    fn in_one_go(&self) -> bool {
+        self.resume_after.is_none() && !self.fast_forward
+    }
+
+    fn name(&self) -> String {
+        let mut name = format!("-m {}", self.max_moves);
+        if let Some(moves) = self.resume_after {
+            write!(name, ", resumed after {moves} moves").unwrap();
+        }
+        if self.fast_forward {
+            name.push_str(" --fast-forward");
+        }
+        if let Some(cell) = self.watch {
+            write!(name, " until cell {cell} is written").unwrap();
+        }
+        if self.cache {
+            name.push_str(" --cache");
+        }
+        name
+    }
+
+    /// Runs `vm` like `tml` does, and returns whether it halted.
+    fn run(
+        &self,
+        vm: &mut impl Machine,
+        compiled: &Compiled,
+        bi_infinite: bool,
+        max_moves: usize,
+        mut halted: bool,
+    ) -> bool {
+        if let Some(cell) = self.watch {
+            vm.watch_cell(cell);
+        }
+        let finished =
+            |vm: &dyn Machine| self.watch.is_some_and(|cell| vm.cell(cell as isize) != 0);
+        let mut cycles = self
+            .fast_forward
+            .then(|| cycle::Detector::new(&compiled.bytes, bi_infinite));
+
+        while !halted && !finished(vm) && vm.moves() < max_moves {
+            let mut target = max_moves;
+            if let Some(cycles) = &cycles {
+                target = target.min(cycles.next_sample().max(vm.moves() + 1));
+            }
+            vm.run(target);
+            halted = vm.moves() < target && !finished(vm);
+            if let (Some(cycles), false) = (&mut cycles, halted) {
+                if cycles.update(vm, max_moves, self.watch) {
+                    halted = !finished(vm);
+                }
+            }
+        }
+        halted
+    }
+
+    /// Runs `vm`, through a checkpoint in `files` and the VM `restore()`
+    /// makes of it if the run is resumed.
+    fn finish<M: Machine>(
+        &self,
+        mut vm: M,
+        compiled: &Compiled,
+        bi_infinite: bool,
+        files: &Files,
+        restore: impl Fn(&Checkpoint) -> M,
+    ) -> Result<Simulated, Error> {
+        let mut halted = false;
+        if let Some(moves) = self.resume_after {
+            halted = self.run(&mut vm, compiled, bi_infinite, moves, false);
+            vm.checkpoint(checkpoint::hash(compiled), halted)
+                .write(&files.checkpoint)?;
+            drop(vm);
+            let checkpoint = Checkpoint::read(&files.checkpoint)?;
+            checkpoint.validate(compiled, bi_infinite)?;
+            vm = restore(&checkpoint);
+            halted = checkpoint.halted;
+        }
+        self.run(&mut vm, compiled, bi_infinite, self.max_moves, halted);
+        Ok(vm.finish())
+    }
+}
+
+/// The VMs, and the builds of vm.c `ffi::Vm::new()` picks from.
+const BACKENDS: [&str; 4] = ["c", "c wide", "c sparse", "rust"];
+
+fn simulate(
+    backend: usize,
+    compiled: &Compiled,
+    bi_infinite: bool,
+    case: &Case,
+    files: &Files,
+) -> Result<Simulated, Error> {
+    let (bytes, tape) = (&compiled.bytes, &compiled.tape);
+    // claiming more symbols than fit in a byte picks the build with two-byte
+    // cells
+    let symbols = match BACKENDS[backend] {
+        "c wide" => 257,
+        _ => compiled.symbols.len(),
+    };
+    let sparse = BACKENDS[backend] == "c sparse";
+    match BACKENDS[backend] {
+        "rust" => case.finish(
+            vm::Vm::new(bytes, tape.clone(), bi_infinite, false),
+            compiled,
+            bi_infinite,
+            files,
+            |checkpoint| vm::Vm::restore(bytes, checkpoint, false),
+        ),
+        _ => case.finish(
+            ffi::Vm::new(bytes, tape, symbols, bi_infinite, sparse, false),
+            compiled,
+            bi_infinite,
+            files,
+            |checkpoint| ffi::Vm::restore(bytes, checkpoint, symbols, sparse, false),
+        ),
+    }
+}
+
+/// What a run ends with, in terms that are the same in every mode. Symbols
+/// are numbered and states laid out differently in each.
+#[derive(PartialEq)]
+struct Outcome {
+    tape: Vec<String>,
+    origin: usize,
+    head: isize,
+    /// The name of the final state, without the arguments `--specialize`
+    /// adds to it
+    state: String,
+    moves: usize,
+}
+
+impl Outcome {
+    fn new(simulated: &Simulated, compiled: &Compiled) -> Self {
+        let state = match compiled.states.get(&simulated.final_address) {
+            Some(name) => name.split('(').next().unwrap().to_string(),
+            None if simulated.final_address == bc::HALT_ADDRESS => "!".to_string(),
+            None => format!("{:#x}", simulated.final_address),
+        };
+        Outcome {
+            tape: simulated
+                .tape
+                .symbols(0, &compiled.symbols)
+                .map(str::to_string)
+                .collect(),
+            origin: simulated.origin,
+            head: simulated.head_position,
+            state,
+            moves: simulated.moves,
+        }
+    }
+
+    fn describe(&self) -> String {
+        let mut tape: Vec<_> = self
+            .tape
+            .iter()
+            .take(SHOWN_CELLS)
+            .map(|s| format!("'{s}'"))
+            .collect();
+        if self.tape.len() > SHOWN_CELLS {
+            tape.push(format!("... ({} cells)", self.tape.len()));
+        }
+        format!(
+            "{} moves, in {}, head at {}, tape [{}] from cell {}",
+            self.moves,
+            self.state,
+            self.head,
+            tape.join(" "),
+            -(self.origin as isize)
+        )
+    }
+}
+
+pub struct Mismatch {
+    machine: &'static str,
+    tape: &'static str,
+    bi_infinite: bool,
+    mode: String,
+    backend: &'static str,
+    expected: String,
+    found: String,
+}
+
+impl Mismatch {
+    pub fn print(&self) {
+        println!(
+            "mismatch: {} in the {} VM{}",
+            self.mode,
+            self.backend,
+            if self.bi_infinite {
+                " (bi-infinite)"
+            } else {
+                ""
+            }
+        );
+        println!("  expected {}\n  found    {}", self.expected, self.found);
+        println!("  tape: {}\n{}", self.tape, self.machine);
+    }
+}
+
+/// The runs of one `compare()`.
+pub struct Comparison {
+    pub runs: usize,
+    /// Runs of machines the compiler rejected at `-O0`
+    pub rejected: usize,
+    /// The time each mode took in each VM, for the runs made in one go
+    pub times: Vec<[Duration; BACKENDS.len()]>,
+    pub mismatches: Vec<Mismatch>,
+}
+
+/// Runs `machines` random machines from `seed` on random tapes in every
+/// mode and VM, each with a random `Case`, and compares every run against
+/// the Rust VM at `-O0` running the same case in one go, the reference
+/// semantics.
+pub fn compare(machines: usize, seed: u64) -> Comparison {
+    let mut rng = Rng(seed);
+    let modes = Mode::all();
+    let mut times = vec![[Duration::ZERO; BACKENDS.len()]; modes.len()];
+    let mut mismatches = Vec::new();
+    let (mut runs, mut rejected) = (0, 0);
+    let dir = std::env::temp_dir().join(format!("tml-differential-{}", std::process::id()));
+    fs::create_dir_all(&dir).expect("the temporary directory is writable");
+    for _ in 0..machines {
+        let machine = leak(generate_machine(&mut rng));
+        let unit = parse_machine(machine).expect("generated machines parse");
+        for _ in 0..TAPES {
+            let tape = leak(generate_tape(&mut rng));
+            let symbols = parse_tape(tape).expect("generated tapes parse");
+            let bi_infinite = rng.one_in(2);
+            let case = Case::generate(&mut rng);
+            let files = Files::new(dir.clone(), machine, tape);
+
+            let mismatch = |mode: &Mode, backend, expected: String, found: String| Mismatch {
+                machine,
+                tape,
+                bi_infinite,
+                mode: format!("{} {}", mode.name(), case.name()),
+                backend,
+                expected,
+                found,
+            };
+            let mut reference = None;
+            for (i, mode) in modes.iter().enumerate() {
+                // the first mode is the reference
+                if i == 0 {
+                    let Ok(compiled) = mode.compile(&unit, &symbols, None) else {
+                        break;
+                    };
+                    let rust = BACKENDS.len() - 1;
+                    let simulated =
+                        simulate(rust, &compiled, bi_infinite, &case.reference(), &files)
+                            .expect("runs in one go don't fail");
+                    reference = Some(Outcome::new(&simulated, &compiled));
+                }
+                let reference = reference.as_ref().unwrap();
+
+                let compiled = match mode.compile(&unit, &symbols, case.cache.then_some(&files)) {
+                    Ok(compiled) => compiled,
+                    Err(error) => {
+                        let found = format!("{error:?}");
+                        let expected = "the machine to compile".to_string();
+                        mismatches.push(mismatch(mode, "any", expected, found));
+                        continue;
+                    }
+                };
+
+                let mut final_address = None;
+                for backend in (0..BACKENDS.len()).rev() {
+                    // like `tml`, which doesn't take both
+                    if case.fast_forward && BACKENDS[backend] == "c sparse" {
+                        continue;
+                    }
+                    let start = Instant::now();
+                    let simulated = simulate(backend, &compiled, bi_infinite, &case, &files);
+                    if case.in_one_go() {
+                        times[i][backend] += start.elapsed();
+                    }
+                    let simulated = match simulated {
+                        Ok(simulated) => simulated,
+                        Err(error) => {
+                            let found = format!("{error:?}");
+                            mismatches.push(mismatch(
+                                mode,
+                                BACKENDS[backend],
+                                reference.describe(),
+                                found,
+                            ));
+                            continue;
+                        }
+                    };
+
+                    let outcome = Outcome::new(&simulated, &compiled);
+                    // addresses are only the same in the same mode
+                    let address = *final_address.get_or_insert(simulated.final_address);
+                    if outcome != *reference || simulated.final_address != address {
+                        let expected = reference.describe();
+                        let found = format!(
+                            "{} (address {:#x})",
+                            outcome.describe(),
+                            simulated.final_address
+                        );
+                        mismatches.push(mismatch(mode, BACKENDS[backend], expected, found));
+                    }
+                }
+            }
+            match reference {
+                Some(_) => runs += 1,
+                None => rejected += 1,
+            }
+        }
+    }
+    let _ = fs::remove_dir_all(&dir);
+
+    Comparison {
+        runs,
+        rejected,
+        times,
+        mismatches,
+    }
+}
+
+/// Runs `MACHINES` random machines (or the count given as the first
+/// argument, with the seed as the second) through `compare()`, and reports
+/// how much faster each mode and VM is than the reference on the runs made
+/// in one go. Exits with an error if anything didn't match.
+fn main() -> ExitCode {
+    // `cargo bench` passes `--bench`
+    let args: Vec<_> = std::env::args()
+        .skip(1)
+        .filter(|arg| !arg.starts_with('-'))
+        .collect();
+    let machines = args.first().map_or(MACHINES, |arg| arg.parse().unwrap());
+    let seed = args
+        .get(1)
+        .map_or(0x2545f4914f6cdd1d, |arg| arg.parse().unwrap());
+    let Comparison {
+        runs,
+        rejected,
+        times,
+        mismatches,
+    } = compare(machines, seed);
+
+    let modes = Mode::all();
+    println!(
+        "{runs} runs of {machines} machines ({rejected} runs rejected by the compiler), \
+         seed {seed}, at most {MAX_MOVES} moves each or {FAST_FORWARD_MOVES} with --fast-forward"
+    );
+    let reference = times[0][BACKENDS.len() - 1].as_secs_f64();
+    print!("{:<26}", "speedup over rust -O0");
+    for backend in BACKENDS {
+        print!("{backend:>12}");
+    }
+    println!();
+    for (mode, times) in modes.iter().zip(&times) {
+        print!("{:<26}", mode.name());
+        for time in times {
+            print!("{:>11.2}x", reference / time.as_secs_f64());
+        }
+        println!();
+    }
+    println!("reference time: {:.1?}\n", times[0][BACKENDS.len() - 1]);
+
+    for mismatch in mismatches.iter().take(SHOWN) {
+        mismatch.print();
+    }
+    println!("{} mismatches", mismatches.len());
+    if mismatches.is_empty() {
+        ExitCode::SUCCESS
+    } else {
+        ExitCode::FAILURE
+    }
+}
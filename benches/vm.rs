@@ -0,0 +1,129 @@
+use std::fmt::Write;
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use criterion::{
+    black_box, criterion_group, criterion_main, BatchSize, BenchmarkId, Criterion, Throughput,
+};
+
+use tml::compile::{self, Compiled};
+use tml::{ffi, lex, parse, tape, vm};
+
+/// Moves per run of an example
+const MOVES: usize = 10_000_000;
+
+fn compile_file(path: PathBuf) -> Compiled {
+    let tokens = lex::Tokens::from_path_buf(path, false).unwrap();
+    compile::compile(parse::parse(tokens).unwrap(), &[]).unwrap()
+}
+
+fn examples() -> Vec<(String, Compiled)> {
+    let dir = Path::new(env!("CARGO_MANIFEST_DIR")).join("examples");
+    let mut paths: Vec<_> = fs::read_dir(dir)
+        .unwrap()
+        .map(|entry| entry.unwrap().path())
+        .filter(|path| path.extension().is_some_and(|ext| ext == "tml"))
+        .collect();
+    paths.sort();
+
+    paths
+        .into_iter()
+        .map(|path| {
+            let name = path.file_stem().unwrap().to_string_lossy().into_owned();
+            (name, compile_file(path))
+        })
+        .collect()
+}
+
+/// Runs every example for `MOVES` moves, or until it halts, in both VMs.
+fn simulate(c: &mut Criterion) {
+    let mut group = c.benchmark_group("simulate");
+    group.sample_size(10);
+    for (name, compiled) in examples() {
+        let moves = vm::simulate(&compiled.bytes, compiled.tape.clone(), MOVES, false).moves;
+        group.throughput(Throughput::Elements(moves as u64));
+
+        group.bench_with_input(BenchmarkId::new("c", &name), &compiled, |b, compiled| {
+            b.iter(|| {
+                ffi::simulate(
+                    &compiled.bytes,
+                    &compiled.tape,
+                    compiled.symbols.len(),
+                    MOVES,
+                    false,
+                    false,
+                )
+            })
+        });
+        group.bench_with_input(BenchmarkId::new("rust", &name), &compiled, |b, compiled| {
+            b.iter(|| vm::simulate(&compiled.bytes, compiled.tape.clone(), MOVES, false))
+        });
+    }
+    group.finish();
+}
+
+/// A machine with `states` states, each with a few arms and some of them
+/// passing parameterized states on.
+fn generate_machine(states: usize) -> String {
+    let mut code = String::from("start {\n    _ | | s0,\n}\n\n");
+    code.push_str("wrap(A; x) {\n    x | > | A,\n    _ | < x | wrap(A; x),\n}\n\n");
+    for i in 0..states {
+        let next = (i + 1) % states;
+        let jump = (i * 7 + 3) % states;
+        writeln!(
+            code,
+            "s{i} {{\n    '0' | '1' > | s{next},\n    '1' | '0' << | wrap(s{jump}; '{}'),\n    \
+             'x' | >> 'y' | s{jump},\n    _ | '0' < | s{next},\n}}\n",
+            i % 10
+        )
+        .unwrap();
+    }
+    code
+}
+
+fn compile(c: &mut Criterion) {
+    let mut group = c.benchmark_group("compile");
+    group.sample_size(10);
+    for states in [1_000, 10_000, 50_000] {
+        let code: &'static str = Box::leak(generate_machine(states).into_boxed_str());
+        let path: &'static Path = Box::leak(PathBuf::from("generated.tml").into_boxed_path());
+        let unit = parse::parse(lex::Tokens::new(code, path, false).unwrap()).unwrap();
+
+        group.throughput(Throughput::Elements(states as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(states), &unit, |b, unit| {
+            b.iter_batched(
+                || unit.clone(),
+                |unit| compile::compile(unit, &[]).unwrap(),
+                BatchSize::LargeInput,
+            )
+        });
+    }
+    group.finish();
+}
+
+/// Parses tapes with `cells` binary digit cells, laid out like the ones
+/// `sqrt2.tml` writes.
+fn parse_decimal(c: &mut Criterion) {
+    let mut group = c.benchmark_group("parse_decimal");
+    for cells in [100, 1_000, 10_000, 100_000] {
+        // digits from a xorshift generator, so the numbers aren't trivial
+        let mut state = 0x2545f4914f6cdd1du64;
+        let mut tape = vec!["ə", "ə"];
+        for _ in 0..cells {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            tape.push(if state & 1 == 0 { "0" } else { "1" });
+            tape.push("");
+        }
+
+        group.throughput(Throughput::Elements(cells as u64));
+        group.bench_with_input(BenchmarkId::from_parameter(cells), &tape, |b, tape| {
+            b.iter(|| tape::parse_decimal(black_box(tape).iter().copied(), 2, None, 2, 2))
+        });
+    }
+    group.finish();
+}
+
+criterion_group!(benches, simulate, compile, parse_decimal);
+criterion_main!(benches);
@@ -2,23 +2,36 @@ const USE_COMPUTED_GOTO: bool = true;
 
 fn main() {
     println!("cargo:rerun-if-changed=src/vm.c");
+    // the narrow VM stores each cell in one byte, see `NARROW_CELLS` in vm.c,
+    // and only the profiling VM has counters, see `PROFILING`
+    build("vm", None, &[]);
+    build("vm_u8", Some("_u8"), &["NARROW_CELLS"]);
+    build("vm_profile", Some("_profile"), &["PROFILING"]);
+}
+
+fn build(name: &str, suffix: Option<&str>, defines: &[&str]) {
+    let out_dir = std::env::var("OUT_DIR").unwrap();
+    let mut build = cc::Build::new();
+    build.file("src/vm.c").out_dir(format!("{out_dir}/{name}"));
+    if let Some(suffix) = suffix {
+        build.define("VM_SUFFIX", suffix);
+    }
+    for define in defines {
+        build.define(define, "1");
+    }
+
     let profile = std::env::var("PROFILE").unwrap();
     match profile.as_str() {
-        "debug" => cc::Build::new()
-            .file("src/vm.c")
-            .define("DEBUG", "1")
-            .compile("vm"),
+        "debug" => {
+            build.define("DEBUG", "1");
+        }
         "release" => {
+            build.opt_level(3);
             if USE_COMPUTED_GOTO {
-                cc::Build::new()
-                    .file("src/vm.c")
-                    .opt_level(3)
-                    .define("USE_COMPUTED_GOTO", "1")
-                    .compile("vm");
-            } else {
-                cc::Build::new().file("src/vm.c").opt_level(3).compile("vm");
+                build.define("USE_COMPUTED_GOTO", "1");
             }
         }
         _ => unreachable!(),
     }
+    build.compile(name);
 }
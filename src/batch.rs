@@ -0,0 +1,464 @@
+use std::collections::HashMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::{mpsc, OnceLock};
+use std::thread;
+
+use clap::Parser;
+
+use crate::bytecode as bc;
+use crate::compile::{self, Compiled};
+use crate::error::Error;
+use crate::parse::{self, State};
+use crate::{cache, ffi, inline, lex, optimize, specialize, tape, vm};
+
+#[derive(Parser, Debug)]
+#[command(name = "tml batch", bin_name = "tml batch")]
+pub struct Arguments {
+    /// File listing one job per line: `MACHINE [TAPE|-] [MAX_MOVES]`
+    manifest: PathBuf,
+
+    /// Number of worker threads [default: number of cores]
+    #[arg(short = 'j', long = "jobs", value_parser = clap::value_parser!(u32).range(1..))]
+    jobs: Option<u32>,
+
+    /// Maximum number of moves for jobs that don't set one
+    #[arg(short = 'm', long = "max-moves")]
+    max_moves: Option<usize>,
+
+    /// Don't compute the decimal interpretation of the final tapes
+    #[arg(long = "hide-decimal")]
+    hide_decimal: bool,
+
+    /// Radix for the final decimal
+    #[arg(short = 'r', long = "decimal-radix", default_value_t = 2, value_parser = clap::value_parser!(u32).range(1..=36))]
+    decimal_radix: u32,
+
+    /// Digits in the final decimal
+    #[arg(short = 'd', long = "decimal-digits", value_parser = clap::value_parser!(u32).range(3..))]
+    decimal_digits: Option<u32>,
+
+    /// Start position for the final decimal
+    #[arg(short = 's', long = "decimal-start", default_value_t = 2)]
+    decimal_start: u32,
+
+    /// Stride for the final decimal
+    #[arg(short = 'S', long = "decimal-stride", default_value_t = 2, value_parser = clap::value_parser!(u32).range(1..))]
+    decimal_stride: u32,
+
+    /// Allow tab characters in machine and tape files
+    #[arg(long = "allow-tabs")]
+    allow_tabs: bool,
+
+    /// Use Rust VM
+    #[arg(long = "rust-vm")]
+    rust_vm: bool,
+
+    /// Instantiate parameterized states with their arguments at compile time
+    #[arg(long = "specialize")]
+    specialize: bool,
+
+    /// Maximum number of instances before falling back to closures
+    #[arg(long = "specialize-limit", default_value_t = 4096)]
+    specialize_limit: usize,
+
+    /// Optimization level for the bytecode, like `tml -O`
+    #[arg(short = 'O', long = "opt-level", default_value_t = 0, value_parser = clap::value_parser!(u8).range(0..=2))]
+    opt_level: u8,
+
+    /// Inline states that only go on to another state, like `tml --inline`
+    #[arg(long = "inline")]
+    inline: bool,
+
+    /// Keep compiled machines in this directory and reuse them when the machine, tape and compile options are the same
+    #[arg(long = "cache")]
+    cache: Option<PathBuf>,
+
+    /// Let the tapes grow to the left of the initial cell 0 instead of halting
+    #[arg(long = "bi-infinite")]
+    bi_infinite: bool,
+
+    /// Store the tapes in pages that are only allocated when written to
+    #[arg(long = "sparse-tape", conflicts_with = "rust_vm")]
+    sparse_tape: bool,
+}
+
+struct Job {
+    line: usize,
+    machine: PathBuf,
+    tape: Option<PathBuf>,
+    max_moves: usize,
+}
+
+/// Machines are only parsed once, and compiled once for each tape they run
+/// on since the tape's symbols are part of the compiled symbol table.
+struct Cache {
+    units: HashMap<PathBuf, OnceLock<Result<Vec<State>, String>>>,
+    programs: HashMap<(PathBuf, Option<PathBuf>), OnceLock<Result<Compiled, String>>>,
+}
+
+impl Cache {
+    /// Empty slots for every machine and machine and tape pair in `jobs`, so
+    /// the workers only ever fill them in.
+    fn new(jobs: &[Job]) -> Self {
+        let mut cache = Cache {
+            units: HashMap::new(),
+            programs: HashMap::new(),
+        };
+        for job in jobs {
+            cache.units.entry(job.machine.clone()).or_default();
+            cache
+                .programs
+                .entry((job.machine.clone(), job.tape.clone()))
+                .or_default();
+        }
+        cache
+    }
+}
+
+/// Runs every job in the manifest and prints one tab separated line per job,
+/// in manifest order: the line number, the number of moves, the final head
+/// position, the final state and the decimal.
+pub fn run(args: Arguments) -> Result<(), Error> {
+    let jobs = read_manifest(&args)?;
+    let cache = Cache::new(&jobs);
+
+    let workers = match args.jobs {
+        Some(jobs) => jobs as usize,
+        None => thread::available_parallelism().map_or(1, |n| n.get()),
+    };
+
+    run_jobs(&jobs, &cache, &args, workers, |job, result| {
+        println!("{}\t{result}", job.line);
+    });
+    Ok(())
+}
+
+/// Runs `jobs` on `workers` threads, and passes each result to `print` in
+/// the order of the jobs.
+fn run_jobs(
+    jobs: &[Job],
+    cache: &Cache,
+    args: &Arguments,
+    workers: usize,
+    mut print: impl FnMut(&Job, String),
+) {
+    let next_job = AtomicUsize::new(0);
+    let (sender, receiver) = mpsc::channel();
+    thread::scope(|scope| {
+        for _ in 0..workers.min(jobs.len()) {
+            let sender = sender.clone();
+            let next_job = &next_job;
+            scope.spawn(move || loop {
+                let index = next_job.fetch_add(1, Ordering::Relaxed);
+                let Some(job) = jobs.get(index) else {
+                    break;
+                };
+                let result = match run_job(job, cache, args) {
+                    Ok(result) => result,
+                    Err(error) => format!("error: {error}"),
+                };
+                if sender.send((index, result)).is_err() {
+                    break;
+                }
+            });
+        }
+        drop(sender);
+
+        // results arrive in any order, but are printed in manifest order
+        let mut pending = HashMap::new();
+        let mut printed = 0;
+        for (index, result) in receiver {
+            pending.insert(index, result);
+            while let Some(result) = pending.remove(&printed) {
+                print(&jobs[printed], result);
+                printed += 1;
+            }
+        }
+    });
+}
+
+fn read_manifest(args: &Arguments) -> Result<Vec<Job>, Error> {
+    let path = &args.manifest;
+    let Ok(manifest) = fs::read_to_string(path) else {
+        return Err(Error::new(
+            format!("couldn't read file {}", path.display()),
+            None,
+        ));
+    };
+    let dir = path.parent().unwrap_or(Path::new(""));
+
+    let mut jobs = Vec::new();
+    for (i, line) in manifest.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() || line.starts_with('#') {
+            continue;
+        }
+
+        let invalid = |msg: &str| Error::new(format!("{}:{}: {msg}", path.display(), i + 1), None);
+
+        let fields: Vec<_> = line.split_whitespace().collect();
+        if fields.len() > 3 {
+            return Err(invalid("expected `MACHINE [TAPE|-] [MAX_MOVES]`"));
+        }
+
+        let tape = match fields.get(1) {
+            Some(&"-") | None => None,
+            Some(tape) => Some(dir.join(tape)),
+        };
+        let max_moves = match fields.get(2) {
+            Some(&"-") | None => args.max_moves.unwrap_or(usize::MAX),
+            Some(max_moves) => max_moves
+                .parse()
+                .map_err(|_| invalid(&format!("invalid number of moves `{max_moves}`")))?,
+        };
+
+        jobs.push(Job {
+            line: i + 1,
+            machine: dir.join(fields[0]),
+            tape,
+            max_moves,
+        });
+    }
+
+    Ok(jobs)
+}
+
+fn run_job(job: &Job, cache: &Cache, args: &Arguments) -> Result<String, String> {
+    let key = (job.machine.clone(), job.tape.clone());
+    let compiled = cache.programs[&key]
+        .get_or_init(|| compile_job(job, cache, args).map_err(|error| error.to_string()))
+        .as_ref()?;
+
+    let simulated = if args.rust_vm {
+        vm::simulate(
+            &compiled.bytes,
+            compiled.tape.clone(),
+            job.max_moves,
+            args.bi_infinite,
+        )
+    } else {
+        ffi::simulate(
+            &compiled.bytes,
+            &compiled.tape,
+            compiled.symbols.len(),
+            job.max_moves,
+            args.bi_infinite,
+            args.sparse_tape,
+        )
+    };
+
+    let state = if simulated.final_address == bc::HALT_ADDRESS {
+        "!"
+    } else {
+        compiled.states[&simulated.final_address].as_str()
+    };
+
+    let decimal = if args.hide_decimal {
+        "-".to_string()
+    } else {
+        tape::parse_decimal(
+            simulated.tape.symbols(simulated.origin, &compiled.symbols),
+            args.decimal_radix as usize,
+            args.decimal_digits.map(|d| d as usize),
+            args.decimal_start as usize,
+            args.decimal_stride as usize,
+        )
+        .to_string()
+    };
+
+    Ok(format!(
+        "{}\t{}\t{state}\t{decimal}",
+        simulated.moves, simulated.head_position
+    ))
+}
+
+fn compile_job(job: &Job, cache: &Cache, args: &Arguments) -> Result<Compiled, Error> {
+    let entry = if let Some(dir) = &args.cache {
+        let specialize = args.specialize.then_some(args.specialize_limit);
+        let tape = job.tape.as_deref();
+        let entry = cache::Entry::new(
+            dir,
+            &job.machine,
+            tape,
+            args.allow_tabs,
+            specialize,
+            args.opt_level,
+            args.inline,
+        )?;
+        if let Some(compiled) = entry.load() {
+            return Ok(compiled);
+        }
+        Some(entry)
+    } else {
+        None
+    };
+
+    let mut unit = cache.units[&job.machine]
+        .get_or_init(|| {
+            let tokens = lex::Tokens::from_path_buf(job.machine.clone(), args.allow_tabs);
+            tokens
+                .and_then(parse::parse)
+                .map_err(|error| error.to_string())
+        })
+        .clone()
+        .map_err(|msg| Error::new(msg, None))?;
+
+    let initial = match &job.tape {
+        Some(path) => Some(tape::Initial::read(path.clone(), args.allow_tabs)?),
+        None => None,
+    };
+    let alphabet = initial.as_ref().map_or(&[][..], |initial| &initial.symbols);
+
+    if args.inline {
+        inline::inline(&mut unit);
+    }
+    let mut compiled = if args.specialize {
+        specialize::compile(unit, alphabet, args.specialize_limit)?
+    } else {
+        compile::compile(unit, alphabet)?
+    };
+    if let Some(initial) = &initial {
+        compiled.tape = initial.cells(&compiled)?;
+    }
+    optimize::optimize(&mut compiled, args.opt_level);
+    if let Some(entry) = &entry {
+        entry.store(&compiled)?;
+    }
+    Ok(compiled)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::testing::TempDir;
+
+    fn batch(manifest: &Path, flags: &[&str]) -> Arguments {
+        let args = ["tml batch", manifest.to_str().unwrap()];
+        Arguments::parse_from(args.iter().chain(flags))
+    }
+
+    /// Runs the jobs in `manifest` on `workers` threads, like `tml batch`.
+    fn run(manifest: &Path, workers: usize, flags: &[&str]) -> Vec<String> {
+        let args = batch(manifest, flags);
+        let jobs = read_manifest(&args).unwrap();
+        let mut lines = Vec::new();
+        run_jobs(&jobs, &Cache::new(&jobs), &args, workers, |job, result| {
+            lines.push(format!("{}\t{result}", job.line));
+        });
+        lines
+    }
+
+    #[test]
+    fn reads_jobs_relative_to_the_manifest() {
+        let dir = TempDir::new("batch-manifest");
+        let manifest = dir.write(
+            "manifest",
+            "# machine, tape, moves\n\na.tml a.tape 2\n  b.tml -\nb.tml a.tape -\n",
+        );
+        let jobs = read_manifest(&batch(&manifest, &["-m", "50"])).unwrap();
+        let jobs: Vec<_> = jobs
+            .iter()
+            .map(|job| {
+                (
+                    job.line,
+                    job.machine.clone(),
+                    job.tape.clone(),
+                    job.max_moves,
+                )
+            })
+            .collect();
+        let (a, b, tape) = (
+            dir.0.join("a.tml"),
+            dir.0.join("b.tml"),
+            dir.0.join("a.tape"),
+        );
+        assert_eq!(
+            jobs,
+            [
+                (3, a, Some(tape.clone()), 2),
+                (4, b.clone(), None, 50),
+                (5, b, Some(tape), 50),
+            ]
+        );
+
+        // without -m, jobs run until they halt
+        let jobs = read_manifest(&batch(&manifest, &[])).unwrap();
+        assert_eq!(jobs[1].max_moves, usize::MAX);
+
+        for (line, msg) in [
+            (
+                "a.tml a.tape 2 3",
+                "expected `MACHINE [TAPE|-] [MAX_MOVES]`",
+            ),
+            ("a.tml - -2", "invalid number of moves `-2`"),
+        ] {
+            fs::write(&manifest, format!("# {line}\n{line}\n")).unwrap();
+            let error = read_manifest(&batch(&manifest, &[])).err().unwrap();
+            assert_eq!(
+                error.to_string(),
+                format!("{}:2: {msg}", manifest.display())
+            );
+        }
+    }
+
+    #[test]
+    fn prints_results_in_manifest_order() {
+        let dir = TempDir::new("batch-order");
+        dir.write("loop.tml", "start {\n    _ | | start,\n}\n");
+        dir.write("halt.tml", "start {\n    _ | > | !,\n}\n");
+        // the first job takes far longer than the ones after it, and the
+        // missing machine doesn't stop the others
+        let manifest = dir.write(
+            "manifest",
+            "loop.tml - 3000000\nhalt.tml\nmissing.tml\nhalt.tml - 0\nloop.tml - 1\n",
+        );
+        let missing = dir.0.join("missing.tml");
+        let expected = [
+            "1\t3000000\t0\tstart\t-".to_string(),
+            "2\t1\t1\t!\t-".to_string(),
+            format!("3\terror: couldn't read file {}", missing.display()),
+            "4\t0\t0\tstart\t-".to_string(),
+            "5\t1\t0\tstart\t-".to_string(),
+        ];
+        for workers in [1, 4] {
+            assert_eq!(run(&manifest, workers, &["--hide-decimal"]), expected);
+        }
+    }
+
+    #[test]
+    fn compiles_machines_for_each_tape() {
+        // the machine doesn't mention the symbols on either tape, so they are
+        // only in the symbol table it was compiled with for that tape
+        let dir = TempDir::new("batch-tapes");
+        dir.write(
+            "copy.tml",
+            "start {\n    '' | | !,\n    _  | > | start,\n}\n",
+        );
+        dir.write("a.tape", "'a' 'a'");
+        dir.write("b.tape", "'b'");
+        dir.write("broken.tml", "start {\n    _ | | nowhere,\n}\n");
+        let manifest = dir.write(
+            "manifest",
+            "copy.tml a.tape\ncopy.tml b.tape\ncopy.tml a.tape\nbroken.tml\nbroken.tml a.tape\n",
+        );
+        let lines = run(&manifest, 3, &["-r", "16", "-s", "0", "-S", "1", "-d", "3"]);
+        // 0xaa / 0x100 and 0xb / 0x10
+        assert_eq!(
+            lines[..3],
+            [
+                "1\t3\t2\t!\t0.664",
+                "2\t2\t1\t!\t0.687",
+                "3\t3\t2\t!\t0.664"
+            ]
+        );
+        // both jobs on the machine that doesn't compile report why
+        for line in &lines[3..] {
+            assert!(
+                line.contains("\terror: no function with signature `nowhere`"),
+                "{line}"
+            );
+        }
+    }
+}
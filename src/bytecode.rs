@@ -1,3 +1,5 @@
+use std::collections::HashMap;
+
 use termion::{color, style};
 
 pub const LEFT: u8 = 0;
@@ -22,14 +24,102 @@ pub const COMPARE_ARG: u8 = 16;
 pub const COMPARE_VAL: u8 = 17;
 pub const OTHER: u8 = 18;
 pub const HALT: u8 = 19;
+pub const DISPATCH_TABLE: u8 = 20;
+pub const SCAN_LEFT_WHILE: u8 = 21;
+pub const SCAN_RIGHT_WHILE: u8 = 22;
+pub const SCAN_LEFT_UNTIL: u8 = 23;
+pub const SCAN_RIGHT_UNTIL: u8 = 24;
+/// Comes after the ops of an arm with `--inline` states inlined into it, with
+/// their number and how far to skip to where the arm went before inlining.
+/// The skip is taken if the inlined moves would pass the move limit
+pub const INLINED: u8 = 25;
 
 pub const HALT_ADDRESS: u32 = 6;
+pub const NO_ARM: u16 = u16::MAX;
+
+/// The length of the encoded instruction at `ip`.
+pub fn encoded_len(bytes: &[u8], ip: usize) -> usize {
+    let u16_at = |ip: usize| u16::from_le_bytes([bytes[ip], bytes[ip + 1]]) as usize;
+
+    match bytes[ip] {
+        LEFT_N | RIGHT_N => 2,
+        WRITE_ARG | SYMBOL_ARG | TAKE_ARG | CLONE_ARG | FREE_ARG | FINAL_ARG => 2,
+        WRITE_VAL | SYMBOL_VAL => 3,
+        COMPARE_ARG | INLINED => 4,
+        COMPARE_VAL | FINAL_STATE => 5,
+        MAKE_STATE => 6,
+        DISPATCH_TABLE => 7 + 2 * u16_at(ip + 3),
+        SCAN_LEFT_WHILE | SCAN_RIGHT_WHILE | SCAN_LEFT_UNTIL | SCAN_RIGHT_UNTIL => {
+            5 + 2 * u16_at(ip + 3)
+        }
+        _ => 1,
+    }
+}
+
+/// The furthest the head can get from where it was between two moves during
+/// one move of the machine in `bytes`.
+pub fn reach(bytes: &[u8]) -> usize {
+    let mut reach = 0;
+    let mut moved = 0;
+    let mut ip = HALT_ADDRESS as usize + 1;
+    while ip < bytes.len() {
+        let op = bytes[ip];
+        match op {
+            LEFT | RIGHT => moved += 1,
+            LEFT_N | RIGHT_N => moved += bytes[ip + 1] as usize,
+            SCAN_LEFT_WHILE | SCAN_RIGHT_WHILE | SCAN_LEFT_UNTIL | SCAN_RIGHT_UNTIL => {
+                // every step of a scan is a move of its own
+                reach = reach.max(u16::from_le_bytes([bytes[ip + 1], bytes[ip + 2]]) as usize);
+            }
+            _ => {}
+        }
+        ip += encoded_len(bytes, ip);
+
+        reach = reach.max(moved);
+        if op == FINAL_STATE || op == FINAL_ARG {
+            moved = 0;
+        }
+    }
+    reach
+}
+
+/// The number of state and symbol arguments of every state the machine in
+/// `bytes` can be in, by address. These are how many arguments the code that
+/// goes to a state pushes, and the start state and halting have none.
+pub fn arities(bytes: &[u8]) -> HashMap<u32, (usize, usize)> {
+    let u32_at = |ip: usize| u32::from_le_bytes(bytes[ip..ip + 4].try_into().unwrap());
+
+    let mut arities = HashMap::from([(u32_at(2), (0, 0)), (HALT_ADDRESS, (0, 0))]);
+    let (mut states, mut symbols) = (0, 0);
+    let mut ip = HALT_ADDRESS as usize + 1;
+    while ip < bytes.len() {
+        match bytes[ip] {
+            SYMBOL_ARG | SYMBOL_VAL | SYMBOL_BOUND => symbols += 1,
+            TAKE_ARG | CLONE_ARG => states += 1,
+            MAKE_STATE => {
+                let count = bytes[ip + 1] as usize;
+                arities.insert(u32_at(ip + 2), (count, symbols));
+                states = states - count + 1;
+                symbols = 0;
+            }
+            FINAL_STATE => {
+                arities.insert(u32_at(ip + 1), (states, symbols));
+                (states, symbols) = (0, 0);
+            }
+            FINAL_ARG => (states, symbols) = (0, 0),
+            _ => {}
+        }
+        ip += encoded_len(bytes, ip);
+    }
+    arities
+}
 
 pub fn dump(bytes: &mut dyn Iterator<Item = u8>, no_color: bool) {
     let mut dumper = Dumper {
         bytes,
         no_color,
         address: 0,
+        table_arms: 0,
     };
 
     dumper.dump();
@@ -39,6 +129,7 @@ struct Dumper<'a> {
     bytes: &'a mut dyn Iterator<Item = u8>,
     address: u32,
     no_color: bool,
+    table_arms: u16,
 }
 
 macro_rules! text {
@@ -139,7 +230,12 @@ impl Dumper<'_> {
             );
         }
 
-        let arm_kind = self.pattern();
+        let arm_kind = if self.table_arms > 0 {
+            self.table_arms -= 1;
+            ArmKind::Table
+        } else {
+            self.pattern()
+        };
         if arm_kind == ArmKind::Halt {
             return false;
         }
@@ -147,6 +243,8 @@ impl Dumper<'_> {
         textln!(self, "instructions:", Blue);
 
         let mut seen_state = false;
+        // an arm with inlined states also has the state it went to before
+        let mut finals = 1;
         macro_rules! state_instr {
             () => {
                 #[allow(unused_assignments)]
@@ -229,17 +327,28 @@ impl Dumper<'_> {
                         self.next_u32()
                     );
                 }
-                FINAL_STATE => {
+                INLINED => {
                     state_instr!();
-                    text!(self, "    FINAL_STATE", Green);
-                    println!(" (addr: {:#010x})", self.next_u32());
-                    return arm_kind != ArmKind::Other;
+                    text!(self, "    INLINED", Green);
+                    println!(" (n: {}) (skip: {})", self.next_u8(), self.next_u16());
+                    finals += 1;
                 }
-                FINAL_ARG => {
+                op @ (FINAL_STATE | FINAL_ARG) => {
                     state_instr!();
-                    text!(self, "    FINAL_ARG", Green);
-                    println!(" (arg: {})", self.next_u8());
-                    return arm_kind != ArmKind::Other;
+                    if op == FINAL_STATE {
+                        text!(self, "    FINAL_STATE", Green);
+                        println!(" (addr: {:#010x})", self.next_u32());
+                    } else {
+                        text!(self, "    FINAL_ARG", Green);
+                        println!(" (arg: {})", self.next_u8());
+                    }
+                    finals -= 1;
+                    if finals == 0 {
+                        return self.has_next_arm(arm_kind);
+                    }
+                    // the next instruction starts the state from before
+                    // inlining
+                    seen_state = false;
                 }
 
                 _ => panic!("invalid bytecode"),
@@ -267,10 +376,54 @@ impl Dumper<'_> {
                 textln!(self, "    HALT", Green);
                 ArmKind::Halt
             }
+            DISPATCH_TABLE => {
+                let arms = self.next_u16();
+                let len = self.next_u16();
+                let default = self.next_u16();
+                text!(self, "    DISPATCH_TABLE", Green);
+                if default == NO_ARM {
+                    println!(" (arms: {arms}) (len: {len}) (default: halt)");
+                } else {
+                    println!(" (arms: {arms}) (len: {len}) (default: {default})");
+                }
+                for value in 0..len {
+                    let offset = self.next_u16();
+                    if offset != default {
+                        println!("        (value: {value}) (offset: {offset})");
+                    }
+                }
+                self.table_arms = arms - 1;
+                ArmKind::Table
+            }
+            op @ (SCAN_LEFT_WHILE | SCAN_RIGHT_WHILE | SCAN_LEFT_UNTIL | SCAN_RIGHT_UNTIL) => {
+                let name = match op {
+                    SCAN_LEFT_WHILE => "    SCAN_LEFT_WHILE",
+                    SCAN_RIGHT_WHILE => "    SCAN_RIGHT_WHILE",
+                    SCAN_LEFT_UNTIL => "    SCAN_LEFT_UNTIL",
+                    _ => "    SCAN_RIGHT_UNTIL",
+                };
+                text!(self, name, Green);
+                let stride = self.next_u16();
+                let count = self.next_u16();
+                print!(" (stride: {stride}) (symbols:");
+                for _ in 0..count {
+                    print!(" {}", self.next_u16());
+                }
+                println!(")");
+                self.pattern()
+            }
             _ => panic!("invalid bytecode"),
         }
     }
 
+    fn has_next_arm(&self, arm_kind: ArmKind) -> bool {
+        match arm_kind {
+            ArmKind::Continue => true,
+            ArmKind::Table => self.table_arms > 0,
+            ArmKind::Other | ArmKind::Halt => false,
+        }
+    }
+
     fn next_u8(&mut self) -> u8 {
         self.address += 1;
         self.bytes.next().expect("invalid bytecode")
@@ -290,9 +443,10 @@ impl Dumper<'_> {
     }
 }
 
-#[derive(PartialEq)]
+#[derive(PartialEq, Clone, Copy)]
 enum ArmKind {
     Continue,
     Other,
     Halt,
+    Table,
 }
@@ -0,0 +1,384 @@
+use std::collections::HashMap;
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use crate::compile::Compiled;
+use crate::error::Error;
+use crate::lex::Span;
+
+const MAGIC: &[u8; 4] = b"TMLB";
+const VERSION: u32 = 2;
+
+/// A compiled machine cached in `--cache`. All integers are stored little
+/// endian:
+///
+/// ```text
+/// "TMLB" (u32 version) (u64 key) (u64 bytecode len) (bytecode)
+/// (u32 symbol count) string* (u32 state count) state*
+/// (u32 arm count) arm* (u64 tape len) (tape len x u16 symbol)
+/// (u64 checksum)
+///
+/// string: (u32 len) (len x u8 UTF-8)
+/// state:  (u32 address) string
+/// arm:    (u32 address) (u32 line) (u32 column) (u32 prefix len)
+///         (u32 text len)
+/// ```
+///
+/// Arm spans are stored as the byte lengths of their prefix and text on
+/// their line of the machine file, since the file is read anyway to find
+/// the key. The checksum is the FNV-1a hash of everything before it, since
+/// the VMs trust the bytecode they run.
+pub struct Entry {
+    path: PathBuf,
+    key: u64,
+    machine: &'static Path,
+    source: &'static str,
+}
+
+/// FNV-1a, like `checkpoint::hash()`.
+struct Hasher(u64);
+
+impl Hasher {
+    fn new() -> Self {
+        Hasher(0xcbf29ce484222325)
+    }
+
+    fn add(&mut self, bytes: &[u8]) {
+        for &byte in bytes {
+            self.0 = (self.0 ^ byte as u64).wrapping_mul(0x100000001b3);
+        }
+    }
+}
+
+impl Entry {
+    /// Finds the entry in the directory `dir` for compiling `machine` with
+    /// the symbols in `tape`. The key covers both files, the compile options
+    /// (`specialize` is the `--specialize-limit` with `--specialize`,
+    /// `opt_level` the `-O` level and `inline` is `--inline`) and the `tml`
+    /// executable, so entries written by another build are never used.
+    pub fn new(
+        dir: &Path,
+        machine: &Path,
+        tape: Option<&Path>,
+        allow_tabs: bool,
+        specialize: Option<usize>,
+        opt_level: u8,
+        inline: bool,
+    ) -> Result<Self, Error> {
+        let read = |path: &Path| {
+            fs::read(path)
+                .map_err(|_| Error::new(format!("couldn't read file {}", path.display()), None))
+        };
+
+        let source = read(machine)?;
+        let mut hasher = Hasher::new();
+        hasher.add(MAGIC);
+        hasher.add(&VERSION.to_le_bytes());
+        hasher.add(&(source.len() as u64).to_le_bytes());
+        hasher.add(&source);
+        match tape {
+            Some(tape) => {
+                let tape = read(tape)?;
+                hasher.add(&(tape.len() as u64).to_le_bytes());
+                hasher.add(&tape);
+            }
+            None => hasher.add(&u64::MAX.to_le_bytes()),
+        }
+        hasher.add(&[allow_tabs as u8]);
+        let limit = specialize.map_or(u64::MAX, |limit| limit as u64);
+        hasher.add(&limit.to_le_bytes());
+        hasher.add(&[opt_level, inline as u8]);
+        if let Ok(metadata) = std::env::current_exe().and_then(fs::metadata) {
+            hasher.add(&metadata.len().to_le_bytes());
+            if let Ok(time) = metadata.modified() {
+                hasher.add(format!("{time:?}").as_bytes());
+            }
+        }
+
+        let key = hasher.0;
+        // invalid UTF-8 is reported by the lexer, and such a file is never
+        // compiled, so it's never loaded either
+        let source = String::from_utf8(source).unwrap_or_default();
+        Ok(Entry {
+            path: dir.join(format!("{key:016x}.tmlb")),
+            key,
+            machine: Box::leak(Box::new(machine.to_path_buf())),
+            source: Box::leak(source.into_boxed_str()),
+        })
+    }
+
+    /// Reads the cached machine, if there is a valid one.
+    pub fn load(&self) -> Option<Compiled> {
+        let bytes = fs::read(&self.path).ok()?;
+        let (bytes, checksum) = bytes.split_at(bytes.len().checked_sub(8)?);
+        let mut hasher = Hasher::new();
+        hasher.add(bytes);
+        if checksum != hasher.0.to_le_bytes() {
+            return None;
+        }
+
+        let lines: Vec<_> = self.source.lines().collect();
+        Reader { bytes }.compiled(self, &lines)
+    }
+
+    /// Writes `compiled` to the cache. Like checkpoints, the entry only
+    /// replaces an existing one once it has been written in full.
+    pub fn store(&self, compiled: &Compiled) -> Result<(), Error> {
+        let mut bytes = Vec::with_capacity(64 + compiled.bytes.len() + 2 * compiled.tape.len());
+        bytes.extend(MAGIC);
+        bytes.extend(VERSION.to_le_bytes());
+        bytes.extend(self.key.to_le_bytes());
+        bytes.extend((compiled.bytes.len() as u64).to_le_bytes());
+        bytes.extend(&compiled.bytes);
+
+        let string = |bytes: &mut Vec<u8>, string: &str| {
+            bytes.extend((string.len() as u32).to_le_bytes());
+            bytes.extend(string.as_bytes());
+        };
+        bytes.extend((compiled.symbols.len() as u32).to_le_bytes());
+        for symbol in &compiled.symbols {
+            string(&mut bytes, symbol);
+        }
+        bytes.extend((compiled.states.len() as u32).to_le_bytes());
+        for (&address, name) in &compiled.states {
+            bytes.extend(address.to_le_bytes());
+            string(&mut bytes, name);
+        }
+        bytes.extend((compiled.arms.len() as u32).to_le_bytes());
+        for (&address, span) in &compiled.arms {
+            bytes.extend(address.to_le_bytes());
+            bytes.extend((span.line as u32).to_le_bytes());
+            bytes.extend((span.column as u32).to_le_bytes());
+            bytes.extend((span.prefix.len() as u32).to_le_bytes());
+            bytes.extend((span.text.len() as u32).to_le_bytes());
+        }
+        bytes.extend((compiled.tape.len() as u64).to_le_bytes());
+        for symbol in &compiled.tape {
+            bytes.extend(symbol.to_le_bytes());
+        }
+        let mut hasher = Hasher::new();
+        hasher.add(&bytes);
+        bytes.extend(hasher.0.to_le_bytes());
+
+        // batch jobs in other processes can write the same entry at once
+        let mut temp = self.path.as_os_str().to_owned();
+        temp.push(format!(".{}.tmp", std::process::id()));
+        fs::write(&temp, bytes)
+            .and_then(|_| fs::rename(&temp, &self.path))
+            .map_err(|_| Error::new(format!("couldn't write file {}", self.path.display()), None))
+    }
+}
+
+struct Reader<'a> {
+    bytes: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn compiled(&mut self, entry: &Entry, lines: &[&'static str]) -> Option<Compiled> {
+        if self.take(4)? != MAGIC || self.u32()? != VERSION || self.u64()? != entry.key {
+            return None;
+        }
+
+        let len = self.u64()?.try_into().ok()?;
+        let bytecode = self.take(len)?.to_vec();
+
+        let symbols: Vec<_> = (0..self.u32()?)
+            .map(|_| self.string())
+            .collect::<Option<_>>()?;
+        let state_count = self.u32()?;
+        let mut states = HashMap::with_capacity((state_count as usize).min(self.bytes.len()));
+        for _ in 0..state_count {
+            states.insert(self.u32()?, self.string()?);
+        }
+
+        let arm_count = self.u32()?;
+        let mut arms = HashMap::with_capacity((arm_count as usize).min(self.bytes.len()));
+        for _ in 0..arm_count {
+            let address = self.u32()?;
+            let line: usize = self.u32()?.try_into().ok()?;
+            let column = self.u32()?.try_into().ok()?;
+            let prefix_len: usize = self.u32()?.try_into().ok()?;
+            let text_len: usize = self.u32()?.try_into().ok()?;
+
+            // the source is the same as when the entry was written, so this
+            // only fails for corrupted entries
+            let code = *lines.get(line)?;
+            let end = prefix_len.checked_add(text_len)?;
+            let span = Span {
+                text: code.get(prefix_len..end)?,
+                prefix: code.get(..prefix_len)?,
+                suffix: code.get(end..)?,
+                line,
+                column,
+                path: entry.machine,
+            };
+            arms.insert(address, span);
+        }
+
+        let tape_len: usize = self.u64()?.try_into().ok()?;
+        let tape: Vec<_> = self
+            .take(tape_len.checked_mul(2)?)?
+            .chunks(2)
+            .map(|bytes| u16::from_le_bytes([bytes[0], bytes[1]]))
+            .collect();
+
+        let in_bytecode = |&address: &u32| (address as usize) < bytecode.len();
+        let valid = self.bytes.is_empty()
+            && states.keys().all(in_bytecode)
+            && arms.keys().all(in_bytecode)
+            && tape.iter().all(|&symbol| (symbol as usize) < symbols.len());
+        valid.then_some(Compiled {
+            bytes: bytecode,
+            symbols,
+            states,
+            arms,
+            tape,
+        })
+    }
+
+    fn string(&mut self) -> Option<String> {
+        let len = self.u32()?.try_into().ok()?;
+        String::from_utf8(self.take(len)?.to_vec()).ok()
+    }
+
+    fn take(&mut self, n: usize) -> Option<&'a [u8]> {
+        if self.bytes.len() < n {
+            return None;
+        }
+        let (taken, rest) = self.bytes.split_at(n);
+        self.bytes = rest;
+        Some(taken)
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::testing::{self, TempDir};
+
+    /// Rewrites the entry at `path` with `bytes` and a valid checksum.
+    fn rewrite(path: &Path, mut bytes: Vec<u8>) {
+        let mut hasher = Hasher::new();
+        hasher.add(&bytes);
+        bytes.extend(hasher.0.to_le_bytes());
+        fs::write(path, bytes).unwrap();
+    }
+
+    #[test]
+    fn loads_the_arms_at_their_place_in_the_machine() {
+        let machine = "start {\n    'a' | '1' > | start,   '' | | done(; 'a'),\n}\n\
+                       done(; x) {\n    _ | x | !,\n}\n";
+        let dir = TempDir::new("cache-arms");
+        let path = dir.write("machine.tml", machine);
+        let entry = Entry::new(&dir.0, &path, None, false, None, 0, false).unwrap();
+        assert!(entry.load().is_none());
+
+        let compiled = testing::compile(machine, "'a' 'a'");
+        entry.store(&compiled).unwrap();
+        let loaded = entry.load().unwrap();
+        assert_eq!(loaded.bytes, compiled.bytes);
+        assert_eq!(loaded.symbols, compiled.symbols);
+        assert_eq!(loaded.states, compiled.states);
+        assert_eq!(loaded.tape, compiled.tape);
+        assert_eq!(loaded.arms.len(), compiled.arms.len());
+        for (address, span) in &loaded.arms {
+            let compiled = compiled.arms[address];
+            let parts = |span: &Span| (span.prefix, span.text, span.suffix, span.line, span.column);
+            assert_eq!(parts(span), parts(&compiled));
+            assert_eq!(span.path, path);
+        }
+    }
+
+    #[test]
+    fn keys_every_input_of_the_compiler() {
+        let dir = TempDir::new("cache-keys");
+        let machine = dir.write("machine.tml", "start { _ | '1' | ! }");
+        let empty = dir.write("empty.tape", "");
+        let tape = dir.write("x.tape", "'x'");
+        let entries = [
+            Entry::new(&dir.0, &machine, None, false, None, 0, false),
+            Entry::new(&dir.0, &machine, Some(&empty), false, None, 0, false),
+            Entry::new(&dir.0, &machine, Some(&tape), false, None, 0, false),
+            Entry::new(&dir.0, &machine, None, true, None, 0, false),
+            Entry::new(&dir.0, &machine, None, false, Some(0), 0, false),
+            Entry::new(&dir.0, &machine, None, false, Some(4096), 0, false),
+            Entry::new(&dir.0, &machine, None, false, None, 1, false),
+            Entry::new(&dir.0, &machine, None, false, None, 0, true),
+        ]
+        .map(Result::unwrap);
+        for (i, entry) in entries.iter().enumerate() {
+            for other in &entries[i + 1..] {
+                assert_ne!(entry.path, other.path);
+            }
+        }
+
+        // an entry copied to another key isn't used for it
+        entries[0]
+            .store(&testing::compile("start { _ | '1' | ! }", ""))
+            .unwrap();
+        assert!(entries[0].load().is_some());
+        fs::copy(&entries[0].path, &entries[1].path).unwrap();
+        assert!(entries[1].load().is_none());
+
+        let error = Entry::new(
+            &dir.0,
+            &dir.0.join("missing.tml"),
+            None,
+            false,
+            None,
+            0,
+            false,
+        );
+        assert!(error.is_err());
+    }
+
+    #[test]
+    fn rejects_damaged_entries() {
+        let machine = "start { 'x' | '1' > | start, _ | | ! }";
+        let dir = TempDir::new("cache-damaged");
+        let path = dir.write("machine.tml", machine);
+        let entry = Entry::new(&dir.0, &path, None, false, None, 0, false).unwrap();
+        let compiled = testing::compile(machine, "'x' 'x'");
+        entry.store(&compiled).unwrap();
+        let bytes = fs::read(&entry.path).unwrap();
+
+        for len in [0, 7, 8, 24, bytes.len() - 1] {
+            fs::write(&entry.path, &bytes[..len]).unwrap();
+            assert!(entry.load().is_none(), "{len} bytes");
+        }
+        for i in [0, 30, bytes.len() - 1] {
+            let mut flipped = bytes.clone();
+            flipped[i] ^= 1;
+            fs::write(&entry.path, flipped).unwrap();
+            assert!(entry.load().is_none(), "byte {i} flipped");
+        }
+
+        // with valid checksums, but pointing outside the machine
+        let contents = bytes[..bytes.len() - 8].to_vec();
+        rewrite(&entry.path, contents.clone());
+        assert!(entry.load().is_some());
+        let symbols: usize = compiled.symbols.iter().map(|s| 4 + s.len()).sum();
+        let state = 24 + compiled.bytes.len() + 4 + symbols + 4;
+        let mut corrupted = contents.clone();
+        corrupted[state..state + 4].copy_from_slice(&u32::MAX.to_le_bytes());
+        rewrite(&entry.path, corrupted);
+        assert!(entry.load().is_none());
+        let mut corrupted = contents.clone();
+        let cell = corrupted.len() - 2;
+        corrupted[cell..].copy_from_slice(&u16::MAX.to_le_bytes());
+        rewrite(&entry.path, corrupted);
+        assert!(entry.load().is_none());
+        let mut extended = contents;
+        extended.push(0);
+        rewrite(&entry.path, extended);
+        assert!(entry.load().is_none());
+    }
+}
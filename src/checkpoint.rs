@@ -0,0 +1,547 @@
+use std::collections::HashMap;
+use std::fs;
+use std::path::Path;
+
+use crate::bytecode as bc;
+use crate::compile::Compiled;
+use crate::error::Error;
+
+const MAGIC: &[u8; 4] = b"TMLC";
+const VERSION: u32 = 3;
+
+/// A machine between two moves. All integers are stored little endian:
+///
+/// ```text
+/// "TMLC" (u32 version) (u64 hash) (u64 moves) (u64 inlined moves)
+/// (u8 halted) (u64 head) (u64 origin) (u8 bi-infinite) (u64 tape len)
+/// (tape len x u16 symbol) (u32 state count) state*
+///
+/// state: (u32 address) (u8 child count) (u8 symbol count)
+///        (child count x u32 index) (symbol count x u16 symbol)
+/// ```
+///
+/// States are stored children first, so every index refers to an earlier
+/// state, and shared states are only stored once. The last state is the
+/// current one. The head and the origin (the initial cell 0) are indices into
+/// the tape, which is stored with blanks up to both.
+pub struct Checkpoint {
+    pub hash: u64,
+    pub moves: usize,
+    /// The moves of inlined states among `moves`, see `Simulated::inlined`
+    pub inlined: usize,
+    pub halted: bool,
+    pub head_position: usize,
+    pub origin: usize,
+    pub bi_infinite: bool,
+    pub tape: Vec<u16>,
+    pub states: Vec<Node>,
+}
+
+pub struct Node {
+    pub address: u32,
+    pub states: Vec<u32>,
+    pub symbols: Vec<u16>,
+}
+
+/// Identifies the bytecode and symbol table a checkpoint belongs to.
+pub fn hash(compiled: &Compiled) -> u64 {
+    let mut hash = 0xcbf29ce484222325;
+    let mut add = |byte: u8| hash = (hash ^ byte as u64).wrapping_mul(0x100000001b3);
+
+    compiled.bytes.iter().copied().for_each(&mut add);
+    for symbol in &compiled.symbols {
+        symbol.bytes().for_each(&mut add);
+        add(0xff);
+    }
+    hash
+}
+
+/// Flattens the state DAG below `root` into nodes, children first. `key`
+/// identifies shared states and `node` returns a state's address, children
+/// and symbols.
+pub fn flatten<T: Copy>(
+    root: (u32, Vec<T>, Vec<u16>),
+    key: impl Fn(T) -> usize,
+    node: impl Fn(T) -> (u32, Vec<T>, Vec<u16>),
+) -> Vec<Node> {
+    let mut indices = HashMap::new();
+    let mut nodes = Vec::new();
+
+    // walk the DAG without recursion, since states can be nested very deeply
+    let mut stack: Vec<_> = root.1.iter().map(|&state| (state, false)).collect();
+    while let Some((state, expanded)) = stack.pop() {
+        if indices.contains_key(&key(state)) {
+            continue;
+        }
+
+        let (address, states, symbols) = node(state);
+        if expanded {
+            indices.insert(key(state), nodes.len() as u32);
+            nodes.push(Node {
+                address,
+                states: states.iter().map(|&child| indices[&key(child)]).collect(),
+                symbols,
+            });
+        } else {
+            stack.push((state, true));
+            stack.extend(states.iter().map(|&child| (child, false)));
+        }
+    }
+
+    let (address, states, symbols) = root;
+    nodes.push(Node {
+        address,
+        states: states.iter().map(|&child| indices[&key(child)]).collect(),
+        symbols,
+    });
+    nodes
+}
+
+impl Checkpoint {
+    pub fn read(path: &Path) -> Result<Self, Error> {
+        let Ok(bytes) = fs::read(path) else {
+            return Err(Error::new(
+                format!("couldn't read file {}", path.display()),
+                None,
+            ));
+        };
+
+        Reader { bytes: &bytes }
+            .checkpoint()
+            .ok_or_else(|| Error::new(format!("invalid checkpoint {}", path.display()), None))
+    }
+
+    /// Replaces `path` only once the whole checkpoint has been written, so a
+    /// crash never leaves a truncated checkpoint behind.
+    pub fn write(&self, path: &Path) -> Result<(), Error> {
+        let mut bytes = Vec::with_capacity(64 + 2 * self.tape.len());
+        bytes.extend(MAGIC);
+        bytes.extend(VERSION.to_le_bytes());
+        bytes.extend(self.hash.to_le_bytes());
+        bytes.extend((self.moves as u64).to_le_bytes());
+        bytes.extend((self.inlined as u64).to_le_bytes());
+        bytes.push(self.halted as u8);
+        bytes.extend((self.head_position as u64).to_le_bytes());
+        bytes.extend((self.origin as u64).to_le_bytes());
+        bytes.push(self.bi_infinite as u8);
+        // the VMs leave off blanks at the end of the tape
+        let len = self.tape.len().max(self.head_position + 1).max(self.origin);
+        bytes.extend((len as u64).to_le_bytes());
+        for symbol in &self.tape {
+            bytes.extend(symbol.to_le_bytes());
+        }
+        bytes.resize(bytes.len() + 2 * (len - self.tape.len()), 0);
+        bytes.extend((self.states.len() as u32).to_le_bytes());
+        for node in &self.states {
+            bytes.extend(node.address.to_le_bytes());
+            bytes.push(node.states.len() as u8);
+            bytes.push(node.symbols.len() as u8);
+            for index in &node.states {
+                bytes.extend(index.to_le_bytes());
+            }
+            for symbol in &node.symbols {
+                bytes.extend(symbol.to_le_bytes());
+            }
+        }
+
+        let mut temp = path.as_os_str().to_owned();
+        temp.push(".tmp");
+        fs::write(&temp, bytes)
+            .and_then(|_| fs::rename(&temp, path))
+            .map_err(|_| Error::new(format!("couldn't write file {}", path.display()), None))
+    }
+
+    /// Checks that the checkpoint can be resumed with `compiled`.
+    pub fn validate(&self, compiled: &Compiled, bi_infinite: bool) -> Result<(), Error> {
+        if self.hash != hash(compiled) {
+            return Err(Error::new(
+                "checkpoint was made with a different machine, tape or compile options".to_string(),
+                None,
+            ));
+        } else if self.bi_infinite != bi_infinite {
+            let with = if self.bi_infinite { "with" } else { "without" };
+            return Err(Error::new(
+                format!("checkpoint was made {with} --bi-infinite"),
+                None,
+            ));
+        }
+
+        // the VMs trust the head, the origin and the arguments of every state
+        let symbols = compiled.symbols.len();
+        let arities = bc::arities(&compiled.bytes);
+        let valid = self.head_position < self.tape.len()
+            && self.origin <= self.tape.len()
+            && self.tape.iter().all(|&symbol| (symbol as usize) < symbols)
+            && self.states.iter().all(|node| {
+                arities.get(&node.address) == Some(&(node.states.len(), node.symbols.len()))
+                    && node
+                        .symbols
+                        .iter()
+                        .all(|&symbol| (symbol as usize) < symbols)
+            });
+        if valid {
+            Ok(())
+        } else {
+            Err(Error::new("checkpoint is corrupted".to_string(), None))
+        }
+    }
+}
+
+struct Reader<'a> {
+    bytes: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn checkpoint(&mut self) -> Option<Checkpoint> {
+        if self.take(4)? != MAGIC || self.u32()? != VERSION {
+            return None;
+        }
+
+        let hash = self.u64()?;
+        let moves = self.u64()?.try_into().ok()?;
+        let inlined = self.u64()?.try_into().ok()?;
+        let halted = self.u8()? != 0;
+        let head_position = self.u64()?.try_into().ok()?;
+        let origin = self.u64()?.try_into().ok()?;
+        let bi_infinite = self.u8()? != 0;
+
+        let tape_len: usize = self.u64()?.try_into().ok()?;
+        let tape = self
+            .take(tape_len.checked_mul(2)?)?
+            .chunks(2)
+            .map(|bytes| u16::from_le_bytes([bytes[0], bytes[1]]))
+            .collect();
+
+        let state_count = self.u32()?;
+        let mut states = Vec::new();
+        for i in 0..state_count {
+            let address = self.u32()?;
+            let child_count = self.u8()?;
+            let symbol_count = self.u8()?;
+            let states_ = (0..child_count)
+                .map(|_| self.u32().filter(|&index| index < i))
+                .collect::<Option<_>>()?;
+            let symbols = (0..symbol_count)
+                .map(|_| self.u16())
+                .collect::<Option<_>>()?;
+            states.push(Node {
+                address,
+                states: states_,
+                symbols,
+            });
+        }
+
+        if states.is_empty() || !self.bytes.is_empty() {
+            return None;
+        }
+
+        Some(Checkpoint {
+            hash,
+            moves,
+            inlined,
+            halted,
+            head_position,
+            origin,
+            bi_infinite,
+            tape,
+            states,
+        })
+    }
+
+    fn take(&mut self, n: usize) -> Option<&'a [u8]> {
+        if self.bytes.len() < n {
+            return None;
+        }
+        let (taken, rest) = self.bytes.split_at(n);
+        self.bytes = rest;
+        Some(taken)
+    }
+
+    fn u8(&mut self) -> Option<u8> {
+        Some(self.take(1)?[0])
+    }
+
+    fn u16(&mut self) -> Option<u16> {
+        Some(u16::from_le_bytes(self.take(2)?.try_into().ok()?))
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::ffi;
+    use crate::testing::{self, Outcome, TempDir};
+    use crate::vm::{self, Machine};
+
+    /// Goes back and forth, nesting a new closure around the state it goes
+    /// to every other move
+    const NESTING: &str = "
+start {
+    _ | | ping(pong(start); '1'),
+}
+
+ping(A; x) {
+    _ | x > | A,
+}
+
+pong(A) {
+    _ | '0' > | ping(pong(A); '1'),
+}
+";
+
+    fn round_trip(checkpoint: &Checkpoint, dir: &TempDir) -> Checkpoint {
+        let path = dir.0.join("checkpoint.tmlc");
+        checkpoint.write(&path).unwrap();
+        Checkpoint::read(&path).unwrap()
+    }
+
+    #[test]
+    fn resumes_in_either_vm() {
+        let dir = TempDir::new("checkpoint-resume");
+        let compiled = testing::compile(NESTING, "'x' 'x'");
+        let expected = testing::run(&compiled, 40);
+
+        for moves in [0, 1, 2, 7, 40] {
+            let (mut rust, mut c) = testing::vms(&compiled, false);
+            let vms: [&mut dyn Machine; 2] = [&mut rust, &mut c];
+            for vm in vms {
+                vm.run(moves);
+                let checkpoint = round_trip(&vm.checkpoint(hash(&compiled), false), &dir);
+                assert_eq!(checkpoint.moves, moves);
+                checkpoint.validate(&compiled, false).unwrap();
+
+                let (mut rust, mut c) = testing::restore(&compiled, &checkpoint);
+                rust.run(40);
+                c.run(40);
+                assert_eq!(testing::finish(&compiled, (rust, c)), expected);
+            }
+        }
+    }
+
+    #[test]
+    fn keeps_the_moves_of_inlined_states() {
+        let mut unit = testing::unit("start { _ | > | a }\na { _ | | b }\nb { _ | | start }");
+        crate::inline::inline(&mut unit);
+        let mut compiled = crate::compile::compile(unit, &[]).unwrap();
+        compiled.tape = compiled.intern(&[]).unwrap();
+        let inlined = |(rust, c): (vm::Vm, ffi::Vm)| {
+            let (rust, c) = (rust.finish(), c.finish());
+            assert_eq!(rust.inlined, c.inlined);
+            rust.inlined
+        };
+        for moves in [1, 3, 7] {
+            // stopping in the middle of an arm runs the state it would have
+            // inlined, so the same stop without a checkpoint is expected
+            let (mut rust, mut c) = testing::vms(&compiled, false);
+            let vms: [&mut dyn Machine; 2] = [&mut rust, &mut c];
+            for vm in vms {
+                vm.run(moves);
+                vm.run(40);
+            }
+            let expected = inlined((rust, c));
+            assert!(expected > 20);
+
+            let (mut rust, mut c) = testing::vms(&compiled, false);
+            let vms: [&mut dyn Machine; 2] = [&mut rust, &mut c];
+            for vm in vms {
+                vm.run(moves);
+                let (mut rust, mut c) = testing::restore(&compiled, &vm.checkpoint(0, false));
+                rust.run(40);
+                c.run(40);
+                assert_eq!(inlined((rust, c)), expected, "resumed after {moves} moves");
+            }
+        }
+    }
+
+    #[test]
+    fn stores_shared_states_once() {
+        let code = "
+start {
+    _ | > | twice(wrap(!)),
+}
+
+twice(A) {
+    _ | > | pair(A, A),
+}
+
+pair(A, B) {
+    _ | > | A,
+}
+
+wrap(A) {
+    _ | > | A,
+}
+";
+        let compiled = testing::compile(code, "");
+        let (mut rust, mut c) = testing::vms(&compiled, false);
+        let vms: [&mut dyn Machine; 2] = [&mut rust, &mut c];
+        for vm in vms {
+            vm.run(2);
+            // `!`, `wrap(!)`, and `pair` with `wrap(!)` twice
+            let states = vm.checkpoint(0, false).states;
+            assert_eq!(states.len(), 3);
+            assert_eq!(states[2].states, [1, 1]);
+        }
+    }
+
+    #[test]
+    fn flattens_deeply_nested_states() {
+        let code = "
+start {
+    _ | | grow(!),
+}
+
+grow(A) {
+    '' | '1' > | grow(grow(A)),
+    _  | <     | A,
+}
+";
+        let compiled = testing::compile(code, "");
+        // the Rust VM drops nested states recursively, so only the C VM
+        // nests them this deep
+        let (_, mut vm) = testing::vms(&compiled, false);
+        vm.run(100_000);
+        let checkpoint = vm.checkpoint(hash(&compiled), false);
+        // a `grow` for every move, and the `!` in the innermost one
+        assert_eq!(checkpoint.states.len(), 100_001);
+
+        let symbols = compiled.symbols.len();
+        let mut resumed = ffi::Vm::restore(&compiled.bytes, &checkpoint, symbols, false, false);
+        vm.run(150_000);
+        resumed.run(150_000);
+        let (vm, resumed) = (vm.finish(), resumed.finish());
+        assert_eq!(
+            Outcome::new(&resumed, &compiled),
+            Outcome::new(&vm, &compiled)
+        );
+    }
+
+    #[test]
+    fn reads_only_whole_checkpoints() {
+        let dir = TempDir::new("checkpoint-read");
+        let compiled = testing::compile(NESTING, "");
+        let (mut vm, _) = testing::vms(&compiled, false);
+        vm.run(5);
+        let path = dir.0.join("checkpoint.tmlc");
+        vm.checkpoint(hash(&compiled), false).write(&path).unwrap();
+        // the file is only replaced once it is complete
+        assert_eq!(fs::read_dir(&dir.0).unwrap().count(), 1);
+
+        let bytes = fs::read(&path).unwrap();
+        let invalid = |bytes: &[u8]| {
+            fs::write(&path, bytes).unwrap();
+            let error = Checkpoint::read(&path).err().unwrap();
+            assert_eq!(
+                error.to_string(),
+                format!("invalid checkpoint {}", path.display())
+            );
+        };
+        for len in [0, 4, 8, bytes.len() - 1] {
+            invalid(&bytes[..len]);
+        }
+        invalid(&[&bytes[..], &[0]].concat());
+        let mut version = bytes.clone();
+        version[4] += 1;
+        invalid(&version);
+
+        // a state can only have states before it as children
+        let checkpoint = Checkpoint::read(&dir.write("checkpoint.tmlc", &bytes)).unwrap();
+        let last = checkpoint.states.last().unwrap();
+        assert!(!last.states.is_empty());
+        let child = bytes.len() - 2 * last.symbols.len() - 4 * last.states.len();
+        let index = checkpoint.states.len() as u32 - 1;
+        let mut forward = bytes.clone();
+        forward[child..child + 4].copy_from_slice(&index.to_le_bytes());
+        invalid(&forward);
+    }
+
+    #[test]
+    fn rejects_checkpoints_of_other_machines() {
+        let compiled = testing::compile(NESTING, "");
+        let (mut vm, _) = testing::vms(&compiled, false);
+        vm.run(5);
+        let error = |checkpoint: &Checkpoint| {
+            checkpoint
+                .validate(&compiled, false)
+                .unwrap_err()
+                .to_string()
+        };
+
+        // the tape's symbols are part of the machine
+        let other = testing::compile(NESTING, "'x'");
+        let mut checkpoint = vm.checkpoint(hash(&other), false);
+        assert!(error(&checkpoint).starts_with("checkpoint was made with a different machine"));
+
+        checkpoint.hash = hash(&compiled);
+        checkpoint.tape.push(compiled.symbols.len() as u16);
+        assert_eq!(error(&checkpoint), "checkpoint is corrupted");
+        checkpoint.tape.pop();
+        checkpoint.states[0].address += 1;
+        assert_eq!(error(&checkpoint), "checkpoint is corrupted");
+    }
+
+    #[test]
+    fn resumes_tapes_grown_to_the_left() {
+        let dir = TempDir::new("checkpoint-bi-infinite");
+        let compiled = testing::compile("start {\n    _ | '1' < | start,\n}\n", "'x'");
+        let (mut rust, mut c) = testing::vms(&compiled, true);
+        rust.run(30);
+        c.run(30);
+        let expected = testing::finish(&compiled, (rust, c));
+        assert_eq!((expected.origin, expected.head), (29, -30));
+
+        let (mut rust, mut c) = testing::vms(&compiled, true);
+        let vms: [&mut dyn Machine; 2] = [&mut rust, &mut c];
+        for vm in vms {
+            vm.run(10);
+            let checkpoint = round_trip(&vm.checkpoint(hash(&compiled), false), &dir);
+            let error = checkpoint.validate(&compiled, false).unwrap_err();
+            assert_eq!(error.to_string(), "checkpoint was made with --bi-infinite");
+            checkpoint.validate(&compiled, true).unwrap();
+
+            let (mut rust, mut c) = testing::restore(&compiled, &checkpoint);
+            rust.run(30);
+            c.run(30);
+            assert_eq!(testing::finish(&compiled, (rust, c)), expected);
+        }
+    }
+
+    #[test]
+    fn rejects_heads_and_arguments_the_vms_cant_use() {
+        let dir = TempDir::new("checkpoint-arities");
+        let compiled = testing::compile(NESTING, "");
+        let error = |checkpoint: &Checkpoint| checkpoint.validate(&compiled, false).unwrap_err();
+
+        // the head is on a blank past the end of what the VMs keep
+        let (mut vm, _) = testing::vms(&compiled, false);
+        vm.run(6);
+        let made = vm.checkpoint(hash(&compiled), false);
+        assert!(made.head_position >= made.tape.len());
+        let checkpoint = round_trip(&made, &dir);
+        checkpoint.validate(&compiled, false).unwrap();
+
+        let corrupt = |corrupt: &dyn Fn(&mut Checkpoint)| {
+            let mut checkpoint = round_trip(&made, &dir);
+            corrupt(&mut checkpoint);
+            assert_eq!(error(&checkpoint).to_string(), "checkpoint is corrupted");
+        };
+        corrupt(&|checkpoint| checkpoint.head_position = 1 << 40);
+        corrupt(&|checkpoint| checkpoint.head_position = checkpoint.tape.len());
+        corrupt(&|checkpoint| checkpoint.origin = checkpoint.tape.len() + 1);
+        // `ping` takes a state and a symbol, and `pong` only a state
+        let last = made.states.len() - 1;
+        corrupt(&|checkpoint| checkpoint.states[last].symbols.push(0));
+        corrupt(&|checkpoint| checkpoint.states[last].states.push(0));
+        corrupt(&|checkpoint| {
+            checkpoint.states[last].states.pop();
+        });
+    }
+}
@@ -1,18 +1,26 @@
-use std::collections::{hash_map::Entry, HashMap, VecDeque};
+use std::collections::{hash_map::Entry, HashMap, HashSet, VecDeque};
 
 use crate::bytecode as bc;
 use crate::error::Error;
 use crate::lex::Span;
 use crate::parse::{Arm, Name, Op, Pattern, State, Symbol, ToState};
 
+const MIN_DISPATCH_ARMS: usize = 3;
+const MAX_DISPATCH_LEN: usize = 256;
+
 pub struct Compiled {
     pub bytes: Vec<u8>,
     pub symbols: Vec<String>,
     pub states: HashMap<u32, String>,
+    /// The pattern of every arm, by the address of its right-hand side
+    pub arms: HashMap<u32, Span>,
     pub tape: Vec<u16>,
 }
 
-pub fn compile(unit: Vec<State>, symbols: Vec<Symbol>) -> Result<Compiled, Error> {
+/// Compiles `unit`, with the symbols in `alphabet` in the symbol table
+/// besides its own, so it can run on any tape with those symbols. The tape
+/// is left empty, see `Compiled::intern()`.
+pub fn compile(unit: Vec<State>, alphabet: &[Symbol]) -> Result<Compiled, Error> {
     let mut compiler = Compiler {
         bytes: vec![0, 0, 0xff, 0xff, 0xff, 0xff, bc::HALT],
         forward_refs: HashMap::new(),
@@ -20,13 +28,14 @@ pub fn compile(unit: Vec<State>, symbols: Vec<Symbol>) -> Result<Compiled, Error
         symbols: Symbols::new(),
         states: unit.into(),
         state_names: HashMap::new(),
+        arm_spans: HashMap::new(),
+        inlined: None,
     };
 
     compiler.compile()?;
 
-    let mut tape = Vec::with_capacity(symbols.len());
-    for symbol in symbols {
-        tape.push(compiler.symbols.insert(symbol)?);
+    for symbol in alphabet {
+        compiler.symbols.insert(symbol.clone())?;
     }
 
     let mut symbols = vec![String::new(); compiler.symbols.0.len()];
@@ -38,10 +47,35 @@ pub fn compile(unit: Vec<State>, symbols: Vec<Symbol>) -> Result<Compiled, Error
         bytes: compiler.bytes,
         symbols,
         states: compiler.state_names,
-        tape,
+        arms: compiler.arm_spans,
+        tape: Vec::new(),
     })
 }
 
+impl Compiled {
+    /// The cells of a tape with `symbols`, which must be in the alphabet the
+    /// machine was compiled with.
+    pub fn intern(&self, symbols: &[Symbol]) -> Result<Vec<u16>, Error> {
+        let table: HashMap<_, _> = self
+            .symbols
+            .iter()
+            .enumerate()
+            .map(|(i, symbol)| (symbol.as_str(), i as u16))
+            .collect();
+        symbols
+            .iter()
+            .map(|symbol| {
+                table.get(symbol.symbol.as_str()).copied().ok_or_else(|| {
+                    Error::new(
+                        "symbol isn't in the machine's symbol table".to_string(),
+                        Some(symbol.span),
+                    )
+                })
+            })
+            .collect()
+    }
+}
+
 struct Compiler {
     bytes: Vec<u8>,
     forward_refs: HashMap<Signature, Vec<ForwardRef>>,
@@ -49,6 +83,10 @@ struct Compiler {
     symbols: Symbols,
     states: VecDeque<State>,
     state_names: HashMap<u32, String>,
+    arm_spans: HashMap<u32, Span>,
+    /// `Arm::inlined` and `Arm::uninlined` of the right-hand side being
+    /// compiled, if states were inlined into it
+    inlined: Option<(u8, ToState)>,
 }
 
 impl Compiler {
@@ -115,37 +153,216 @@ impl Compiler {
             ));
         }
 
+        self.compile_scan(&name, &state_params, &symbol_params, &arms, &symbol_map)?;
+
         if arms.is_empty() {
             self.bytes.push(bc::HALT);
+        } else if let Some(values) = self.dispatch_values(&arms, &symbol_map)? {
+            let location = self.bytes.len();
+            if !self.compile_dispatch(arms.clone(), &values, &state_map, &symbol_map)? {
+                self.rollback(location);
+                self.compile_arms(arms, &state_map, &symbol_map)?;
+            }
         } else {
-            let arm_count = arms.len();
-            for (i, arm) in arms.into_iter().enumerate() {
-                let is_last_arm = i == arm_count - 1;
-                let is_catchall = self.compile_arm(arm, &state_map, &symbol_map, is_last_arm)?;
-                if is_last_arm && !is_catchall {
-                    self.bytes.push(bc::HALT);
+            self.compile_arms(arms, &state_map, &symbol_map)?;
+        }
+
+        Ok(())
+    }
+
+    fn compile_arms(
+        &mut self,
+        arms: Vec<Arm>,
+        state_map: &HashMap<&'static str, u8>,
+        symbol_map: &HashMap<&'static str, u8>,
+    ) -> Result<(), Error> {
+        let arm_count = arms.len();
+        for (i, arm) in arms.into_iter().enumerate() {
+            let is_last_arm = i == arm_count - 1;
+            let is_catchall = self.compile_arm(arm, state_map, symbol_map, is_last_arm)?;
+            if is_last_arm && !is_catchall {
+                self.bytes.push(bc::HALT);
+            }
+        }
+
+        Ok(())
+    }
+
+    /// Emits a `SCAN_*` prefix if some arms only move the head and loop back
+    /// to the same state, so the VM can run them without dispatching.
+    fn compile_scan(
+        &mut self,
+        name: &Name,
+        state_params: &[Name],
+        symbol_params: &[Name],
+        arms: &[Arm],
+        symbol_map: &HashMap<&'static str, u8>,
+    ) -> Result<(), Error> {
+        let mut values = Vec::with_capacity(arms.len());
+        for (i, arm) in arms.iter().enumerate() {
+            match &arm.pattern {
+                Pattern::Symbol(symbol) => values.push(Some(self.symbols.insert(symbol.clone())?)),
+                Pattern::Name(name) if i == arms.len() - 1 && !symbol_map.contains_key(name.name) => {
+                    values.push(None)
                 }
+                Pattern::Name(_) => return Ok(()),
             }
         }
 
+        let steps: Vec<_> = arms
+            .iter()
+            .map(|arm| scan_step(arm, name, state_params, symbol_params))
+            .collect();
+
+        // a looping catchall scans until one of the other symbols, otherwise
+        // scan while the symbol is one of the looping ones
+        let until = values.last() == Some(&None) && steps[arms.len() - 1].is_some();
+        let step = if until {
+            steps[arms.len() - 1]
+        } else {
+            steps.iter().flatten().next().copied()
+        };
+        let Some(step) = step else {
+            return Ok(());
+        };
+        let Ok(stride) = u16::try_from(step.unsigned_abs()) else {
+            return Ok(());
+        };
+
+        let mut seen = HashSet::new();
+        let mut set = Vec::new();
+        for (&value, &arm_step) in values.iter().zip(&steps) {
+            if let Some(value) = value {
+                if seen.insert(value) && (arm_step == Some(step)) != until {
+                    set.push(value);
+                }
+            }
+        }
+        let Ok(count) = u16::try_from(set.len()) else {
+            return Ok(());
+        };
+
+        self.bytes.push(match (step < 0, until) {
+            (true, false) => bc::SCAN_LEFT_WHILE,
+            (false, false) => bc::SCAN_RIGHT_WHILE,
+            (true, true) => bc::SCAN_LEFT_UNTIL,
+            (false, true) => bc::SCAN_RIGHT_UNTIL,
+        });
+        self.bytes.extend(stride.to_le_bytes());
+        self.bytes.extend(count.to_le_bytes());
+        for value in set {
+            self.bytes.extend(value.to_le_bytes());
+        }
+
         Ok(())
     }
 
+    /// Returns the symbol matched by each arm (`None` for a final catchall)
+    /// if the state can be compiled to a `DISPATCH_TABLE`.
+    fn dispatch_values(
+        &mut self,
+        arms: &[Arm],
+        symbol_map: &HashMap<&'static str, u8>,
+    ) -> Result<Option<Vec<Option<u16>>>, Error> {
+        if arms.len() < MIN_DISPATCH_ARMS || arms.len() > u16::MAX as usize {
+            return Ok(None);
+        }
+
+        let mut values = Vec::with_capacity(arms.len());
+        for (i, arm) in arms.iter().enumerate() {
+            match &arm.pattern {
+                Pattern::Symbol(symbol) => values.push(Some(self.symbols.insert(symbol.clone())?)),
+                Pattern::Name(name) if i == arms.len() - 1 && !symbol_map.contains_key(name.name) => {
+                    values.push(None)
+                }
+                Pattern::Name(_) => return Ok(None),
+            }
+        }
+
+        let len = values.iter().flatten().max().map_or(0, |&max| max as usize + 1);
+        if len > MAX_DISPATCH_LEN {
+            Ok(None)
+        } else {
+            Ok(Some(values))
+        }
+    }
+
+    /// Returns `false` if the arms are too big to be addressed by the table.
+    fn compile_dispatch(
+        &mut self,
+        arms: Vec<Arm>,
+        values: &[Option<u16>],
+        state_map: &HashMap<&'static str, u8>,
+        symbol_map: &HashMap<&'static str, u8>,
+    ) -> Result<bool, Error> {
+        let len = values.iter().flatten().max().map_or(0, |&max| max as usize + 1);
+
+        self.bytes.push(bc::DISPATCH_TABLE);
+        self.bytes.extend((arms.len() as u16).to_le_bytes());
+        self.bytes.extend((len as u16).to_le_bytes());
+        let table = self.bytes.len();
+        self.bytes.resize(table + 2 * (len + 1), 0);
+        let base = self.bytes.len();
+
+        let mut offsets = vec![None; len];
+        let mut default = None;
+        for (arm, &value) in arms.into_iter().zip(values) {
+            let offset = self.bytes.len() - base;
+            if offset >= bc::NO_ARM as usize {
+                return Ok(false);
+            }
+
+            let bound = match (&arm.pattern, value) {
+                (Pattern::Name(name), None) => name.name,
+                _ => "",
+            };
+            let span = arm.pattern.span();
+            self.inlined = arm.uninlined.map(|to_state| (arm.inlined as u8, to_state));
+            self.compile_rhs(arm.ops, arm.to_state, span, state_map, symbol_map, bound)?;
+
+            match value {
+                Some(value) => {
+                    offsets[value as usize].get_or_insert(offset as u16);
+                }
+                None => default = Some(offset as u16),
+            }
+        }
+
+        let default = default.unwrap_or(bc::NO_ARM);
+        self.bytes[table..table + 2].copy_from_slice(&default.to_le_bytes());
+        for (i, offset) in offsets.into_iter().enumerate() {
+            let location = table + 2 * (i + 1);
+            let bytes = offset.unwrap_or(default).to_le_bytes();
+            self.bytes[location..location + 2].copy_from_slice(&bytes);
+        }
+
+        Ok(true)
+    }
+
+    fn rollback(&mut self, location: usize) {
+        self.bytes.truncate(location);
+        self.arm_spans
+            .retain(|&address, _| (address as usize) < location);
+        for refs in self.forward_refs.values_mut() {
+            refs.retain(|f_ref| f_ref.location < location);
+        }
+        self.forward_refs.retain(|_, refs| !refs.is_empty());
+    }
+
     fn compile_arm(
         &mut self,
         Arm {
             pattern,
             ops,
             to_state,
+            inlined,
+            uninlined,
         }: Arm,
         state_map: &HashMap<&'static str, u8>,
         symbol_map: &HashMap<&'static str, u8>,
         is_last_arm: bool,
     ) -> Result<bool, Error> {
-        let pattern_span = match &pattern {
-            Pattern::Symbol(symbol) => symbol.span,
-            Pattern::Name(name) => name.span,
-        };
+        let pattern_span = pattern.span();
 
         let bound = self.compile_pattern(pattern, symbol_map, is_last_arm)?;
 
@@ -154,11 +371,8 @@ impl Compiler {
             self.bytes.extend(u16::MAX.to_le_bytes());
         }
 
-        self.compile_ops(OpIter(ops.into()), symbol_map, bound)?;
-
-        let mut counts: HashMap<_, _> = state_map.keys().map(|&name| (name, 0)).collect();
-        count_state_args(&to_state, &mut counts)?;
-        self.compile_to_state(to_state, state_map, symbol_map, &mut counts, bound, true)?;
+        self.inlined = uninlined.map(|to_state| (inlined as u8, to_state));
+        self.compile_rhs(ops, to_state, pattern_span, state_map, symbol_map, bound)?;
 
         if bound.is_empty() {
             let jump_size = self.bytes.len() - location - 2;
@@ -179,6 +393,50 @@ impl Compiler {
         Ok(!bound.is_empty())
     }
 
+    /// Compiles the ops and final state of an arm. With states inlined into
+    /// it, the VMs skip to where it went before inlining if the inlined moves
+    /// would pass the move limit.
+    fn compile_rhs(
+        &mut self,
+        ops: Vec<Op>,
+        to_state: ToState,
+        span: Span,
+        state_map: &HashMap<&'static str, u8>,
+        symbol_map: &HashMap<&'static str, u8>,
+        bound: &str,
+    ) -> Result<(), Error> {
+        self.arm_spans.insert(self.bytes.len() as u32, span);
+        self.compile_ops(OpIter(ops.into()), symbol_map, bound)?;
+
+        let Some((n, uninlined)) = self.inlined.take() else {
+            return self.compile_final(to_state, state_map, symbol_map, bound);
+        };
+        let location = self.bytes.len();
+        self.bytes.extend([bc::INLINED, n, 0, 0]);
+        self.compile_final(to_state, state_map, symbol_map, bound)?;
+        let Ok(skip) = u16::try_from(self.bytes.len() - location - 4) else {
+            return Err(Error::new(
+                "this arm is too complicated".to_string(),
+                Some(span),
+            ));
+        };
+        self.bytes[location + 2..location + 4].copy_from_slice(&skip.to_le_bytes());
+        self.compile_final(uninlined, state_map, symbol_map, bound)
+    }
+
+    /// Compiles the state an arm goes to, ending in a `FINAL_*` instruction.
+    fn compile_final(
+        &mut self,
+        to_state: ToState,
+        state_map: &HashMap<&'static str, u8>,
+        symbol_map: &HashMap<&'static str, u8>,
+        bound: &str,
+    ) -> Result<(), Error> {
+        let mut counts: HashMap<_, _> = state_map.keys().map(|&name| (name, 0)).collect();
+        count_state_args(&to_state, &mut counts)?;
+        self.compile_to_state(to_state, state_map, symbol_map, &mut counts, bound, true)
+    }
+
     fn compile_pattern(
         &mut self,
         pattern: Pattern,
@@ -476,6 +734,48 @@ fn make_map(params: &[Name], kind: &str) -> Result<HashMap<&'static str, u8>, Er
     Ok(map)
 }
 
+/// Returns the net head movement of `arm` if it only moves and then goes back
+/// to the state it's in with the same arguments. Scans count one move per
+/// step, so arms with inlined states never scan.
+fn scan_step(arm: &Arm, name: &Name, state_params: &[Name], symbol_params: &[Name]) -> Option<isize> {
+    if arm.inlined > 0 {
+        return None;
+    }
+    let ToState::State {
+        name: to_name,
+        state_args,
+        symbol_args,
+    } = &arm.to_state
+    else {
+        return None;
+    };
+
+    let is_param = |name: &str| state_params.iter().any(|param| param.name == name);
+    let same_states = state_args.len() == state_params.len()
+        && state_args.iter().zip(state_params).all(|(arg, param)| {
+            matches!(arg, ToState::State { name, state_args, symbol_args }
+                if name.name == param.name && state_args.is_empty() && symbol_args.is_empty())
+        });
+    let same_symbols = symbol_args.len() == symbol_params.len()
+        && symbol_args
+            .iter()
+            .zip(symbol_params)
+            .all(|(arg, param)| matches!(arg, Pattern::Name(name) if name.name == param.name));
+    if to_name.name != name.name || is_param(to_name.name) || !same_states || !same_symbols {
+        return None;
+    }
+
+    let mut step = 0;
+    for op in &arm.ops {
+        match op {
+            Op::Left(_) => step -= 1,
+            Op::Right(_) => step += 1,
+            Op::Name(_) | Op::Symbol(_) => return None,
+        }
+    }
+    (step != 0).then_some(step)
+}
+
 fn count_state_args(
     state: &ToState,
     counts: &mut HashMap<&'static str, usize>,
@@ -0,0 +1,423 @@
+use std::collections::hash_map::DefaultHasher;
+use std::collections::HashMap;
+use std::hash::{Hash, Hasher};
+
+use std::ops::Range;
+
+use crate::bytecode;
+use crate::vm::Machine;
+
+/// Cells on each side of the head that are hashed with the state
+const WINDOW: isize = 32;
+/// Moves between samples at first. Every candidate that turns out not to be
+/// a cycle doubles it, up to `MAX_INTERVAL`
+const INITIAL_INTERVAL: usize = 1 << 14;
+const MAX_INTERVAL: usize = 1 << 20;
+/// Samples kept before they're all forgotten
+const MAX_SAMPLES: usize = 1 << 12;
+/// Longest candidate period that is verified, since verifying runs it one
+/// move at a time
+const MAX_PERIOD: usize = 1 << 22;
+/// Most cells inserted by one fast-forward, so a machine that runs forever
+/// doesn't allocate its whole future tape at once
+const MAX_INSERTED: usize = 1 << 26;
+
+/// Finds translated cycles: a state without arguments that comes back after
+/// `period` moves with the head `shift` cells further right, and the cells
+/// the period can reach the same relative to the head. Every period after it
+/// then does the same thing shifted by `shift` cells, so the tape it leaves
+/// behind is the same block of cells over and over again.
+///
+/// Configurations are sampled every so often, hashed by their state and the
+/// cells around the head, and a repeated hash is verified by running one
+/// more period.
+pub struct Detector {
+    /// See `bytecode::reach()`
+    reach: isize,
+    bi_infinite: bool,
+    interval: usize,
+    next_sample: usize,
+    /// Moves and head position at the last sample with each hash
+    samples: HashMap<(u32, u64), (usize, isize)>,
+}
+
+/// A verified cycle, at the end of a period.
+struct Cycle {
+    period: usize,
+    shift: isize,
+    /// The cells the next period can reach, relative to the head
+    left: isize,
+    right: isize,
+    /// The block of cells one period leaves behind, and the cell it's
+    /// inserted before. The cells on the side the head is on move away to
+    /// make room
+    pattern: Vec<u16>,
+    position: isize,
+}
+
+enum Verified {
+    Cycle(Cycle),
+    NoCycle,
+    Halted,
+}
+
+impl Detector {
+    pub fn new(bytes: &[u8], bi_infinite: bool) -> Self {
+        Detector {
+            reach: bytecode::reach(bytes) as isize,
+            bi_infinite,
+            interval: INITIAL_INTERVAL,
+            next_sample: 0,
+            samples: HashMap::new(),
+        }
+    }
+
+    /// The number of moves `vm` should be run to before calling `update()`.
+    pub fn next_sample(&self) -> usize {
+        self.next_sample
+    }
+
+    /// Samples `vm` if it's time to, and fast-forwards it by as many periods
+    /// as fit in `max_moves` if the sample completes a cycle. Periods are
+    /// only skipped while none of them could write the `watch` cell. Returns
+    /// true if the machine halted while a cycle was verified.
+    pub fn update(&mut self, vm: &mut dyn Machine, max_moves: usize, watch: Option<usize>) -> bool {
+        let moves = vm.moves();
+        if moves < self.next_sample {
+            return false;
+        }
+        self.next_sample = moves.saturating_add(self.interval);
+
+        let Some(address) = vm.address() else {
+            return false;
+        };
+        let head = vm.head();
+        let mut hasher = DefaultHasher::new();
+        for position in head - WINDOW..=head + WINDOW {
+            vm.cell(position).hash(&mut hasher);
+        }
+
+        if self.samples.len() >= MAX_SAMPLES {
+            self.samples.clear();
+        }
+        let key = (address, hasher.finish());
+        let Some((earlier, earlier_head)) = self.samples.insert(key, (moves, head)) else {
+            return false;
+        };
+        let period = moves - earlier;
+        if period > MAX_PERIOD || max_moves - moves < period {
+            return false;
+        }
+
+        match self.verify(vm, address, period, head - earlier_head, watch) {
+            Verified::Cycle(cycle) => {
+                let remaining = (max_moves - vm.moves()) / cycle.period;
+                let periods = cycle.periods(vm.head(), remaining, watch);
+                if periods > 0 {
+                    vm.insert_cells(
+                        cycle.position,
+                        &cycle.pattern,
+                        periods,
+                        cycle.shift < 0,
+                        periods * cycle.period,
+                    );
+                }
+                self.samples.clear();
+                self.next_sample = vm.moves().saturating_add(self.interval);
+                false
+            }
+            Verified::NoCycle => {
+                self.interval = (2 * self.interval).min(MAX_INTERVAL);
+                false
+            }
+            Verified::Halted => true,
+        }
+    }
+
+    /// Runs `period` moves one at a time to find how far the head gets, and
+    /// checks that they end in the state at `address` with the cells the
+    /// next period can reach shifted like the head, in the direction of
+    /// `shift`.
+    fn verify(
+        &self,
+        vm: &mut dyn Machine,
+        address: u32,
+        period: usize,
+        shift: isize,
+        watch: Option<usize>,
+    ) -> Verified {
+        // the period can't get further than `margin` from the head, so that's
+        // all that is needed of the tape on the side it comes from
+        let from = vm.head();
+        let margin = (period as isize + 1) * self.reach;
+        let written = vm.written();
+        let range = match shift {
+            0 => from - margin..from + margin + 1,
+            1.. => from - margin..written.end,
+            _ => written.start..from + margin + 1,
+        };
+        let before = Snapshot {
+            first: range.start.max(written.start),
+            cells: (range.start.max(written.start)..range.end.min(written.end))
+                .map(|position| vm.cell(position))
+                .collect(),
+        };
+
+        let (mut low, mut high) = (from, from);
+        for _ in 0..period {
+            let moves = vm.moves();
+            vm.run(moves + 1);
+            if vm.moves() == moves {
+                return Verified::Halted;
+            }
+            if watch.is_some_and(|position| vm.cell(position as isize) != 0) {
+                return Verified::NoCycle;
+            }
+            low = low.min(vm.head());
+            high = high.max(vm.head());
+        }
+        if vm.address() != Some(address) || (vm.head() - from).signum() != shift.signum() {
+            return Verified::NoCycle;
+        }
+
+        let reach = (from - low + self.reach, high - from + self.reach);
+        match Cycle::new(&before, from, written, vm, period, reach, self.bi_infinite) {
+            Some(cycle) => Verified::Cycle(cycle),
+            None => Verified::NoCycle,
+        }
+    }
+}
+
+/// Cells of the tape before a period, relative to the initial cell 0.
+struct Snapshot {
+    first: isize,
+    cells: Vec<u16>,
+}
+
+impl Snapshot {
+    fn cell(&self, position: isize) -> u16 {
+        usize::try_from(position - self.first)
+            .ok()
+            .and_then(|index| self.cells.get(index).copied())
+            .unwrap_or(0)
+    }
+}
+
+impl Cycle {
+    /// Checks that the period that went from the head position `from` and
+    /// the cells in `before` (which was `written`) to where `vm` is now can
+    /// repeat forever. `reach` is how far left and right of `from` it got.
+    fn new(
+        before: &Snapshot,
+        from: isize,
+        written: Range<isize>,
+        vm: &dyn Machine,
+        period: usize,
+        (mut left, right): (isize, isize),
+        bi_infinite: bool,
+    ) -> Option<Self> {
+        let to = vm.head();
+        let shift = to - from;
+        if shift < 0 && !bi_infinite {
+            // the copies would run into the left end of the tape
+            return None;
+        }
+        if !bi_infinite {
+            // the period didn't run into the left end of the tape
+            left = left.min(from);
+        }
+
+        // moving right, the period reads nothing it didn't write itself right
+        // of what it can reach, and moving left, nothing left of it
+        let after = vm.written();
+        let (first, last) = match shift {
+            0 => (-left, right),
+            1.. => (-left, (written.end - from).max(after.end - to)),
+            _ => ((written.start - from).min(after.start - to), right),
+        };
+        if (first..=last).any(|offset| before.cell(from + offset) != vm.cell(to + offset)) {
+            return None;
+        }
+
+        let position = if shift < 0 { to + right + 1 } else { to - left };
+        let cells = if shift < 0 {
+            position..position - shift
+        } else {
+            position - shift..position
+        };
+        Some(Cycle {
+            period,
+            shift,
+            left,
+            right,
+            pattern: cells.map(|position| vm.cell(position)).collect(),
+            position,
+        })
+    }
+
+    /// How many of the next `periods` periods can be skipped from the head
+    /// position `head`, without any of them being able to write the `watch`
+    /// cell.
+    fn periods(&self, head: isize, mut periods: usize, watch: Option<usize>) -> usize {
+        if self.shift == 0 {
+            let watched = watch.is_some_and(|position| {
+                (head - self.left..=head + self.right).contains(&(position as isize))
+            });
+            return if watched { 0 } else { periods };
+        }
+
+        periods = periods.min(MAX_INSERTED / self.shift.unsigned_abs());
+        let Some(watch) = watch else {
+            return periods;
+        };
+
+        // mirror leftward cycles, so the head always moves right
+        let (watch, head, left, right) = if self.shift < 0 {
+            (-(watch as isize), -head, self.right, self.left)
+        } else {
+            (watch as isize, head, self.left, self.right)
+        };
+        if watch < head - left {
+            periods
+        } else if watch <= head + right {
+            0
+        } else {
+            // period i reaches up to `head + i * shift + right`
+            let clear = (watch - head - right - 1) as usize / self.shift.unsigned_abs() + 1;
+            periods.min(clear)
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::compile::Compiled;
+    use crate::testing::{self, Outcome};
+
+    /// Runs `vm` for at most `max_moves` moves like `tml --fast-forward`
+    /// does, and returns whether any moves were skipped.
+    fn run(
+        vm: &mut dyn Machine,
+        detector: Option<&mut Detector>,
+        max_moves: usize,
+        watch: Option<usize>,
+    ) -> bool {
+        if let Some(position) = watch {
+            vm.watch_cell(position);
+        }
+        let finished = |vm: &dyn Machine| watch.is_some_and(|at| vm.cell(at as isize) != 0);
+
+        let Some(detector) = detector else {
+            vm.run(max_moves);
+            return false;
+        };
+        let mut skipped = false;
+        while vm.moves() < max_moves && !finished(vm) {
+            let target = max_moves.min(detector.next_sample().max(vm.moves() + 1));
+            vm.run(target);
+            let moves = vm.moves();
+            if moves < target || detector.update(vm, max_moves, watch) {
+                break;
+            }
+            // verifying a cycle runs one period, which is never longer than
+            // the moves before it
+            skipped |= vm.moves() - moves > moves;
+        }
+        skipped
+    }
+
+    /// Fast-forwards `compiled` in both VMs, which have to end the same way
+    /// as without skipping anything.
+    fn fast_forward(
+        compiled: &Compiled,
+        max_moves: usize,
+        watch: Option<usize>,
+        bi_infinite: bool,
+    ) -> (Outcome, bool) {
+        let (mut rust, mut c) = testing::vms(compiled, bi_infinite);
+        run(&mut rust, None, max_moves, watch);
+        run(&mut c, None, max_moves, watch);
+        let expected = testing::finish(compiled, (rust, c));
+
+        let detector = || Detector::new(&compiled.bytes, bi_infinite);
+        let (mut rust, mut c) = testing::vms(compiled, bi_infinite);
+        let skipped = run(&mut rust, Some(&mut detector()), max_moves, watch);
+        assert_eq!(
+            run(&mut c, Some(&mut detector()), max_moves, watch),
+            skipped
+        );
+        let outcome = testing::finish(compiled, (rust, c));
+        assert_eq!(outcome, expected);
+        (outcome, skipped)
+    }
+
+    #[test]
+    fn skips_periods_that_shift_the_head() {
+        let right = "start { _ | '1' > '0' > | start }";
+        let compiled = testing::compile(right, "'x' 'x' 'x'");
+        // not a whole number of periods after the first sample
+        let (outcome, skipped) = fast_forward(&compiled, 1_000_003, None, false);
+        assert!(skipped);
+        assert_eq!(outcome.tape[..4], ["1", "0", "1", "0"]);
+
+        let left = "start { _ | '1' < '0' < | start }";
+        let compiled = testing::compile(left, "'x'");
+        let (outcome, skipped) = fast_forward(&compiled, 1_000_001, None, true);
+        assert!(skipped);
+        assert_eq!(outcome.head, -2_000_002);
+        // the copies would run into the left end
+        assert!(!fast_forward(&compiled, 100_000, None, false).1);
+    }
+
+    #[test]
+    fn doesnt_skip_over_cells_written_ahead() {
+        // every sample over the `x` cells looks like a cycle, until the `y`
+        // far ahead of the head is read
+        let machine = "
+start {
+    'y' | < | back,
+    _ | '1' > | start,
+}
+
+back {
+    _ | '0' < | back,
+}
+";
+        let mut compiled = testing::compile(machine, "'x' 'y'");
+        let (x, y) = (compiled.tape[0], compiled.tape[1]);
+        compiled.tape = vec![x; 200_000];
+        compiled.tape.push(y);
+        let (outcome, skipped) = fast_forward(&compiled, usize::MAX, None, false);
+        assert!(!skipped);
+        assert_eq!(outcome.moves, 400_000);
+    }
+
+    #[test]
+    fn stops_at_the_watched_cell() {
+        let compiled = testing::compile("start { _ | '1' > | start }", "");
+        let (outcome, skipped) = fast_forward(&compiled, usize::MAX, Some(500_001), false);
+        assert!(skipped);
+        assert_eq!(outcome.moves, 500_002);
+
+        // a watched cell behind the head can't stop anything
+        let machine = "start { _ | > | second } second { _ | '1' > | second }";
+        let compiled = testing::compile(machine, "");
+        let (outcome, skipped) = fast_forward(&compiled, 1_000_000, Some(0), false);
+        assert!(skipped);
+        assert_eq!(outcome.moves, 1_000_000);
+    }
+
+    #[test]
+    fn skips_periods_in_place() {
+        let compiled = testing::compile("start { _ | > < | start }", "");
+        // far more moves than could be run one by one
+        let max_moves = 1 << 50;
+        let (mut rust, mut c) = testing::vms(&compiled, false);
+        let detector = || Detector::new(&compiled.bytes, false);
+        assert!(run(&mut rust, Some(&mut detector()), max_moves, None));
+        assert!(run(&mut c, Some(&mut detector()), max_moves, None));
+        let outcome = testing::finish(&compiled, (rust, c));
+        assert_eq!((outcome.head, outcome.moves), (0, max_moves));
+    }
+}
@@ -32,3 +32,19 @@ impl Error {
         }
     }
 }
+
+impl std::fmt::Display for Error {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self.span {
+            Some(span) => write!(
+                f,
+                "{} ({}:{}:{})",
+                self.msg,
+                span.path.display(),
+                span.line + 1,
+                span.column + 1
+            ),
+            None => write!(f, "{}", self.msg),
+        }
+    }
+}
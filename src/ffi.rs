@@ -1,33 +1,513 @@
-use crate::vm::Simulated;
+use std::ffi::c_void;
+use std::marker::PhantomData;
+use std::ops::{Deref, Range};
+use std::ptr::NonNull;
+use std::slice;
 
+use crate::checkpoint::{self, Checkpoint};
+use crate::profile::Profile;
+use crate::vm::{Buffer, Machine, Simulated};
+
+#[repr(C)]
+struct VmContext {
+    _private: [u8; 0],
+}
+
+#[repr(C)]
+struct State {
+    _private: [u8; 0],
+}
+
+/// Declares the functions exported by vm.c, once for each build of it, and a
+/// `Backend` table so a `Vm` can pick a build at runtime.
+macro_rules! backends {
+    ($(fn $name:ident($($arg:ident: $ty:ty),* $(,)?) $(-> $ret:ty)?;)*) => {
+        struct Backend {
+            $($name: unsafe extern "C" fn($($ty),*) $(-> $ret)?,)*
+        }
+
+        mod wide {
+            use super::*;
+
+            extern "C" {
+                $(pub fn $name($($arg: $ty),*) $(-> $ret)?;)*
+            }
+        }
+
+        mod narrow {
+            use super::*;
+
+            extern "C" {
+                $(
+                    #[link_name = concat!(stringify!($name), "_u8")]
+                    pub fn $name($($arg: $ty),*) $(-> $ret)?;
+                )*
+            }
+        }
+
+        mod profiled {
+            use super::*;
+
+            extern "C" {
+                $(
+                    #[link_name = concat!(stringify!($name), "_profile")]
+                    pub fn $name($($arg: $ty),*) $(-> $ret)?;
+                )*
+            }
+        }
+
+        /// Two bytes per cell
+        static WIDE: Backend = Backend {
+            $($name: wide::$name,)*
+        };
+
+        /// One byte per cell, for machines with at most 256 symbols
+        static NARROW: Backend = Backend {
+            $($name: narrow::$name,)*
+        };
+
+        /// Two bytes per cell, with counters for `--profile`
+        static PROFILED: Backend = Backend {
+            $($name: profiled::$name,)*
+        };
+    };
+}
+
+backends! {
+    fn create_vm() -> *mut VmContext;
+    fn init_tape(vm: *mut VmContext, tape: *const u16, len: usize);
+    fn init_bytes(vm: *mut VmContext, bytes: *const u8, len: usize);
+    fn run(vm: *mut VmContext, max_moves: usize);
+    fn make_state(
+        vm: *mut VmContext,
+        address: u32,
+        states: *const *mut State,
+        state_count: usize,
+        symbols: *const u16,
+        symbol_count: usize,
+    ) -> *mut State;
+    fn retain_state(state: *mut State);
+    fn release_state(vm: *mut VmContext, state: *mut State);
+    fn set_state(
+        vm: *mut VmContext,
+        address: u32,
+        states: *const *mut State,
+        state_count: usize,
+        symbols: *const u16,
+        symbol_count: usize,
+    );
+    fn set_tape_head_position(vm: *mut VmContext, position: usize);
+    fn set_tape_origin(vm: *mut VmContext, origin: usize);
+    fn set_bi_infinite(vm: *mut VmContext, bi_infinite: bool);
+    fn set_sparse(vm: *mut VmContext, sparse: bool);
+    fn set_move_count(vm: *mut VmContext, moves: usize);
+    fn set_inlined_move_count(vm: *mut VmContext, moves: usize);
+    fn set_watch_cell(vm: *mut VmContext, position: usize);
+    fn get_final_address(vm: *mut VmContext) -> u32;
+    fn get_states(vm: *mut VmContext) -> *const *mut State;
+    fn get_state_count(vm: *mut VmContext) -> usize;
+    fn get_symbols(vm: *mut VmContext) -> *const u16;
+    fn get_symbol_count(vm: *mut VmContext) -> usize;
+    fn get_state_address(state: *mut State) -> u32;
+    fn get_state_children(state: *mut State) -> *const *mut State;
+    fn get_state_child_count(state: *mut State) -> usize;
+    fn get_state_symbols(state: *mut State) -> *const u16;
+    fn get_state_symbol_count(state: *mut State) -> usize;
+    fn copy_tape(vm: *mut VmContext, symbols: *mut u16);
+    fn take_tape(vm: *mut VmContext) -> *mut c_void;
+    fn free_tape(tape: *mut c_void);
+    fn get_tape_len(vm: *mut VmContext) -> usize;
+    fn get_tape_head_position(vm: *mut VmContext) -> usize;
+    fn get_tape_origin(vm: *mut VmContext) -> usize;
+    fn get_cell(vm: *mut VmContext, position: i64) -> u16;
+    fn insert_cells(
+        vm: *mut VmContext,
+        position: i64,
+        pattern: *const u16,
+        len: usize,
+        copies: usize,
+        left: bool,
+    );
+    fn get_bi_infinite(vm: *mut VmContext) -> bool;
+    fn get_move_count(vm: *mut VmContext) -> usize;
+    fn get_inlined_move_count(vm: *mut VmContext) -> usize;
+    fn restart(vm: *mut VmContext, tape: *const u16, len: usize);
+    fn cleanup(vm: *mut VmContext);
+}
+
+// only in the profiling build
 extern "C" {
-    fn init_tape(tape: *const u16, len: usize);
-    fn run(bytes: *const u8, max_moves: usize);
-    fn get_final_address() -> u32;
-    fn get_tape() -> *const u16;
-    fn get_tape_len() -> usize;
-    fn get_tape_head_position() -> usize;
-    fn get_move_count() -> usize;
-    fn cleanup();
-}
-
-pub fn simulate(bytes: &[u8], tape: &[u16], max_moves: usize) -> Simulated {
-    unsafe {
-        init_tape(tape.as_ptr(), tape.len());
-        run(bytes.as_ptr(), max_moves);
-
-        let mut tape = std::slice::from_raw_parts(get_tape(), get_tape_len()).to_vec();
+    fn init_profile(vm: *mut VmContext, len: usize);
+    fn copy_profile(
+        vm: *mut VmContext,
+        state_moves: *mut u64,
+        scan_moves: *mut u64,
+        arm_matches: *mut u64,
+        allocations: *mut u64,
+    );
+}
+
+/// A machine in the C VM. Every `Vm` owns its own context, so any number of
+/// them can run at the same time on different threads.
+pub struct Vm<'a> {
+    context: NonNull<VmContext>,
+    backend: &'static Backend,
+    /// The length of the bytecode, if the `Vm` is profiled
+    profile_len: Option<usize>,
+    bytes: PhantomData<&'a [u8]>,
+}
+
+// the context isn't shared with anything else, so it can move between threads
+unsafe impl Send for Vm<'_> {}
+
+impl<'a> Vm<'a> {
+    /// Stores the tape in one byte per cell if `symbol_count` allows it, and
+    /// in pages that are only allocated when written to if `sparse` is set.
+    /// With `profile`, the `Vm` uses the slower build of vm.c with counters.
+    pub fn new(
+        bytes: &'a [u8],
+        tape: &[u16],
+        symbol_count: usize,
+        bi_infinite: bool,
+        sparse: bool,
+        profile: bool,
+    ) -> Self {
+        let backend = if profile {
+            &PROFILED
+        } else if symbol_count <= 256 {
+            &NARROW
+        } else {
+            &WIDE
+        };
+        let context = NonNull::new(unsafe { (backend.create_vm)() }).expect("out of memory");
+        unsafe {
+            if profile {
+                init_profile(context.as_ptr(), bytes.len());
+            }
+            (backend.set_bi_infinite)(context.as_ptr(), bi_infinite);
+            (backend.set_sparse)(context.as_ptr(), sparse);
+            (backend.init_tape)(context.as_ptr(), tape.as_ptr(), tape.len());
+            (backend.init_bytes)(context.as_ptr(), bytes.as_ptr(), bytes.len());
+        }
+        Vm {
+            context,
+            backend,
+            profile_len: profile.then_some(bytes.len()),
+            bytes: PhantomData,
+        }
+    }
+
+    pub fn restore(
+        bytes: &'a [u8],
+        checkpoint: &Checkpoint,
+        symbol_count: usize,
+        sparse: bool,
+        profile: bool,
+    ) -> Self {
+        let vm = Vm::new(
+            bytes,
+            &checkpoint.tape,
+            symbol_count,
+            checkpoint.bi_infinite,
+            sparse,
+            profile,
+        );
+        let (context, backend) = (vm.context.as_ptr(), vm.backend);
+
+        let (node, nodes) = checkpoint
+            .states
+            .split_last()
+            .expect("checkpoint without a state");
+        unsafe {
+            // every parent owns a reference to each of its children, and the
+            // temporary references in `states` are released at the end
+            let mut states = Vec::with_capacity(nodes.len());
+            let children = |states: &Vec<*mut State>, indices: &[u32]| {
+                let children: Vec<_> = indices.iter().map(|&i| states[i as usize]).collect();
+                children
+                    .iter()
+                    .for_each(|&child| (backend.retain_state)(child));
+                children
+            };
+            for node in nodes {
+                let children = children(&states, &node.states);
+                states.push((backend.make_state)(
+                    context,
+                    node.address,
+                    children.as_ptr(),
+                    children.len(),
+                    node.symbols.as_ptr(),
+                    node.symbols.len(),
+                ));
+            }
+
+            let children = children(&states, &node.states);
+            (backend.set_state)(
+                context,
+                node.address,
+                children.as_ptr(),
+                children.len(),
+                node.symbols.as_ptr(),
+                node.symbols.len(),
+            );
+            for state in states {
+                (backend.release_state)(context, state);
+            }
+
+            (backend.set_tape_head_position)(context, checkpoint.head_position);
+            (backend.set_tape_origin)(context, checkpoint.origin);
+            (backend.set_move_count)(context, checkpoint.moves);
+            (backend.set_inlined_move_count)(context, checkpoint.inlined);
+        }
+        vm
+    }
+
+    /// The tape widened to one `u16` per cell, with the trailing blank cells
+    /// removed.
+    pub fn tape(&self) -> Vec<u16> {
+        let context = self.context.as_ptr();
+        let mut tape = vec![0; unsafe { (self.backend.get_tape_len)(context) }];
+        unsafe { (self.backend.copy_tape)(context, tape.as_mut_ptr()) };
         while let Some(0) = tape.last() {
             tape.pop();
         }
+        tape
+    }
+
+    /// Takes the tape out of the context, without copying it unless it's
+    /// sparse. The `Vm` can only be restarted after that.
+    fn take_tape(&mut self) -> Buffer {
+        let context = self.context.as_ptr();
+        let len = unsafe { (self.backend.get_tape_len)(context) };
+        let Some(cells) = NonNull::new(unsafe { (self.backend.take_tape)(context) }) else {
+            return Buffer::Owned(self.tape());
+        };
+
+        let backend = self.backend;
+        if std::ptr::eq(backend, &NARROW) {
+            Buffer::Narrow(Tape {
+                cells: cells.cast(),
+                len,
+                backend,
+            })
+        } else {
+            Buffer::Wide(Tape {
+                cells: cells.cast(),
+                len,
+                backend,
+            })
+        }
+    }
 
-        cleanup();
+    pub fn head_position(&self) -> usize {
+        unsafe { (self.backend.get_tape_head_position)(self.context.as_ptr()) }
+    }
+
+    pub fn origin(&self) -> usize {
+        unsafe { (self.backend.get_tape_origin)(self.context.as_ptr()) }
+    }
+
+    pub fn final_address(&self) -> u32 {
+        unsafe { (self.backend.get_final_address)(self.context.as_ptr()) }
+    }
 
+    /// Takes the result out of the context like `Machine::finish()`, but
+    /// keeps the context, which can only be restarted after that.
+    pub fn take_result(&mut self) -> Simulated {
+        let (origin, head) = (self.origin(), self.head_position());
+        let (final_address, moves) = (self.final_address(), self.moves());
+        let inlined = unsafe { (self.backend.get_inlined_move_count)(self.context.as_ptr()) };
         Simulated {
-            tape,
-            head_position: get_tape_head_position(),
-            final_address: get_final_address(),
-            moves: get_move_count(),
+            inlined,
+            ..Simulated::new(self.take_tape(), origin, head, final_address, moves)
         }
     }
+
+    /// Starts the machine over on `tape`, without decoding the bytecode
+    /// again, so one `Vm` can run a machine on many tapes.
+    pub fn restart(&mut self, tape: &[u16]) {
+        unsafe { (self.backend.restart)(self.context.as_ptr(), tape.as_ptr(), tape.len()) }
+    }
+}
+
+impl Machine for Vm<'_> {
+    fn run(&mut self, max_moves: usize) {
+        unsafe { (self.backend.run)(self.context.as_ptr(), max_moves) }
+    }
+
+    fn moves(&self) -> usize {
+        unsafe { (self.backend.get_move_count)(self.context.as_ptr()) }
+    }
+
+    fn cell(&self, position: isize) -> u16 {
+        unsafe { (self.backend.get_cell)(self.context.as_ptr(), position as i64) }
+    }
+
+    fn written(&self) -> Range<isize> {
+        let context = self.context.as_ptr();
+        let (len, origin) = unsafe {
+            (
+                (self.backend.get_tape_len)(context) as isize,
+                (self.backend.get_tape_origin)(context) as isize,
+            )
+        };
+        -origin..len - origin
+    }
+
+    fn head(&self) -> isize {
+        self.head_position() as isize - self.origin() as isize
+    }
+
+    fn address(&self) -> Option<u32> {
+        let context = self.context.as_ptr();
+        unsafe {
+            let simple = (self.backend.get_state_count)(context) == 0
+                && (self.backend.get_symbol_count)(context) == 0;
+            simple.then(|| (self.backend.get_final_address)(context))
+        }
+    }
+
+    fn insert_cells(
+        &mut self,
+        position: isize,
+        pattern: &[u16],
+        copies: usize,
+        left: bool,
+        moves: usize,
+    ) {
+        let context = self.context.as_ptr();
+        unsafe {
+            (self.backend.insert_cells)(
+                context,
+                position as i64,
+                pattern.as_ptr(),
+                pattern.len(),
+                copies,
+                left,
+            );
+            (self.backend.set_move_count)(context, self.moves() + moves);
+        }
+    }
+
+    fn watch_cell(&mut self, position: usize) {
+        unsafe { (self.backend.set_watch_cell)(self.context.as_ptr(), position) }
+    }
+
+    fn profile(&self) -> Option<Profile> {
+        let len = self.profile_len?;
+        let (mut moves, mut scans) = (vec![0; len], vec![0; len]);
+        let (mut arms, mut allocations) = (vec![0; len], vec![0; len]);
+        unsafe {
+            copy_profile(
+                self.context.as_ptr(),
+                moves.as_mut_ptr(),
+                scans.as_mut_ptr(),
+                arms.as_mut_ptr(),
+                allocations.as_mut_ptr(),
+            )
+        };
+        Some(Profile::from_arrays(&moves, &scans, &arms, &allocations))
+    }
+
+    fn checkpoint(&self, hash: u64, halted: bool) -> Checkpoint {
+        unsafe fn parts<T: Copy>(data: *const T, len: usize) -> Vec<T> {
+            if len == 0 {
+                Vec::new()
+            } else {
+                slice::from_raw_parts(data, len).to_vec()
+            }
+        }
+
+        let (context, backend) = (self.context.as_ptr(), self.backend);
+        let states = unsafe {
+            let root = (
+                (backend.get_final_address)(context),
+                parts(
+                    (backend.get_states)(context),
+                    (backend.get_state_count)(context),
+                ),
+                parts(
+                    (backend.get_symbols)(context),
+                    (backend.get_symbol_count)(context),
+                ),
+            );
+            checkpoint::flatten(
+                root,
+                |state| state as usize,
+                |state| {
+                    (
+                        (backend.get_state_address)(state),
+                        parts(
+                            (backend.get_state_children)(state),
+                            (backend.get_state_child_count)(state),
+                        ),
+                        parts(
+                            (backend.get_state_symbols)(state),
+                            (backend.get_state_symbol_count)(state),
+                        ),
+                    )
+                },
+            )
+        };
+
+        Checkpoint {
+            hash,
+            moves: self.moves(),
+            inlined: unsafe { (backend.get_inlined_move_count)(context) },
+            halted,
+            head_position: self.head_position(),
+            origin: self.origin(),
+            bi_infinite: unsafe { (backend.get_bi_infinite)(context) },
+            tape: self.tape(),
+            states,
+        }
+    }
+
+    fn finish(mut self) -> Simulated {
+        self.take_result()
+    }
+}
+
+/// A tape taken from a context, in the cells of the build of vm.c it was
+/// run in, which also frees it.
+pub struct Tape<T> {
+    cells: NonNull<T>,
+    len: usize,
+    backend: &'static Backend,
+}
+
+// like contexts, tapes aren't shared with anything else
+unsafe impl<T> Send for Tape<T> {}
+
+impl<T> Deref for Tape<T> {
+    type Target = [T];
+
+    fn deref(&self) -> &[T] {
+        unsafe { slice::from_raw_parts(self.cells.as_ptr(), self.len) }
+    }
+}
+
+impl<T> Drop for Tape<T> {
+    fn drop(&mut self) {
+        unsafe { (self.backend.free_tape)(self.cells.as_ptr().cast()) }
+    }
+}
+
+impl Drop for Vm<'_> {
+    fn drop(&mut self) {
+        unsafe { (self.backend.cleanup)(self.context.as_ptr()) }
+    }
+}
+
+pub fn simulate(
+    bytes: &[u8],
+    tape: &[u16],
+    symbol_count: usize,
+    max_moves: usize,
+    bi_infinite: bool,
+    sparse: bool,
+) -> Simulated {
+    let mut vm = Vm::new(bytes, tape, symbol_count, bi_infinite, sparse, false);
+    vm.run(max_moves);
+    vm.finish()
 }
@@ -0,0 +1,434 @@
+use std::collections::HashMap;
+
+use crate::parse::{Name, Op, Pattern, State, ToState};
+
+/// Most states inlined into one arm, so forwarding loops like
+/// `a { _ | | b }` and `b { _ | | a }` still compile
+const MAX_INLINED: usize = 16;
+
+/// Largest state an arm goes to after inlining, counting its arguments, so
+/// arms still compile: inlining a state that passes a state parameter on
+/// twice doubles it
+const MAX_SIZE: usize = 64;
+
+/// Inlines transit states into the arms that go to them, for `--inline`. If
+/// the arm that matches in the state an arm goes to is known at compile time
+/// and has no ops, the arm goes straight to where that arm goes: states like
+/// `_ | | next`, or `x | | A` called right after writing `x`. The symbol
+/// under the head is known after a write, or if the arm doesn't move, and a
+/// catchall matches any symbol.
+///
+/// Each arm counts the states inlined into it in `Arm::inlined`, for the VMs
+/// to count their moves, and keeps where it went before in `Arm::uninlined`,
+/// which the VMs go to instead if the inlined moves would pass the move limit.
+/// Returns the number of arms changed.
+pub fn inline(unit: &mut [State]) -> usize {
+    let definitions: HashMap<_, _> = unit
+        .iter()
+        .map(|state| {
+            let signature = (
+                state.name.name,
+                state.state_params.len(),
+                state.symbol_params.len(),
+            );
+            (signature, state)
+        })
+        .collect();
+
+    let mut inlined = Vec::new();
+    for (i, state) in unit.iter().enumerate() {
+        let params: Vec<_> = state.state_params.iter().map(|param| param.name).collect();
+        for (j, arm) in state.arms.iter().enumerate() {
+            let cell = cell(&arm.pattern, &arm.ops);
+            let max_size = MAX_SIZE.max(size(&arm.to_state));
+            let mut to_state = None;
+            let mut n = 0;
+            while n < MAX_INLINED {
+                let from = to_state.as_ref().unwrap_or(&arm.to_state);
+                match inline_one(from, cell.as_ref(), &params, &definitions) {
+                    Some(next) if size(&next) <= max_size => to_state = Some(next),
+                    _ => break,
+                }
+                n += 1;
+            }
+            if let Some(to_state) = to_state {
+                inlined.push((i, j, to_state, n));
+            }
+        }
+    }
+
+    let changed = inlined.len();
+    for (i, j, to_state, n) in inlined {
+        let arm = &mut unit[i].arms[j];
+        arm.uninlined = Some(std::mem::replace(&mut arm.to_state, to_state));
+        arm.inlined = n;
+    }
+    changed
+}
+
+/// The symbol under the head after an arm with `pattern` and `ops` ran, if
+/// it's known at compile time. A name is a symbol parameter or the catchall
+/// of the state the arm is in.
+fn cell(pattern: &Pattern, ops: &[Op]) -> Option<Pattern> {
+    match ops.last() {
+        None => Some(pattern.clone()),
+        Some(Op::Symbol(symbol)) => Some(Pattern::Symbol(symbol.clone())),
+        Some(Op::Name(name)) => Some(Pattern::Name(name.clone())),
+        Some(Op::Left(_) | Op::Right(_)) => None,
+    }
+}
+
+/// The number of states and symbols in `to_state`, counting its arguments.
+fn size(to_state: &ToState) -> usize {
+    match to_state {
+        ToState::State {
+            state_args,
+            symbol_args,
+            ..
+        } => 1 + symbol_args.len() + state_args.iter().map(size).sum::<usize>(),
+        _ => 1,
+    }
+}
+
+/// Where an arm that goes to `to_state` goes instead if that state can be
+/// inlined, with `cell` under the head. `params` are the state parameters of
+/// the state the arm is in.
+fn inline_one(
+    to_state: &ToState,
+    cell: Option<&Pattern>,
+    params: &[&'static str],
+    definitions: &HashMap<(&'static str, usize, usize), &State>,
+) -> Option<ToState> {
+    let ToState::State {
+        name,
+        state_args,
+        symbol_args,
+    } = to_state
+    else {
+        return None;
+    };
+    if params.contains(&name.name) {
+        // a state argument, which is only known at runtime
+        return None;
+    }
+    let target = definitions.get(&(name.name, state_args.len(), symbol_args.len()))?;
+
+    let symbol_param = |name: &str| {
+        let index = target
+            .symbol_params
+            .iter()
+            .position(|param| param.name == name)?;
+        Some(&symbol_args[index])
+    };
+    let mut bound = None;
+    let mut matched = None;
+    for (i, arm) in target.arms.iter().enumerate() {
+        let matches = match &arm.pattern {
+            pattern @ Pattern::Symbol(_) => same(cell?, pattern)?,
+            Pattern::Name(name) => match symbol_param(name.name) {
+                Some(arg) => same(cell?, arg)?,
+                None if i == target.arms.len() - 1 => {
+                    bound = Some(name.name);
+                    true
+                }
+                // only the last arm can be a catchall, which `compile()`
+                // reports
+                None => return None,
+            },
+        };
+        if matches {
+            matched = Some(arm);
+            break;
+        }
+    }
+    let matched = matched?;
+    if !matched.ops.is_empty() {
+        return None;
+    }
+
+    let env = Env {
+        state_params: &target.state_params,
+        state_args,
+        symbol_params: &target.symbol_params,
+        symbol_args,
+        bound: bound.map(|name| (name, cell)),
+        params,
+    };
+    env.substitute(&matched.to_state)
+}
+
+/// Whether two symbols known at compile time are the same, or `None` if
+/// that's only known at runtime.
+fn same(a: &Pattern, b: &Pattern) -> Option<bool> {
+    match (a, b) {
+        (Pattern::Symbol(a), Pattern::Symbol(b)) => Some(a.symbol == b.symbol),
+        (Pattern::Name(a), Pattern::Name(b)) if a.name == b.name => Some(true),
+        _ => None,
+    }
+}
+
+/// The parameters of an inlined state, with the arguments of the arm that
+/// goes to it, which are in the scope of the state that arm is in.
+struct Env<'a> {
+    state_params: &'a [Name],
+    state_args: &'a [ToState],
+    symbol_params: &'a [Name],
+    symbol_args: &'a [Pattern],
+    /// The catchall of the matched arm and the symbol it matched
+    bound: Option<(&'static str, Option<&'a Pattern>)>,
+    /// State parameters of the state the arm is in, which would shadow the
+    /// states the inlined arm goes to
+    params: &'a [&'static str],
+}
+
+impl Env<'_> {
+    fn substitute(&self, to_state: &ToState) -> Option<ToState> {
+        let ToState::State {
+            name,
+            state_args,
+            symbol_args,
+        } = to_state
+        else {
+            return Some(to_state.clone());
+        };
+
+        if let Some(index) = self
+            .state_params
+            .iter()
+            .position(|param| param.name == name.name)
+        {
+            return state_args
+                .is_empty()
+                .then(|| self.state_args[index].clone());
+        }
+        if self.params.contains(&name.name) {
+            return None;
+        }
+
+        let state_args = state_args
+            .iter()
+            .map(|arg| self.substitute(arg))
+            .collect::<Option<_>>()?;
+        let symbol_args = symbol_args
+            .iter()
+            .map(|arg| match arg {
+                Pattern::Symbol(_) => Some(arg.clone()),
+                Pattern::Name(name) => self.symbol(name),
+            })
+            .collect::<Option<_>>()?;
+        Some(ToState::State {
+            name: name.clone(),
+            state_args,
+            symbol_args,
+        })
+    }
+
+    fn symbol(&self, name: &Name) -> Option<Pattern> {
+        if let Some(index) = self
+            .symbol_params
+            .iter()
+            .position(|param| param.name == name.name)
+        {
+            return Some(self.symbol_args[index].clone());
+        }
+        match self.bound {
+            Some((bound, cell)) if bound == name.name => cell.cloned(),
+            _ => None,
+        }
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::{compile, optimize, specialize, testing};
+
+    fn target(to_state: &ToState) -> String {
+        let ToState::State {
+            name,
+            state_args,
+            symbol_args,
+        } = to_state
+        else {
+            return "!".to_string();
+        };
+        if state_args.is_empty() && symbol_args.is_empty() {
+            return name.name.to_string();
+        }
+        let states: Vec<_> = state_args.iter().map(target).collect();
+        let symbols: Vec<_> = symbol_args
+            .iter()
+            .map(|arg| match arg {
+                Pattern::Symbol(symbol) => format!("'{}'", symbol.symbol),
+                Pattern::Name(name) => name.name.to_string(),
+            })
+            .collect();
+        format!(
+            "{}({}; {})",
+            name.name,
+            states.join(", "),
+            symbols.join(", ")
+        )
+    }
+
+    /// Where the arms of each state go, like `a -> b(; 'x') +2` for an arm
+    /// of `a` with two states inlined into it.
+    fn arms(unit: &[State], uninlined: bool) -> Vec<String> {
+        let arms = unit.iter().flat_map(|state| {
+            let from = state.name.name;
+            state
+                .arms
+                .iter()
+                .map(move |arm| match (arm.inlined, uninlined) {
+                    (0, _) => format!("{from} -> {}", target(&arm.to_state)),
+                    (_, true) => format!("{from} -> {}", target(arm.uninlined.as_ref().unwrap())),
+                    (n, false) => format!("{from} -> {} +{n}", target(&arm.to_state)),
+                })
+        });
+        arms.collect()
+    }
+
+    fn inlined(code: &'static str) -> Vec<String> {
+        let mut unit = testing::unit(code);
+        let before = arms(&unit, false);
+        let changed = inline(&mut unit);
+        // the VMs go where the arm went before if the inlined moves would
+        // pass the move limit
+        assert_eq!(arms(&unit, true), before);
+        let arms = arms(&unit, false);
+        assert_eq!(changed, arms.iter().filter(|arm| arm.contains('+')).count());
+        arms
+    }
+
+    #[test]
+    fn follows_arms_without_ops() {
+        // `c` could see anything, and `d` only knows its cell after a write
+        let machine = "
+start { _ | | a }
+a { _ | | b }
+b { _ | > | c }
+c { '1' | | d, _ | | d }
+d { '1' | | !, _ | '1' | d }
+";
+        assert_eq!(
+            inlined(machine),
+            [
+                "start -> b +1",
+                "a -> b",
+                "b -> c",
+                "c -> ! +1",
+                "c -> d",
+                "d -> !",
+                "d -> ! +1",
+            ]
+        );
+    }
+
+    #[test]
+    fn matches_the_symbol_under_the_head() {
+        // written, matched without moving, passed as an argument, or bound
+        // by a catchall
+        let machine = "
+start { 'x' | | is(; 'x'), _ | 'y' | is(; 'x') }
+is(; s) { s | | yes(; s), _ | | no }
+yes(; s) { _ | | echo(; s) }
+echo(; s) { c | | done(; c, s) }
+done(; a, b) { _ | > | ! }
+no { _ | > | ! }
+";
+        assert_eq!(
+            inlined(machine),
+            [
+                "start -> done(; 'x', 'x') +3",
+                "start -> no +1",
+                "is -> done(; s, s) +2",
+                "is -> no",
+                "yes -> done(; _, s) +1",
+                "echo -> done(; c, s)",
+                "done -> !",
+                "no -> !",
+            ]
+        );
+    }
+
+    #[test]
+    fn substitutes_state_arguments() {
+        let machine = "
+start { _ | | call(back; 'x') }
+call(k; s) { _ | s | k }
+back { 'x' | | then(start), _ | > | ! }
+then(k) { _ | | k }
+caller(k) { _ | | then(k) }
+";
+        assert_eq!(
+            inlined(machine),
+            [
+                "start -> call(back; 'x')",
+                "call -> k",
+                "back -> call(back; 'x') +2",
+                "back -> !",
+                "then -> k",
+                "caller -> k +1",
+            ]
+        );
+    }
+
+    #[test]
+    fn stops_before_arms_get_too_big_to_compile() {
+        // every state `dup` is inlined into passes `k` on twice more
+        let machine = "
+start { _ | | dup(stop) }
+dup(k) { _ | | dup(pair(k, k)) }
+pair(a, b) { _ | > | a }
+stop { _ | > | ! }
+";
+        let mut unit = testing::unit(machine);
+        inline(&mut unit);
+        let arm = &unit[0].arms[0];
+        assert!(arm.inlined > 0 && size(&arm.to_state) <= MAX_SIZE);
+        compile::compile(unit, &[]).unwrap();
+
+        // forwarding loops only stop at `MAX_INLINED`
+        let mut unit = testing::unit("start { _ | | a } a { _ | | start }");
+        assert_eq!(inline(&mut unit), 2);
+        assert_eq!(unit[0].arms[0].inlined, MAX_INLINED);
+        compile::compile(unit, &[]).unwrap();
+    }
+
+    #[test]
+    fn runs_like_the_machine_without_inlining() {
+        let machine = "
+start { _ | | a }
+a { _ | | b }
+b { _ | | c }
+c { 'x' | | !, _ | '1' | d }
+d { '1' | | e, _ | > | d }
+e { _ | > | start }
+";
+        let tape = "'0' '0' '0' '0' '0' 'x'";
+        let expected = testing::compile(machine, tape);
+        assert_eq!(testing::run(&expected, usize::MAX).moves, 34);
+        for (specialize, level) in [(false, 0), (true, 0), (false, 2), (true, 2)] {
+            let mut unit = testing::unit(machine);
+            inline(&mut unit);
+            let symbols = testing::tape(tape);
+            let mut compiled = if specialize {
+                specialize::compile(unit, &symbols, 4096).unwrap()
+            } else {
+                compile::compile(unit, &symbols).unwrap()
+            };
+            compiled.tape = compiled.intern(&symbols).unwrap();
+            optimize::optimize(&mut compiled, level);
+
+            // runs that stop inside the inlined states end where they would
+            // have without inlining
+            for max_moves in (0..40).chain([usize::MAX]) {
+                assert_eq!(
+                    testing::run(&compiled, max_moves),
+                    testing::run(&expected, max_moves),
+                    "{max_moves} moves"
+                );
+            }
+        }
+    }
+}
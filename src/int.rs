@@ -1,13 +1,20 @@
 use std::cmp::Ordering;
-use std::ops::{Add, Mul, Sub};
-use std::str::FromStr;
-use std::{fmt, iter};
+use std::ops::{Add, Mul, Shl, Shr, Sub};
 
-use crate::decimal::Decimal;
-use crate::digit::Digit::{self, *};
+const LIMB_BITS: u32 = u64::BITS;
 
+/// Decimal digits that fit in one limb, and `10^DECIMAL_LIMB_DIGITS`.
+const DECIMAL_LIMB_DIGITS: usize = 19;
+const DECIMAL_LIMB: u64 = 10_000_000_000_000_000_000;
+
+/// Below this many limbs, `to_decimal` divides by `DECIMAL_LIMB` limb by limb
+/// instead of splitting the number in halves.
+const SPLIT_THRESHOLD: usize = 32;
+
+/// An arbitrary precision unsigned integer, stored as 64-bit limbs with the
+/// least significant limb first and no leading zero limbs.
 #[derive(Clone, Debug, PartialEq, Eq)]
-pub struct Int(Vec<Digit>);
+pub struct Int(Vec<u64>);
 
 impl Int {
     pub fn zero() -> Int {
@@ -15,16 +22,18 @@ impl Int {
     }
 
     pub fn one() -> Int {
-        Int(vec![One])
+        Int(vec![1])
     }
 
-    pub fn from_hex_digit(c: char) -> Int {
-        match c {
-            '0'..='9' => Int::from(c as usize - '0' as usize),
-            'a'..='f' => Int::from(c as usize - 'a' as usize + 10),
-            'A'..='F' => Int::from(c as usize - 'A' as usize + 10),
-            _ => panic!("not a hex digit"),
-        }
+    pub fn is_zero(&self) -> bool {
+        self.0.is_empty()
+    }
+
+    /// The number of bits needed to write `self` in binary.
+    pub fn bits(&self) -> u64 {
+        self.0.last().map_or(0, |&top| {
+            (self.0.len() as u64 - 1) * LIMB_BITS as u64 + (LIMB_BITS - top.leading_zeros()) as u64
+        })
     }
 
     pub fn pow(&self, mut exp: u64) -> Int {
@@ -45,92 +54,221 @@ impl Int {
         &acc * &base
     }
 
-    pub fn times_ten(mut self) -> Int {
-        self.0.insert(0, Zero);
-        self
+    /// Sets `self` to `self * mul + add`.
+    pub fn mul_add_small(&mut self, mul: u64, add: u64) {
+        let mut carry = add as u128;
+        for limb in &mut self.0 {
+            let prod = *limb as u128 * mul as u128 + carry;
+            *limb = prod as u64;
+            carry = prod >> LIMB_BITS;
+        }
+        if carry != 0 {
+            self.0.push(carry as u64);
+        }
+        self.normalize();
     }
 
-    pub fn divmod(&self, denom: &Int) -> (Digit, Int) {
-        let mut digit = Zero;
-        let mut prod = Int::zero();
-        while digit < Nine {
-            let next = &prod + denom;
-            if &next > self {
-                break;
-            }
-            digit.increment();
-            prod = next;
+    /// Divides `self` by `div` in place and returns the remainder.
+    fn div_small(&mut self, div: u64) -> u64 {
+        assert!(div != 0, "divide by zero");
+
+        let mut rem = 0u128;
+        for limb in self.0.iter_mut().rev() {
+            let num = rem << LIMB_BITS | *limb as u128;
+            *limb = (num / div as u128) as u64;
+            rem = num % div as u128;
         }
-        let rem = self - &prod;
-        (digit, rem)
+        self.normalize();
+        rem as u64
     }
 
-    pub fn inverse(&self, len: usize) -> Decimal {
-        assert!(!self.0.is_empty(), "divide by zero");
+    pub fn divmod(&self, denom: &Int) -> (Int, Int) {
+        assert!(!denom.is_zero(), "divide by zero");
 
-        let mut digits = Vec::new();
-        let mut minuend = Int::from(10);
-        for _ in 0..len {
-            let (digit, rem) = minuend.divmod(self);
-            digits.push(digit);
-            minuend = rem.times_ten();
+        if self < denom {
+            (Int::zero(), self.clone())
+        } else if denom.0.len() == 1 {
+            let mut quot = self.clone();
+            let rem = quot.div_small(denom.0[0]);
+            (quot, Int::from(rem))
+        } else {
+            self.long_divmod(denom)
         }
-        digits.reverse();
-        Decimal::new(digits)
     }
 
-    pub fn digits(&self) -> &[Digit] {
-        &self.0
-    }
-}
+    /// Knuth's algorithm D, for denominators with at least two limbs.
+    fn long_divmod(&self, denom: &Int) -> (Int, Int) {
+        let n = denom.0.len();
+        let m = self.0.len() - n;
 
-impl fmt::Display for Int {
-    fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
-        if self.0.is_empty() {
-            write!(f, "0")
-        } else {
-            for &digit in self.0.iter().rev() {
-                write!(f, "{}", char::from(digit))?;
+        // normalize so the top limb of the denominator has its high bit set,
+        // which keeps every estimated quotient limb at most 2 too big
+        let shift = denom.0[n - 1].leading_zeros();
+        let v = shl_limbs(&denom.0, shift);
+        let mut u = shl_limbs(&self.0, shift);
+        u.resize(self.0.len() + 1, 0);
+
+        let mut quot = vec![0; m + 1];
+        for j in (0..=m).rev() {
+            let num = (u[j + n] as u128) << LIMB_BITS | u[j + n - 1] as u128;
+            let mut qhat = num / v[n - 1] as u128;
+            let mut rhat = num % v[n - 1] as u128;
+            while qhat >> LIMB_BITS != 0
+                || qhat * v[n - 2] as u128 > (rhat << LIMB_BITS | u[j + n - 2] as u128)
+            {
+                qhat -= 1;
+                rhat += v[n - 1] as u128;
+                if rhat >> LIMB_BITS != 0 {
+                    break;
+                }
+            }
+
+            // u[j..=j + n] -= qhat * v
+            let mut borrow = false;
+            let mut carry = 0u128;
+            for i in 0..n {
+                let prod = qhat * v[i] as u128 + carry;
+                carry = prod >> LIMB_BITS;
+                let (diff, b1) = u[i + j].overflowing_sub(prod as u64);
+                let (diff, b2) = diff.overflowing_sub(borrow as u64);
+                u[i + j] = diff;
+                borrow = b1 || b2;
+            }
+            let (diff, b1) = u[j + n].overflowing_sub(carry as u64);
+            let (diff, b2) = diff.overflowing_sub(borrow as u64);
+            u[j + n] = diff;
+
+            // qhat was one too big, so add v back once
+            if b1 || b2 {
+                qhat -= 1;
+                let mut carry = false;
+                for i in 0..n {
+                    let (sum, c1) = u[i + j].overflowing_add(v[i]);
+                    let (sum, c2) = sum.overflowing_add(carry as u64);
+                    u[i + j] = sum;
+                    carry = c1 || c2;
+                }
+                u[j + n] = u[j + n].wrapping_add(carry as u64);
             }
-            Ok(())
+
+            quot[j] = qhat as u64;
+        }
+
+        u.truncate(n);
+        let mut rem = Int(shr_limbs(&u, shift));
+        rem.normalize();
+        let mut quot = Int(quot);
+        quot.normalize();
+        (quot, rem)
+    }
+
+    /// Formats `self` as exactly `width` decimal digits, with leading zeros.
+    /// `self` must be less than `10^width`.
+    pub fn to_decimal(&self, width: usize) -> String {
+        // powers[k] is 10^(DECIMAL_LIMB_DIGITS * 2^k)
+        let mut powers = vec![Int::from(DECIMAL_LIMB)];
+        while DECIMAL_LIMB_DIGITS << powers.len() < width {
+            let last = powers.last().unwrap();
+            powers.push(last * last);
+        }
+
+        let mut digits = String::with_capacity(DECIMAL_LIMB_DIGITS << powers.len());
+        to_decimal_impl(self.clone(), &powers, powers.len(), &mut digits);
+
+        let padding = digits.len() - width;
+        assert!(
+            digits.bytes().take(padding).all(|digit| digit == b'0'),
+            "`Int` has more than {width} digits"
+        );
+        digits.split_off(padding)
+    }
+
+    fn normalize(&mut self) {
+        while self.0.last() == Some(&0) {
+            self.0.pop();
         }
     }
 }
 
-impl From<usize> for Int {
-    fn from(mut i: usize) -> Int {
-        let mut int = Vec::new();
-        while i != 0 {
-            int.push(unsafe { Digit::new_unchecked(i % 10) });
-            i /= 10;
+/// Appends exactly `DECIMAL_LIMB_DIGITS * 2^level` digits of `int`, splitting
+/// it in halves of `powers[level - 1]` until the halves are small.
+fn to_decimal_impl(mut int: Int, powers: &[Int], level: usize, digits: &mut String) {
+    if level == 0 || int.0.len() < SPLIT_THRESHOLD {
+        let mut chunks = Vec::with_capacity(1 << level);
+        for _ in 0..1 << level {
+            chunks.push(int.div_small(DECIMAL_LIMB));
         }
-        Int(int)
+        assert!(int.is_zero());
+        for chunk in chunks.iter().rev() {
+            digits.push_str(&format!("{chunk:019}"));
+        }
+    } else {
+        let (high, low) = int.divmod(&powers[level - 1]);
+        to_decimal_impl(high, powers, level - 1, digits);
+        to_decimal_impl(low, powers, level - 1, digits);
+    }
+}
+
+fn shl_limbs(limbs: &[u64], shift: u32) -> Vec<u64> {
+    if shift == 0 {
+        return limbs.to_vec();
+    }
+    let mut shifted = Vec::with_capacity(limbs.len() + 1);
+    let mut carry = 0;
+    for &limb in limbs {
+        shifted.push(limb << shift | carry);
+        carry = limb >> (LIMB_BITS - shift);
+    }
+    if carry != 0 {
+        shifted.push(carry);
+    }
+    shifted
+}
+
+fn shr_limbs(limbs: &[u64], shift: u32) -> Vec<u64> {
+    if shift == 0 {
+        return limbs.to_vec();
+    }
+    let mut shifted = vec![0; limbs.len()];
+    for i in 0..limbs.len() {
+        let high = limbs
+            .get(i + 1)
+            .map_or(0, |&limb| limb << (LIMB_BITS - shift));
+        shifted[i] = limbs[i] >> shift | high;
+    }
+    shifted
+}
+
+impl From<u64> for Int {
+    fn from(i: u64) -> Int {
+        let mut int = Int(vec![i]);
+        int.normalize();
+        int
     }
 }
 
 impl Add for &Int {
     type Output = Int;
     fn add(self, rhs: &Int) -> Int {
-        if self.0.len() < rhs.0.len() {
-            add_impl(&rhs.0, &self.0)
+        let (big, small) = if self.0.len() < rhs.0.len() {
+            (rhs, self)
         } else {
-            add_impl(&self.0, &rhs.0)
-        }
-    }
-}
+            (self, rhs)
+        };
 
-fn add_impl(big: &[Digit], small: &[Digit]) -> Int {
-    let mut sum = Vec::with_capacity(big.len() + 1);
-    let mut digit;
-    let mut carry = false;
-    for (&a, &b) in big.iter().zip(small.iter().chain(iter::repeat(&Zero))) {
-        (digit, carry) = a.carrying_add(b, carry);
-        sum.push(digit);
-    }
-    if carry {
-        sum.push(One);
+        let mut sum = Vec::with_capacity(big.0.len() + 1);
+        let mut carry = false;
+        for (i, &a) in big.0.iter().enumerate() {
+            let (digit, c1) = a.overflowing_add(small.0.get(i).copied().unwrap_or(0));
+            let (digit, c2) = digit.overflowing_add(carry as u64);
+            sum.push(digit);
+            carry = c1 || c2;
+        }
+        if carry {
+            sum.push(1);
+        }
+        Int(sum)
     }
-    Int(sum)
 }
 
 impl Sub for &Int {
@@ -138,85 +276,196 @@ impl Sub for &Int {
     fn sub(self, rhs: &Int) -> Int {
         assert!(self >= rhs, "overflow when subtracting `Int`s");
 
-        let mut digits = self.0.clone();
-        let mut diff = Vec::new();
-        for (mut i, &b) in rhs
-            .0
-            .iter()
-            .chain(iter::repeat(&Zero))
-            .enumerate()
-            .take(digits.len())
-        {
-            let (digit, carry) = digits[i].carrying_sub(b);
+        let mut diff = Vec::with_capacity(self.0.len());
+        let mut borrow = false;
+        for (i, &a) in self.0.iter().enumerate() {
+            let (digit, b1) = a.overflowing_sub(rhs.0.get(i).copied().unwrap_or(0));
+            let (digit, b2) = digit.overflowing_sub(borrow as u64);
             diff.push(digit);
-            if carry {
-                i += 1;
-                while digits[i].wrapping_decrement() {
-                    i += 1;
-                }
-            }
+            borrow = b1 || b2;
         }
 
-        while diff.last() == Some(&Zero) {
-            diff.pop();
-        }
-        Int(diff)
+        let mut diff = Int(diff);
+        diff.normalize();
+        diff
     }
 }
 
 impl Mul for &Int {
     type Output = Int;
     fn mul(self, rhs: &Int) -> Int {
-        let mut prod = Int::zero();
+        if self.is_zero() || rhs.is_zero() {
+            return Int::zero();
+        }
+
+        let mut prod = vec![0; self.0.len() + rhs.0.len()];
         for (i, &a) in self.0.iter().enumerate() {
-            let mut term = vec![Zero; i];
-            let mut carry = Zero;
-            let mut digit;
-            for &b in &rhs.0 {
-                (digit, carry) = a.carrying_mul(b, carry);
-                term.push(digit);
-            }
-            if carry != Zero {
-                term.push(carry);
-            }
-            if term.iter().any(|&d| d != Zero) {
-                prod = &prod + &Int(term);
+            let mut carry = 0u128;
+            for (j, &b) in rhs.0.iter().enumerate() {
+                let sum = a as u128 * b as u128 + prod[i + j] as u128 + carry;
+                prod[i + j] = sum as u64;
+                carry = sum >> LIMB_BITS;
             }
+            prod[i + rhs.0.len()] = carry as u64;
         }
+
+        let mut prod = Int(prod);
+        prod.normalize();
         prod
     }
 }
 
-impl PartialOrd for Int {
-    fn partial_cmp(&self, rhs: &Int) -> Option<Ordering> {
-        let cmp = self.0.len().cmp(&rhs.0.len());
-        if cmp != Ordering::Equal {
-            return Some(cmp);
+impl Shl<u64> for &Int {
+    type Output = Int;
+    fn shl(self, bits: u64) -> Int {
+        if self.is_zero() {
+            return Int::zero();
         }
 
-        for (a, b) in self.0.iter().zip(rhs.0.iter()).rev() {
-            if a.cmp(b) != Ordering::Equal {
-                return Some(a.cmp(b));
-            }
+        let mut shifted = vec![0; (bits / LIMB_BITS as u64) as usize];
+        shifted.extend(shl_limbs(&self.0, (bits % LIMB_BITS as u64) as u32));
+        Int(shifted)
+    }
+}
+
+impl Shr<u64> for &Int {
+    type Output = Int;
+    fn shr(self, bits: u64) -> Int {
+        let skip = (bits / LIMB_BITS as u64) as usize;
+        if skip >= self.0.len() {
+            return Int::zero();
         }
 
-        Some(Ordering::Equal)
+        let mut shifted = Int(shr_limbs(&self.0[skip..], (bits % LIMB_BITS as u64) as u32));
+        shifted.normalize();
+        shifted
+    }
+}
+
+impl PartialOrd for Int {
+    fn partial_cmp(&self, rhs: &Int) -> Option<Ordering> {
+        Some(self.cmp(rhs))
     }
 }
 
 impl Ord for Int {
     fn cmp(&self, rhs: &Int) -> Ordering {
-        self.partial_cmp(rhs).unwrap()
+        self.0
+            .len()
+            .cmp(&rhs.0.len())
+            .then_with(|| self.0.iter().rev().cmp(rhs.0.iter().rev()))
     }
 }
 
-impl FromStr for Int {
-    type Err = ();
-    fn from_str(s: &str) -> Result<Int, ()> {
-        let mut digits = Vec::with_capacity(s.len());
-        for c in s.chars().rev() {
-            digits.push(Digit::try_from(c)?);
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    /// The digits of `digits` in an `Int`.
+    fn parse(digits: &str) -> Int {
+        let mut int = Int::zero();
+        for digit in digits.bytes() {
+            int.mul_add_small(10, (digit - b'0') as u64);
+        }
+        int
+    }
+
+    fn add(a: &Int, b: &Int) -> Int {
+        let mut sum = Vec::new();
+        let mut carry = 0u128;
+        for i in 0..a.0.len().max(b.0.len()) {
+            let limb = |int: &Int| *int.0.get(i).unwrap_or(&0) as u128;
+            let limb = limb(a) + limb(b) + carry;
+            sum.push(limb as u64);
+            carry = limb >> LIMB_BITS;
         }
-        Ok(Int(digits))
+        sum.push(carry as u64);
+        let mut sum = Int(sum);
+        sum.normalize();
+        sum
+    }
+
+    fn assert_divides(num: &Int, denom: &Int) {
+        let (quot, rem) = num.divmod(denom);
+        assert!(&rem < denom);
+        assert_eq!(&add(&(&quot * denom), &rem), num);
+    }
+
+    #[test]
+    fn formats_with_leading_zeros() {
+        assert_eq!(Int::zero().to_decimal(3), "000");
+        assert_eq!(Int::from(42).to_decimal(5), "00042");
+        let digits = "12345678901234567890123456789012345678901";
+        assert_eq!(parse(digits).to_decimal(digits.len()), digits);
+        assert_eq!(parse(digits).to_decimal(50), format!("000000000{digits}"));
+    }
+
+    #[test]
+    fn formats_numbers_split_in_halves() {
+        // 10^1000 has more than `SPLIT_THRESHOLD` limbs
+        let power = Int::from(10).pow(1000);
+        assert!(power.0.len() > SPLIT_THRESHOLD);
+        assert_eq!(power.to_decimal(1001), format!("1{}", "0".repeat(1000)));
+        let nines = parse(&"9".repeat(1000));
+        assert_eq!(
+            nines.to_decimal(1200),
+            format!("{}{}", "0".repeat(200), "9".repeat(1000))
+        );
+
+        let digits: String = (0..3000)
+            .map(|i| (b'0' + (i * 7 % 10) as u8) as char)
+            .collect();
+        assert_eq!(parse(&digits).to_decimal(3000), digits);
+    }
+
+    #[test]
+    #[should_panic(expected = "more than 3 digits")]
+    fn doesnt_cut_off_digits() {
+        Int::from(1000).to_decimal(3);
+    }
+
+    #[test]
+    fn divides_with_remainder() {
+        let mut num = Int::from(3).pow(500);
+        num.mul_add_small(1, 12345);
+        for denom in [
+            Int::from(7),
+            Int::from(7).pow(100),
+            Int::from(u64::MAX).pow(3),
+        ] {
+            assert_divides(&num, &denom);
+        }
+        assert_eq!(Int::from(5).divmod(&num), (Int::zero(), Int::from(5)));
+        assert_eq!(num.divmod(&num), (Int::one(), Int::zero()));
+    }
+
+    #[test]
+    fn corrects_estimated_quotient_limbs() {
+        // limbs next to a power of two make the first estimate of a quotient
+        // limb too big, which the top two limbs of the denominator catch
+        let top = 1 << 63;
+        let extremes = [0, 1, top - 1, top, top + 1, u64::MAX - 1, u64::MAX];
+        for &high in &extremes {
+            for &low in &extremes {
+                let mut denom = Int(vec![low, high]);
+                denom.normalize();
+                if denom.is_zero() {
+                    continue;
+                }
+                for &a in &extremes {
+                    for &b in &extremes {
+                        let mut num = Int(vec![a, b, high, low]);
+                        num.normalize();
+                        assert_divides(&num, &denom);
+                    }
+                }
+            }
+        }
+
+        // b^3 / (b^2 + 1), where even that estimate is one too big and only
+        // subtracting below zero finds out
+        let (quot, rem) = Int(vec![0, 0, 0, 1]).divmod(&Int(vec![1, 0, 1]));
+        assert_eq!(quot, Int::from(u64::MAX));
+        assert_eq!(rem, Int(vec![1, u64::MAX]));
     }
 }
@@ -0,0 +1,24 @@
+//! The compiler and VMs behind the `tml` binary, as a library so benchmarks
+//! can drive them directly.
+
+pub mod batch;
+pub mod bytecode;
+pub mod cache;
+pub mod checkpoint;
+pub mod compile;
+pub mod cycle;
+pub mod decimal;
+pub mod error;
+pub mod ffi;
+pub mod inline;
+pub mod int;
+pub mod lex;
+pub mod optimize;
+pub mod parse;
+pub mod profile;
+pub mod specialize;
+pub mod sweep;
+pub mod tape;
+#[cfg(test)]
+mod testing;
+pub mod vm;
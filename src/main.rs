@@ -1,21 +1,22 @@
+use std::io::{self, Write};
+use std::ops::Range;
 use std::path::PathBuf;
 use std::process::ExitCode;
-use std::time::Instant;
+use std::time::{Duration, Instant};
 
 use clap::Parser;
 use termion::{color, style};
 
-mod bytecode;
-mod compile;
-mod decimal;
-mod digit;
-mod error;
-mod ffi;
-mod int;
-mod lex;
-mod parse;
-mod tape;
-mod vm;
+use tml::vm::{self, Machine};
+use tml::{
+    batch, bytecode, cache, checkpoint, compile, cycle, error, ffi, inline, lex, optimize, parse,
+    profile, specialize, sweep, tape,
+};
+
+/// Moves between looking for new digits with `--stream-digits`
+const STREAM_INTERVAL: usize = 1 << 22;
+/// Time between the lines `--progress` prints
+const PROGRESS_INTERVAL: Duration = Duration::from_secs(1);
 
 #[derive(Parser, Debug)]
 struct Arguments {
@@ -32,6 +33,18 @@ struct Arguments {
     #[arg(long = "hide-tape")]
     hide_tape: bool,
 
+    /// Only print the cells of the final tape in this range, relative to the initial cell 0 (either end can be left out)
+    #[arg(long = "tape-window", value_name = "START..END", value_parser = parse_window, conflicts_with = "hide_tape")]
+    tape_window: Option<Range<isize>>,
+
+    /// Print the final tape as a tape file instead of in boxes
+    #[arg(long = "compact-tape", conflicts_with = "hide_tape")]
+    compact_tape: bool,
+
+    /// Write the final tape from the initial cell 0 on to this file, as a binary tape file
+    #[arg(long = "write-tape")]
+    write_tape: Option<PathBuf>,
+
     /// Don't print the decimal interpretation of the final tape
     #[arg(long = "hide-decimal")]
     hide_decimal: bool,
@@ -52,6 +65,14 @@ struct Arguments {
     #[arg(short = 'S', long = "decimal-stride", default_value_t = 2, value_parser = clap::value_parser!(u32).range(1..))]
     decimal_stride: u32,
 
+    /// Print the digits of the decimal as soon as they are known while the machine runs
+    #[arg(long = "stream-digits", conflicts_with = "hide_decimal")]
+    stream_digits: bool,
+
+    /// Stop once this many digit cells of the decimal are finished (the cell after them is written)
+    #[arg(long = "until-digits", value_parser = clap::value_parser!(u32).range(1..))]
+    until_digits: Option<u32>,
+
     /// Don't color output
     #[arg(long = "no-color")]
     no_color: bool,
@@ -68,16 +89,89 @@ struct Arguments {
     #[arg(long = "rust-vm")]
     rust_vm: bool,
 
+    /// Instantiate parameterized states with their arguments at compile time
+    #[arg(long = "specialize")]
+    specialize: bool,
+
+    /// Maximum number of instances before falling back to closures
+    #[arg(long = "specialize-limit", default_value_t = 4096)]
+    specialize_limit: usize,
+
+    /// Optimization level for the bytecode: 0 (none), 1 (drop writes that change nothing) or 2 (also drop unreachable states and arms)
+    #[arg(short = 'O', long = "opt-level", default_value_t = 0, value_parser = clap::value_parser!(u8).range(0..=2))]
+    opt_level: u8,
+
+    /// Inline states that only go on to another state into the arms that go to them, so the VM runs fewer steps for the same moves
+    #[arg(long = "inline", conflicts_with = "fast_forward")]
+    inline: bool,
+
+    /// Keep compiled machines in this directory and reuse them when the machine, tape and compile options are the same
+    #[arg(long = "cache")]
+    cache: Option<PathBuf>,
+
+    /// Let the tape grow to the left of the initial cell 0 instead of halting
+    #[arg(long = "bi-infinite")]
+    bi_infinite: bool,
+
+    /// Store the tape in pages that are only allocated when written to
+    #[arg(long = "sparse-tape", conflicts_with = "rust_vm")]
+    sparse_tape: bool,
+
+    /// Write a checkpoint to this file at the end of the run
+    #[arg(long = "checkpoint")]
+    checkpoint: Option<PathBuf>,
+
+    /// Also write the checkpoint every this many moves
+    #[arg(long = "checkpoint-every", requires = "checkpoint", value_parser = clap::value_parser!(u64).range(1..))]
+    checkpoint_every: Option<u64>,
+
+    /// Continue from a checkpoint (the machine, tape and compile options must match)
+    #[arg(long = "resume")]
+    resume: Option<PathBuf>,
+
+    /// Count moves by state and arm, and allocated states, and print a report
+    #[arg(long = "profile")]
+    profile: bool,
+
+    /// Detect cycles that repeat with the head shifted and skip ahead over them
+    #[arg(long = "fast-forward", conflicts_with_all = ["profile", "sparse_tape"])]
+    fast_forward: bool,
+
     /// Time execution
     #[arg(short = 't', long = "time")]
     time: bool,
 
+    /// Print the moves, moves per second, tape length and head position to stderr every second while the machine runs
+    #[arg(long = "progress")]
+    progress: bool,
+
     /// Maximum width when printing the final tape
     #[arg(short = 'w', long = "terminal_width", value_parser = clap::value_parser!(u16).range(5..))]
     terminal_width: Option<u16>,
 }
 
 fn main() -> ExitCode {
+    if std::env::args_os().nth(1).is_some_and(|arg| arg == "batch") {
+        let args = batch::Arguments::parse_from(std::env::args_os().skip(1));
+        return match batch::run(args) {
+            Ok(_) => ExitCode::SUCCESS,
+            Err(error) => {
+                error.print(true);
+                ExitCode::FAILURE
+            }
+        };
+    }
+    if std::env::args_os().nth(1).is_some_and(|arg| arg == "sweep") {
+        let args = sweep::Arguments::parse_from(std::env::args_os().skip(1));
+        return match sweep::run(args) {
+            Ok(_) => ExitCode::SUCCESS,
+            Err(error) => {
+                error.print(true);
+                ExitCode::FAILURE
+            }
+        };
+    }
+
     let args = Arguments::parse();
     let no_color = args.no_color;
     match do_it(args) {
@@ -92,30 +186,89 @@ fn main() -> ExitCode {
 fn do_it(args: Arguments) -> Result<(), error::Error> {
     let start = Instant::now();
 
-    let tokens = lex::Tokens::from_path_buf(args.file, args.allow_tabs)?;
-    let unit = parse::parse(tokens)?;
-
-    let compiled = if let Some(path) = args.tape {
-        let tokens = lex::Tokens::from_path_buf(path, args.allow_tabs)?;
-        let symbols = parse::parse_tape(tokens)?;
-        compile::compile(unit, symbols)?
+    let entry = if let Some(dir) = &args.cache {
+        let specialize = args.specialize.then_some(args.specialize_limit);
+        Some(cache::Entry::new(
+            dir,
+            &args.file,
+            args.tape.as_deref(),
+            args.allow_tabs,
+            specialize,
+            args.opt_level,
+            args.inline,
+        )?)
     } else {
-        compile::compile(unit, Vec::new())?
+        None
+    };
+
+    // optimizations aren't kept in the cache, so there are none to print
+    // for a cached machine
+    let (compiled, stats) = match entry.as_ref().and_then(cache::Entry::load) {
+        Some(compiled) => (compiled, None),
+        None => {
+            let (compiled, stats) = compile(&args)?;
+            if let Some(entry) = &entry {
+                entry.store(&compiled)?;
+            }
+            (compiled, Some(stats))
+        }
     };
 
     let compile_time = start.elapsed();
 
     if args.dump_bytecode {
         bytecode::dump(&mut compiled.bytes.iter().copied(), args.no_color);
+        if let Some(stats) = &stats {
+            stats.print(args.no_color);
+        }
     }
 
     let start = Instant::now();
 
-    let max_moves = args.max_moves.unwrap_or(usize::MAX);
-    let simulated = if args.rust_vm {
-        vm::simulate(&compiled.bytes, compiled.tape, max_moves)
+    let checkpoint = if let Some(path) = &args.resume {
+        let checkpoint = checkpoint::Checkpoint::read(path)?;
+        checkpoint.validate(&compiled, args.bi_infinite)?;
+        Some(checkpoint)
     } else {
-        ffi::simulate(&compiled.bytes, &compiled.tape, max_moves)
+        None
+    };
+
+    let halted = checkpoint.as_ref().is_some_and(|c| c.halted);
+    let (simulated, profile) = match (args.rust_vm, &checkpoint) {
+        (true, Some(checkpoint)) => {
+            let vm = vm::Vm::restore(&compiled.bytes, checkpoint, args.profile);
+            execute(vm, &compiled, halted, &args)?
+        }
+        (true, None) => {
+            let vm = vm::Vm::new(
+                &compiled.bytes,
+                compiled.tape.clone(),
+                args.bi_infinite,
+                args.profile,
+            );
+            execute(vm, &compiled, halted, &args)?
+        }
+        (false, Some(checkpoint)) => {
+            let vm = ffi::Vm::restore(
+                &compiled.bytes,
+                checkpoint,
+                compiled.symbols.len(),
+                args.sparse_tape,
+                args.profile,
+            );
+            execute(vm, &compiled, halted, &args)?
+        }
+        (false, None) => {
+            let vm = ffi::Vm::new(
+                &compiled.bytes,
+                &compiled.tape,
+                compiled.symbols.len(),
+                args.bi_infinite,
+                args.sparse_tape,
+                args.profile,
+            );
+            execute(vm, &compiled, halted, &args)?
+        }
     };
 
     let exec_time = start.elapsed();
@@ -141,11 +294,10 @@ fn do_it(args: Arguments) -> Result<(), error::Error> {
         );
     }
 
-    let tape: Vec<_> = simulated
-        .tape
-        .iter()
-        .map(|&i| compiled.symbols[i as usize].as_str())
-        .collect();
+    if let Some(path) = &args.write_tape {
+        let cells = simulated.tape.iter(simulated.origin..simulated.tape.len());
+        tape::write_binary(path, cells, &compiled.symbols)?;
+    }
 
     if !args.hide_tape {
         let terminal_width = if let Some(width) = args.terminal_width {
@@ -156,11 +308,23 @@ fn do_it(args: Arguments) -> Result<(), error::Error> {
             80
         };
 
+        // the window is clipped to the final tape
+        let origin = simulated.origin as isize;
+        let len = simulated.tape.len() as isize;
+        let window = args.tape_window.clone().unwrap_or(isize::MIN..isize::MAX);
+        let start = origin.saturating_add(window.start).clamp(0, len);
+        let end = origin.saturating_add(window.end).clamp(start, len);
+
+        let title = if args.tape_window.is_some() {
+            format!("final tape ({}..{}):", start - origin, end - origin)
+        } else {
+            "final tape:".to_string()
+        };
         if args.no_color {
-            println!("final tape:");
+            println!("{title}");
         } else {
             println!(
-                "{}{}final tape:{}{}",
+                "{}{}{title}{}{}",
                 style::Bold,
                 color::Fg(color::Green),
                 style::Reset,
@@ -168,12 +332,18 @@ fn do_it(args: Arguments) -> Result<(), error::Error> {
             );
         }
 
-        tape::dump(&tape, terminal_width);
+        let cells = simulated.tape.iter(start as usize..end as usize);
+        if args.compact_tape {
+            tape::dump_compact(cells, &compiled.symbols, terminal_width);
+        } else {
+            tape::dump(cells, &compiled.symbols, terminal_width);
+        }
     }
 
     if !args.hide_decimal {
+        // the decimal is always read relative to the initial cell 0
         let decimal = tape::parse_decimal(
-            &tape,
+            simulated.tape.symbols(simulated.origin, &compiled.symbols),
             args.decimal_radix as usize,
             args.decimal_digits.map(|d| d as usize),
             args.decimal_start as usize,
@@ -192,8 +362,13 @@ fn do_it(args: Arguments) -> Result<(), error::Error> {
         }
     }
 
+    // inlined states count as moves, but the VM doesn't run them
+    let steps = simulated.moves - simulated.inlined;
     if args.no_color {
         println!("number of moves: {}", simulated.moves);
+        if args.inline {
+            println!("executed steps: {steps}");
+        }
         println!("final head position: {}\n", simulated.head_position);
     } else {
         println!(
@@ -204,6 +379,15 @@ fn do_it(args: Arguments) -> Result<(), error::Error> {
             color::Fg(color::Reset),
             simulated.moves
         );
+        if args.inline {
+            println!(
+                "{}{}executed steps:{}{} {steps}",
+                style::Bold,
+                color::Fg(color::Green),
+                style::Reset,
+                color::Fg(color::Reset)
+            );
+        }
         println!(
             "{}{}final head position:{}{} {}\n",
             style::Bold,
@@ -214,5 +398,216 @@ fn do_it(args: Arguments) -> Result<(), error::Error> {
         );
     }
 
+    if let Some(profile) = profile {
+        profile.print(&compiled, args.no_color);
+        println!();
+    }
+
     Ok(())
 }
+
+/// Prints how a run is going for `--progress`. It's updated between calls to
+/// `Machine::run()`, like `--stream-digits`, so the VMs don't check anything
+/// more per move. The runs are sized to take about a tenth of the interval.
+struct Progress {
+    start: Instant,
+    last_print: Instant,
+    last_print_moves: usize,
+    last_update: Instant,
+    last_update_moves: usize,
+    /// Moves per run
+    chunk: usize,
+}
+
+impl Progress {
+    fn new(moves: usize) -> Self {
+        let now = Instant::now();
+        Progress {
+            start: now,
+            last_print: now,
+            last_print_moves: moves,
+            last_update: now,
+            last_update_moves: moves,
+            chunk: 1 << 20,
+        }
+    }
+
+    fn update(&mut self, vm: &dyn Machine, no_color: bool) {
+        let now = Instant::now();
+        let moves = vm.moves();
+        let rate = |moves: usize, since: Instant| moves as f64 / (now - since).as_secs_f64();
+
+        let per_run = rate(moves - self.last_update_moves, self.last_update) / 10.0;
+        if per_run.is_finite() {
+            self.chunk = (per_run as usize).clamp(1 << 10, 1 << 30);
+        }
+        self.last_update = now;
+        self.last_update_moves = moves;
+
+        if now - self.last_print < PROGRESS_INTERVAL {
+            return;
+        }
+        let rate = rate(moves - self.last_print_moves, self.last_print) / 1e6;
+        self.last_print = now;
+        self.last_print_moves = moves;
+
+        let title = format!("progress ({}s):", (now - self.start).as_secs());
+        let cells = vm.written().len();
+        let head = vm.head();
+        let text = format!("{moves} moves, {rate:.1}M moves/s, {cells} cells, head at {head}");
+        if no_color {
+            eprintln!("{title} {text}");
+        } else {
+            eprintln!(
+                "{}{}{title}{}{} {text}",
+                style::Bold,
+                color::Fg(color::Green),
+                style::Reset,
+                color::Fg(color::Reset)
+            );
+        }
+    }
+}
+
+/// Parses `START..END`, where either end can be left out.
+fn parse_window(window: &str) -> Result<Range<isize>, String> {
+    let (start, end) = window
+        .split_once("..")
+        .ok_or_else(|| "expected `START..END`".to_string())?;
+    let parse = |bound: &str, default| match bound {
+        "" => Ok(default),
+        _ => bound
+            .parse()
+            .map_err(|_| format!("invalid cell position `{bound}`")),
+    };
+    Ok(parse(start, isize::MIN)?..parse(end, isize::MAX)?)
+}
+
+fn compile(args: &Arguments) -> Result<(compile::Compiled, optimize::Stats), error::Error> {
+    let tokens = lex::Tokens::from_path_buf(args.file.clone(), args.allow_tabs)?;
+    let mut unit = parse::parse(tokens)?;
+
+    let initial = match &args.tape {
+        Some(path) => Some(tape::Initial::read(path.clone(), args.allow_tabs)?),
+        None => None,
+    };
+    let alphabet = initial.as_ref().map_or(&[][..], |initial| &initial.symbols);
+
+    if args.inline {
+        inline::inline(&mut unit);
+    }
+    let mut compiled = if args.specialize {
+        specialize::compile(unit, alphabet, args.specialize_limit)?
+    } else {
+        compile::compile(unit, alphabet)?
+    };
+    if let Some(initial) = &initial {
+        compiled.tape = initial.cells(&compiled)?;
+    }
+    let stats = optimize::optimize(&mut compiled, args.opt_level);
+    Ok((compiled, stats))
+}
+
+/// Runs `vm` up to `--max-moves` moves in total, or until `--until-digits`
+/// digit cells are finished, writing checkpoints, printing the digits of the
+/// decimal and skipping ahead over cycles along the way if asked to.
+fn execute(
+    mut vm: impl Machine,
+    compiled: &compile::Compiled,
+    mut halted: bool,
+    args: &Arguments,
+) -> Result<(vm::Simulated, Option<profile::Profile>), error::Error> {
+    let max_moves = args.max_moves.unwrap_or(usize::MAX);
+    let checkpoint = args.checkpoint.as_deref();
+    let hash = checkpoint::hash(compiled);
+    let every = args.checkpoint_every.map_or(usize::MAX, |n| n as usize);
+
+    let watch = args
+        .until_digits
+        .map(|n| args.decimal_start as usize + n as usize * args.decimal_stride as usize);
+    if let Some(position) = watch {
+        vm.watch_cell(position);
+    }
+    let finished = |vm: &dyn Machine| watch.is_some_and(|position| vm.cell(position as isize) != 0);
+
+    let mut cycles = args
+        .fast_forward
+        .then(|| cycle::Detector::new(&compiled.bytes, args.bi_infinite));
+
+    let mut progress = args.progress.then(|| Progress::new(vm.moves()));
+
+    let mut stream = args.stream_digits.then(|| {
+        tape::DigitStream::new(
+            args.decimal_radix as usize,
+            args.decimal_digits.map(|d| d as usize),
+            args.decimal_start as usize,
+            args.decimal_stride as usize,
+        )
+    });
+    let print_digits = |vm: &dyn Machine, stream: &mut Option<tape::DigitStream>| {
+        if let Some(stream) = stream {
+            print!(
+                "{}",
+                stream.update(|i| compiled.symbols[vm.cell(i as isize) as usize].as_str())
+            );
+            let _ = io::stdout().flush();
+        }
+    };
+
+    if stream.is_some() {
+        if args.no_color {
+            print!("streamed decimal: 0.");
+        } else {
+            print!(
+                "{}{}streamed decimal:{}{} 0.",
+                style::Bold,
+                color::Fg(color::Green),
+                style::Reset,
+                color::Fg(color::Reset)
+            );
+        }
+        print_digits(&vm, &mut stream);
+    }
+
+    while !halted && !finished(&vm) && vm.moves() < max_moves {
+        let moves = vm.moves();
+        let next_checkpoint = moves.saturating_add(every - moves % every);
+        let mut target = max_moves.min(next_checkpoint);
+        if stream.is_some() {
+            target = target.min(moves.saturating_add(STREAM_INTERVAL));
+        }
+        if let Some(cycles) = &cycles {
+            target = target.min(cycles.next_sample().max(moves + 1));
+        }
+        if let Some(progress) = &progress {
+            target = target.min(moves.saturating_add(progress.chunk));
+        }
+        vm.run(target);
+        halted = vm.moves() < target && !finished(&vm);
+        if let (Some(cycles), false) = (&mut cycles, halted) {
+            if cycles.update(&mut vm, max_moves, watch) {
+                halted = !finished(&vm);
+            }
+        }
+        print_digits(&vm, &mut stream);
+        if let Some(progress) = &mut progress {
+            progress.update(&vm, args.no_color);
+        }
+
+        if let (Some(path), false) = (checkpoint, halted || target == max_moves) {
+            if target == next_checkpoint {
+                vm.checkpoint(hash, halted).write(path)?;
+            }
+        }
+    }
+
+    if stream.is_some() {
+        println!();
+    }
+    if let Some(path) = checkpoint {
+        vm.checkpoint(hash, halted).write(path)?;
+    }
+
+    let profile = vm.profile();
+    Ok((vm.finish(), profile))
+}
@@ -0,0 +1,554 @@
+use std::collections::{HashMap, HashSet};
+use std::ops::Range;
+
+use termion::{color, style};
+
+use crate::bytecode::{self as bc, encoded_len};
+use crate::compile::Compiled;
+
+/// What `optimize()` removed.
+#[derive(Default)]
+pub struct Stats {
+    pub level: u8,
+    /// Writes overwritten before the head moved
+    pub overwritten: usize,
+    /// Writes of the symbol that was already in the cell
+    pub unchanged: usize,
+    /// Arms that never match, since their symbol is matched by an earlier
+    /// arm of the state
+    pub arms: usize,
+    /// States that can't be reached from `start`
+    pub states: usize,
+    pub old_len: usize,
+    pub new_len: usize,
+}
+
+/// The symbol in the cell under the head while it hasn't moved yet.
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+enum Cell {
+    Val(u16),
+    Arg(u8),
+    Bound,
+}
+
+/// Rewrites the bytecode of `compiled` at `level`:
+///
+/// - 0 leaves it as it is
+/// - 1 drops writes that can't change the tape: writes overwritten before the
+///   head moves (unless what overwrites them could be blank, see
+///   `Optimizer::rhs()`), and writes of the symbol the arm matched
+/// - 2 also drops states and arms that can't be reached
+///
+/// The machine makes the same moves and leaves the same tape at every level,
+/// only the addresses change. Like `--specialize`, the level is part of the
+/// compile options checkpoints and `--cache` entries are only valid for.
+pub fn optimize(compiled: &mut Compiled, level: u8) -> Stats {
+    let len = compiled.bytes.len();
+    let mut optimizer = Optimizer {
+        old: &compiled.bytes,
+        level,
+        bytes: Vec::with_capacity(len),
+        map: HashMap::from([(bc::HALT_ADDRESS as usize, bc::HALT_ADDRESS as usize)]),
+        fixups: vec![Fixup::Address(2)],
+        stats: Stats {
+            level,
+            old_len: len,
+            new_len: len,
+            ..Stats::default()
+        },
+    };
+    if level == 0 {
+        return optimizer.stats;
+    }
+
+    let mut states: Vec<_> = compiled
+        .states
+        .keys()
+        .map(|&address| address as usize)
+        .collect();
+    states.sort_unstable();
+    let ranges: HashMap<_, _> = states
+        .iter()
+        .enumerate()
+        .map(|(i, &address)| (address, address..states.get(i + 1).copied().unwrap_or(len)))
+        .collect();
+    let reachable = if level >= 2 {
+        reachable(optimizer.old, &ranges)
+    } else {
+        states.iter().copied().collect()
+    };
+
+    optimizer
+        .bytes
+        .extend(&optimizer.old[..=bc::HALT_ADDRESS as usize]);
+    for &address in &states {
+        optimizer.map.insert(address, optimizer.bytes.len());
+        if reachable.contains(&address) {
+            optimizer.state(ranges[&address].clone());
+        } else {
+            optimizer.stats.states += 1;
+        }
+    }
+    let count = u16::from_le_bytes([optimizer.bytes[0], optimizer.bytes[1]]);
+    let count = count - optimizer.stats.states as u16;
+    optimizer.bytes[..2].copy_from_slice(&count.to_le_bytes());
+    optimizer.fix();
+
+    let Optimizer {
+        bytes,
+        map,
+        mut stats,
+        ..
+    } = optimizer;
+    stats.new_len = bytes.len();
+    compiled.states = std::mem::take(&mut compiled.states)
+        .into_iter()
+        .filter(|(address, _)| reachable.contains(&(*address as usize)))
+        .map(|(address, name)| (map[&(address as usize)] as u32, name))
+        .collect();
+    compiled.arms = std::mem::take(&mut compiled.arms)
+        .into_iter()
+        .filter_map(|(address, span)| Some((*map.get(&(address as usize))? as u32, span)))
+        .collect();
+    compiled.bytes = bytes;
+    stats
+}
+
+/// The states that can be reached from `start`, by the ranges of their code.
+fn reachable(bytes: &[u8], ranges: &HashMap<usize, Range<usize>>) -> HashSet<usize> {
+    let start = u32::from_le_bytes([bytes[2], bytes[3], bytes[4], bytes[5]]) as usize;
+    let mut reachable = HashSet::from([start]);
+    let mut stack = vec![start];
+    while let Some(address) = stack.pop() {
+        let mut ip = ranges[&address].start;
+        while ip < ranges[&address].end {
+            let target = match bytes[ip] {
+                bc::MAKE_STATE => Some(&bytes[ip + 2..ip + 6]),
+                bc::FINAL_STATE => Some(&bytes[ip + 1..ip + 5]),
+                _ => None,
+            };
+            if let Some(target) = target {
+                let target = u32::from_le_bytes(target.try_into().unwrap()) as usize;
+                if target != bc::HALT_ADDRESS as usize && reachable.insert(target) {
+                    stack.push(target);
+                }
+            }
+            ip += encoded_len(bytes, ip);
+        }
+    }
+    reachable
+}
+
+/// Operands that hold addresses, by their location in the new bytecode.
+enum Fixup {
+    /// A u32 state address
+    Address(usize),
+    /// A u16 jump relative to the end of the instruction (or table), which
+    /// is `old_base` in the old bytecode and `new_base` in the new one
+    Jump {
+        at: usize,
+        old_base: usize,
+        new_base: usize,
+    },
+}
+
+struct Optimizer<'a> {
+    old: &'a [u8],
+    level: u8,
+    bytes: Vec<u8>,
+    /// New addresses of the old addresses that can be jumped to: states,
+    /// patterns and right-hand sides. Removed code maps to the code after it
+    map: HashMap<usize, usize>,
+    fixups: Vec<Fixup>,
+    stats: Stats,
+}
+
+impl Optimizer<'_> {
+    fn state(&mut self, range: Range<usize>) {
+        let mut matched = HashSet::new();
+        let mut ip = range.start;
+        while ip < range.end {
+            self.map.insert(ip, self.bytes.len());
+            let len = encoded_len(self.old, ip);
+            let at = self.bytes.len();
+            match self.old[ip] {
+                op @ (bc::COMPARE_VAL | bc::COMPARE_ARG) => {
+                    let cell = if op == bc::COMPARE_VAL {
+                        Cell::Val(self.u16_at(ip + 1))
+                    } else {
+                        Cell::Arg(self.old[ip + 1])
+                    };
+                    let end = self.rhs_end(ip + len);
+                    if self.level >= 2 && !matched.insert(cell) {
+                        self.stats.arms += 1;
+                    } else {
+                        self.bytes.extend(&self.old[ip..ip + len]);
+                        self.fixups.push(Fixup::Jump {
+                            at: at + len - 2,
+                            old_base: ip + len,
+                            new_base: at + len,
+                        });
+                        self.rhs(ip + len..end, Some(cell));
+                    }
+                    ip = end;
+                }
+                bc::OTHER => {
+                    self.bytes.push(bc::OTHER);
+                    let end = self.rhs_end(ip + 1);
+                    self.rhs(ip + 1..end, Some(Cell::Bound));
+                    ip = end;
+                }
+                bc::DISPATCH_TABLE => ip = self.dispatch_table(ip),
+                _ => {
+                    self.bytes.extend(&self.old[ip..ip + len]);
+                    ip += len;
+                }
+            }
+        }
+    }
+
+    /// Copies the table at `ip` and the arms after it, and returns the
+    /// address after them.
+    fn dispatch_table(&mut self, ip: usize) -> usize {
+        let arms = self.u16_at(ip + 1);
+        let table_len = self.u16_at(ip + 3) as usize;
+        let len = encoded_len(self.old, ip);
+        let (old_base, new_base) = (ip + len, self.bytes.len() + len);
+
+        // the default arm comes first
+        let offsets: Vec<_> = (0..=table_len)
+            .map(|i| self.u16_at(ip + 5 + 2 * i))
+            .collect();
+        let default = offsets[0];
+        let mut values = HashMap::new();
+        for (value, &offset) in offsets[1..].iter().enumerate() {
+            if offset != default {
+                values.insert(offset, value as u16);
+            }
+        }
+
+        let at = self.bytes.len();
+        self.bytes.extend(&self.old[ip..old_base]);
+        for (i, &offset) in offsets.iter().enumerate() {
+            if offset != bc::NO_ARM {
+                self.fixups.push(Fixup::Jump {
+                    at: at + 5 + 2 * i,
+                    old_base,
+                    new_base,
+                });
+            }
+        }
+
+        let mut kept = 0;
+        let mut ip = old_base;
+        for _ in 0..arms {
+            let end = self.rhs_end(ip);
+            let offset = (ip - old_base) as u16;
+            let cell = if offset == default {
+                Some(Cell::Bound)
+            } else {
+                values.get(&offset).map(|&value| Cell::Val(value))
+            };
+            if self.level >= 2 && cell.is_none() {
+                self.stats.arms += 1;
+            } else {
+                kept += 1;
+                self.rhs(ip..end, cell);
+            }
+            ip = end;
+        }
+        self.bytes[at + 1..at + 3].copy_from_slice(&(kept as u16).to_le_bytes());
+        ip
+    }
+
+    /// The address after the right-hand side starting at `ip`. An arm with
+    /// inlined states ends after the state it went to before inlining.
+    fn rhs_end(&self, mut ip: usize) -> usize {
+        let mut finals = 1;
+        loop {
+            let op = self.old[ip];
+            ip += encoded_len(self.old, ip);
+            if op == bc::INLINED {
+                finals += 1;
+            } else if op == bc::FINAL_STATE || op == bc::FINAL_ARG {
+                finals -= 1;
+                if finals == 0 {
+                    return ip;
+                }
+            }
+        }
+    }
+
+    /// Copies the right-hand side in `range`, where the cell under the head
+    /// holds `cell` to begin with.
+    fn rhs(&mut self, range: Range<usize>, mut cell: Option<Cell>) {
+        self.map.insert(range.start, self.bytes.len());
+
+        let mut instrs = Vec::new();
+        let mut ip = range.start;
+        while ip < range.end {
+            instrs.push(ip);
+            ip += encoded_len(self.old, ip);
+        }
+
+        // only the last write before the head moves matters, and only if it
+        // changes the cell. But `--until-digits` stops at the move that
+        // writes a non-blank symbol to its cell, so a write is only dropped
+        // for a later one if that one is known not to be blank, or if it was
+        // blank itself
+        let mut kept = vec![true; instrs.len()];
+        let mut last_write = None;
+        for (i, &ip) in instrs.iter().enumerate() {
+            let written = match self.old[ip] {
+                bc::WRITE_VAL => Cell::Val(self.u16_at(ip + 1)),
+                bc::WRITE_ARG => Cell::Arg(self.old[ip + 1]),
+                bc::WRITE_BOUND => Cell::Bound,
+                op => {
+                    if let Some((j, written)) = last_write.take() {
+                        if cell == Some(written) {
+                            kept[j] = false;
+                            self.stats.unchanged += 1;
+                        }
+                    }
+                    if op > bc::WRITE_BOUND {
+                        break;
+                    }
+                    cell = None;
+                    continue;
+                }
+            };
+            if let Some((j, previous)) = last_write.replace((i, written)) {
+                if matches!(written, Cell::Val(value) if value != 0) || previous == Cell::Val(0) {
+                    kept[j] = false;
+                    self.stats.overwritten += 1;
+                } else {
+                    cell = Some(previous);
+                }
+            }
+        }
+
+        for (i, &ip) in instrs.iter().enumerate() {
+            if !kept[i] {
+                continue;
+            }
+            let at = self.bytes.len();
+            self.bytes
+                .extend(&self.old[ip..ip + encoded_len(self.old, ip)]);
+            match self.old[ip] {
+                bc::MAKE_STATE => self.fixups.push(Fixup::Address(at + 2)),
+                bc::FINAL_STATE => self.fixups.push(Fixup::Address(at + 1)),
+                _ => {}
+            }
+        }
+    }
+
+    fn fix(&mut self) {
+        for fixup in &self.fixups {
+            match *fixup {
+                Fixup::Address(at) => {
+                    let old = u32::from_le_bytes(self.bytes[at..at + 4].try_into().unwrap());
+                    let new = self.map[&(old as usize)] as u32;
+                    self.bytes[at..at + 4].copy_from_slice(&new.to_le_bytes());
+                }
+                Fixup::Jump {
+                    at,
+                    old_base,
+                    new_base,
+                } => {
+                    let old = u16::from_le_bytes([self.bytes[at], self.bytes[at + 1]]);
+                    let new = (self.map[&(old_base + old as usize)] - new_base) as u16;
+                    self.bytes[at..at + 2].copy_from_slice(&new.to_le_bytes());
+                }
+            }
+        }
+    }
+
+    fn u16_at(&self, ip: usize) -> u16 {
+        u16::from_le_bytes([self.old[ip], self.old[ip + 1]])
+    }
+}
+
+impl Stats {
+    /// Prints what was optimized, after the bytecode with `--dump-bytecode`.
+    pub fn print(&self, no_color: bool) {
+        let title = format!("optimizations (-O{}):", self.level);
+        if no_color {
+            println!("{title}");
+        } else {
+            println!(
+                "{}{}{title}{}{}",
+                style::Bold,
+                color::Fg(color::Blue),
+                style::Reset,
+                color::Fg(color::Reset)
+            );
+        }
+
+        println!("  overwritten writes removed: {}", self.overwritten);
+        println!("  writes of the matched symbol removed: {}", self.unchanged);
+        println!("  unreachable arms removed: {}", self.arms);
+        println!("  unreachable states removed: {}", self.states);
+        println!(
+            "  bytecode size: {} -> {} bytes\n",
+            self.old_len, self.new_len
+        );
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::testing;
+    use crate::vm::Machine;
+
+    fn optimized(code: &'static str, tape: &'static str, level: u8) -> (Compiled, Stats) {
+        let mut compiled = testing::compile(code, tape);
+        let stats = optimize(&mut compiled, level);
+        (compiled, stats)
+    }
+
+    #[test]
+    fn drops_writes_that_cant_change_the_tape() {
+        for (machine, removed) in [
+            ("start { _ | '1' '0' > | ! }", (1, 0)),
+            ("start { 'x' | 'x' > | !, _ | | ! }", (0, 1)),
+            // the first write makes the second one unchanged again
+            ("start { 'x' | '1' 'x' > | !, _ | | ! }", (1, 1)),
+            (
+                "start { _ | | f(; 'x') } f(; x) { x | x > | !, _ | | ! }",
+                (0, 1),
+            ),
+            // `_` could be anything, and after moving it's another cell
+            ("start { _ | 'x' > | ! }", (0, 0)),
+            ("start { _ | '1' > '1' > | ! }", (0, 0)),
+        ] {
+            let (_, stats) = optimized(machine, "'x'", 1);
+            assert_eq!((stats.overwritten, stats.unchanged), removed, "{machine}");
+            assert_eq!(stats.new_len < stats.old_len, removed != (0, 0));
+        }
+    }
+
+    #[test]
+    fn drops_what_cant_be_reached_only_at_level_2() {
+        let machine = "
+start {
+    'a' | > | start,
+    'a' | < | start,
+    _   | | run(helper),
+}
+
+run(s) {
+    _ | > | s,
+}
+
+helper {
+    _ | '1' | !,
+}
+
+unused {
+    _ | | unused,
+}
+";
+        let (_, stats) = optimized(machine, "'a'", 1);
+        assert_eq!((stats.arms, stats.states), (0, 0));
+        // `helper` is only reached as an argument
+        let (compiled, stats) = optimized(machine, "'a'", 2);
+        assert_eq!((stats.arms, stats.states), (1, 1));
+        let mut names: Vec<_> = compiled.states.values().map(String::as_str).collect();
+        names.sort_unstable();
+        assert_eq!(names, ["helper", "run", "start"]);
+
+        let (compiled, stats) = optimized(machine, "'a'", 0);
+        assert_eq!(stats.new_len, stats.old_len);
+        assert_eq!(compiled.bytes, testing::compile(machine, "'a'").bytes);
+    }
+
+    #[test]
+    fn runs_like_the_unoptimized_bytecode() {
+        // `scan` is a dispatch table and `back` compares, both with arms that
+        // lose writes, so the jumps after them have to be rewritten
+        let machine = "
+start {
+    _ | | scan,
+}
+
+scan {
+    '0' | '1' '0' > | scan,
+    '1' | '1' >     | scan,
+    'x' | 'x' 'y' > | scan,
+    'y' | '0' <     | back,
+    ''  |           | !,
+}
+
+back {
+    '0' | '1' '1' < | back,
+    '0' | <         | back,
+    _   | >         | scan(),
+}
+
+unused {
+    _ | '1' | unused,
+}
+";
+        for tape in [
+            "",
+            "'0' '1' 'x' '1' 'y'",
+            "'1' '0' '0' 'y' '1'",
+            "'x' 'x' 'y' ''",
+        ] {
+            let (compiled, _) = optimized(machine, tape, 0);
+            // stopping early ends in a state, whose address must be rewritten
+            for max_moves in [0, 3, 7, 100] {
+                let expected = testing::run(&compiled, max_moves);
+                for level in 1..=2 {
+                    let (optimized, _) = optimized(machine, tape, level);
+                    assert_eq!(testing::run(&optimized, max_moves), expected);
+                }
+            }
+        }
+    }
+
+    #[test]
+    fn keeps_writes_overwritten_by_ones_that_could_be_blank() {
+        let machine = "
+start {
+    _ | | write(; ''),
+}
+
+write(; x) {
+    _ | '1' x '' x | again,
+}
+
+again {
+    _ | '1' > | !,
+}
+";
+        // `x` could be blank, so the `'1'` before it is kept. The `''` is
+        // blank itself, and then the second `x` is already in the cell
+        let (compiled, stats) = optimized(machine, "", 1);
+        assert_eq!((stats.overwritten, stats.unchanged), (1, 1));
+        let count = |bytes: &[u8], op| {
+            let mut ip = bc::HALT_ADDRESS as usize + 1;
+            let mut count = 0;
+            while ip < bytes.len() {
+                count += (bytes[ip] == op) as usize;
+                ip += encoded_len(bytes, ip);
+            }
+            count
+        };
+        assert_eq!(count(&compiled.bytes, bc::WRITE_VAL), 2);
+        assert_eq!(count(&compiled.bytes, bc::WRITE_ARG), 1);
+
+        // so watching the cell still stops the run at the first move
+        for level in 0..=2 {
+            let (compiled, _) = optimized(machine, "", level);
+            let (mut rust, mut c) = testing::vms(&compiled, false);
+            let vms: [&mut dyn Machine; 2] = [&mut rust, &mut c];
+            for vm in vms {
+                vm.watch_cell(0);
+                vm.run(10);
+                assert_eq!(vm.moves(), 2, "-O{level}");
+            }
+        }
+    }
+}
@@ -26,6 +26,10 @@ pub struct Arm {
     pub pattern: Pattern,
     pub ops: Vec<Op>,
     pub to_state: ToState,
+    /// States inlined into the arm with `--inline`, see `inline::inline()`
+    pub inlined: usize,
+    /// Where the arm went before states were inlined into it
+    pub uninlined: Option<ToState>,
 }
 
 #[derive(Clone, Debug)]
@@ -34,6 +38,15 @@ pub enum Pattern {
     Name(Name),
 }
 
+impl Pattern {
+    pub fn span(&self) -> Span {
+        match self {
+            Pattern::Symbol(symbol) => symbol.span,
+            Pattern::Name(name) => name.span,
+        }
+    }
+}
+
 #[derive(Clone, Debug)]
 pub enum Op {
     Left(Span),
@@ -254,6 +267,8 @@ impl Parser {
             pattern,
             ops,
             to_state,
+            inlined: 0,
+            uninlined: None,
         })
     }
 
@@ -0,0 +1,120 @@
+use std::collections::{BTreeMap, HashMap};
+
+use termion::{color, style};
+
+use crate::compile::Compiled;
+
+/// Rows printed for each table in the report
+const REPORT_ROWS: usize = 20;
+
+/// Counters recorded by a VM with `--profile`, all by bytecode address.
+#[derive(Clone, Default)]
+pub struct Profile {
+    /// Moves made in each state
+    pub moves: HashMap<u32, u64>,
+    /// Moves made by the scan at the start of each state
+    pub scans: HashMap<u32, u64>,
+    /// Times each arm matched, by the address of its right-hand side
+    pub arms: HashMap<u32, u64>,
+    /// States with arguments allocated, by the address they continue at
+    pub allocations: HashMap<u32, u64>,
+}
+
+pub fn count(counters: &mut HashMap<u32, u64>, address: u32, n: usize) {
+    if n > 0 {
+        *counters.entry(address).or_default() += n as u64;
+    }
+}
+
+impl Profile {
+    /// Builds a profile from arrays with one counter per bytecode address.
+    pub fn from_arrays(moves: &[u64], scans: &[u64], arms: &[u64], allocations: &[u64]) -> Self {
+        let to_map = |counters: &[u64]| {
+            counters
+                .iter()
+                .enumerate()
+                .filter(|(_, &n)| n > 0)
+                .map(|(address, &n)| (address as u32, n))
+                .collect()
+        };
+        Profile {
+            moves: to_map(moves),
+            scans: to_map(scans),
+            arms: to_map(arms),
+            allocations: to_map(allocations),
+        }
+    }
+
+    /// Prints the hottest states, scans and arms, and the states that
+    /// allocated the most, with the names and spans from `compiled`.
+    pub fn print(&self, compiled: &Compiled, no_color: bool) {
+        if no_color {
+            println!("profile:");
+        } else {
+            println!(
+                "{}{}profile:{}{}",
+                style::Bold,
+                color::Fg(color::Green),
+                style::Reset,
+                color::Fg(color::Reset)
+            );
+        }
+
+        // states are compiled one after another, so an arm belongs to the
+        // closest state before it
+        let states: BTreeMap<_, _> = compiled.states.iter().collect();
+        let state_name = |address: u32| {
+            states
+                .range(..=address)
+                .next_back()
+                .map_or("?", |(_, name)| name.as_str())
+        };
+
+        let state_label = |address| state_name(address).to_string();
+        let arm_label = |address| match compiled.arms.get(&address) {
+            Some(span) => format!(
+                "{} {} ({}:{}:{})",
+                state_name(address),
+                span.text,
+                span.path.display(),
+                span.line + 1,
+                span.column + 1
+            ),
+            None => state_name(address).to_string(),
+        };
+
+        print_table("moves by state", &self.moves, true, &state_label);
+        print_table("moves by scan", &self.scans, true, &state_label);
+        print_table("matches by arm", &self.arms, true, arm_label);
+        print_table(
+            "allocations by state",
+            &self.allocations,
+            false,
+            &state_label,
+        );
+    }
+}
+
+fn print_table(
+    title: &str,
+    counters: &HashMap<u32, u64>,
+    percent: bool,
+    label: impl Fn(u32) -> String,
+) {
+    let total: u64 = counters.values().sum();
+    println!("  {title} (total {total}):");
+
+    let mut rows: Vec<_> = counters.iter().map(|(&address, &n)| (n, address)).collect();
+    rows.sort_unstable_by(|a, b| b.cmp(a));
+    for &(n, address) in rows.iter().take(REPORT_ROWS) {
+        if percent {
+            let share = 100.0 * n as f64 / total as f64;
+            println!("    {n:>14} {share:>6.2}%  {}", label(address));
+        } else {
+            println!("    {n:>14}  {}", label(address));
+        }
+    }
+    if rows.len() > REPORT_ROWS {
+        println!("    ... and {} more", rows.len() - REPORT_ROWS);
+    }
+}
@@ -0,0 +1,542 @@
+use std::collections::{HashMap, HashSet, VecDeque};
+
+use crate::compile::{self, Compiled};
+use crate::error::Error;
+use crate::lex::Span;
+use crate::parse::{Arm, Name, Op, Pattern, State, Symbol, ToState};
+
+const MAX_ARG_NAME_LEN: usize = 32;
+
+/// Compiles `unit` after instantiating every reachable state with concrete
+/// arguments, so the generated bytecode only jumps to fixed addresses. Falls
+/// back to the regular closure bytecode if more than `limit` instances are
+/// reachable or if the instantiated states don't compile. Like
+/// `compile::compile()`, the tape is left empty.
+pub fn compile(unit: Vec<State>, alphabet: &[Symbol], limit: usize) -> Result<Compiled, Error> {
+    let compiled = compile::compile(unit.clone(), alphabet)?;
+
+    match Specializer::new(&unit, alphabet, limit).run() {
+        Some(specialized) => compile::compile(specialized, alphabet).or(Ok(compiled)),
+        None => Ok(compiled),
+    }
+}
+
+struct Specializer<'a> {
+    definitions: HashMap<(&'static str, usize, usize), &'a State>,
+    alphabet: Vec<Symbol>,
+    instances: HashMap<Instance, usize>,
+    names: Vec<Name>,
+    queue: VecDeque<(usize, Instance, Vec<Symbol>)>,
+    limit: usize,
+}
+
+#[derive(Clone, PartialEq, Eq, Hash)]
+struct Instance {
+    name: &'static str,
+    states: Vec<Target>,
+    symbols: Vec<String>,
+}
+
+#[derive(Clone, Copy, PartialEq, Eq, Hash)]
+enum Target {
+    Halt,
+    Instance(usize),
+}
+
+struct Env {
+    states: HashMap<&'static str, Target>,
+    symbols: HashMap<&'static str, Symbol>,
+}
+
+impl<'a> Specializer<'a> {
+    fn new(unit: &'a [State], tape: &[Symbol], limit: usize) -> Self {
+        let definitions = unit
+            .iter()
+            .map(|state| {
+                let signature = (
+                    state.name.name,
+                    state.state_params.len(),
+                    state.symbol_params.len(),
+                );
+                (signature, state)
+            })
+            .collect();
+
+        let mut alphabet = Vec::new();
+        if let Some(state) = unit.first() {
+            alphabet.push(Symbol {
+                symbol: String::new(),
+                span: state.name.span,
+            });
+        }
+        for state in unit {
+            for arm in &state.arms {
+                if let Pattern::Symbol(symbol) = &arm.pattern {
+                    alphabet.push(symbol.clone());
+                }
+                for op in &arm.ops {
+                    if let Op::Symbol(symbol) = op {
+                        alphabet.push(symbol.clone());
+                    }
+                }
+                collect_symbols(&arm.to_state, &mut alphabet);
+            }
+        }
+        alphabet.extend(tape.iter().cloned());
+
+        let mut seen = HashSet::new();
+        alphabet.retain(|symbol| seen.insert(symbol.symbol.clone()));
+
+        Specializer {
+            definitions,
+            alphabet,
+            instances: HashMap::new(),
+            names: Vec::new(),
+            queue: VecDeque::new(),
+            limit,
+        }
+    }
+
+    fn run(mut self) -> Option<Vec<State>> {
+        let start = Instance {
+            name: "start",
+            states: Vec::new(),
+            symbols: Vec::new(),
+        };
+        self.instance(start, Vec::new())?;
+
+        let mut unit = Vec::new();
+        while let Some((index, instance, symbols)) = self.queue.pop_front() {
+            unit.push(self.specialize(index, &instance, symbols)?);
+        }
+        Some(unit)
+    }
+
+    fn instance(&mut self, instance: Instance, symbols: Vec<Symbol>) -> Option<Target> {
+        if let Some(&index) = self.instances.get(&instance) {
+            return Some(Target::Instance(index));
+        } else if self.instances.len() == self.limit {
+            return None;
+        }
+
+        let signature = (instance.name, instance.states.len(), instance.symbols.len());
+        let span = self.definitions.get(&signature)?.name.span;
+
+        let index = self.names.len();
+        self.names.push(Name {
+            name: self.mangle(&instance),
+            span,
+        });
+        self.instances.insert(instance.clone(), index);
+        self.queue.push_back((index, instance, symbols));
+
+        Some(Target::Instance(index))
+    }
+
+    fn specialize(
+        &mut self,
+        index: usize,
+        instance: &Instance,
+        symbols: Vec<Symbol>,
+    ) -> Option<State> {
+        let signature = (instance.name, instance.states.len(), instance.symbols.len());
+        let definition = self.definitions[&signature];
+
+        let env = Env {
+            states: definition
+                .state_params
+                .iter()
+                .map(|param| param.name)
+                .zip(instance.states.iter().copied())
+                .collect(),
+            symbols: definition
+                .symbol_params
+                .iter()
+                .map(|param| param.name)
+                .zip(symbols)
+                .collect(),
+        };
+
+        let mut arms = Vec::new();
+        let mut matched = HashSet::new();
+        for arm in &definition.arms {
+            match &arm.pattern {
+                Pattern::Symbol(symbol) => {
+                    matched.insert(symbol.symbol.clone());
+                    arms.push(self.arm(arm, arm.pattern.clone(), &env, None)?);
+                }
+                Pattern::Name(name) if env.symbols.contains_key(name.name) => {
+                    let symbol = Symbol {
+                        symbol: env.symbols[name.name].symbol.clone(),
+                        span: name.span,
+                    };
+                    matched.insert(symbol.symbol.clone());
+                    arms.push(self.arm(arm, Pattern::Symbol(symbol), &env, None)?);
+                }
+                Pattern::Name(name) if uses_bound(&arm.to_state, name.name, &env) => {
+                    // the bound symbol is only known at runtime, so split the
+                    // catchall into one arm per symbol it could match
+                    for symbol in self.alphabet.clone() {
+                        if !matched.contains(&symbol.symbol) {
+                            let bound = (name.name, &symbol);
+                            let pattern = Pattern::Symbol(symbol.clone());
+                            arms.push(self.arm(arm, pattern, &env, Some(bound))?);
+                        }
+                    }
+                }
+                Pattern::Name(_) => arms.push(self.arm(arm, arm.pattern.clone(), &env, None)?),
+            }
+        }
+
+        Some(State {
+            name: self.names[index].clone(),
+            state_params: Vec::new(),
+            symbol_params: Vec::new(),
+            arms,
+        })
+    }
+
+    fn arm(
+        &mut self,
+        arm: &Arm,
+        pattern: Pattern,
+        env: &Env,
+        bound: Option<(&str, &Symbol)>,
+    ) -> Option<Arm> {
+        let ops = arm
+            .ops
+            .iter()
+            .map(|op| match op {
+                Op::Name(name) => match lookup(name, env, bound) {
+                    Some(symbol) => Op::Symbol(symbol),
+                    None => op.clone(),
+                },
+                _ => op.clone(),
+            })
+            .collect();
+
+        let uninlined = match &arm.uninlined {
+            Some(to_state) => Some(self.arm_target(to_state, env, bound)?),
+            None => None,
+        };
+        Some(Arm {
+            pattern,
+            ops,
+            to_state: self.arm_target(&arm.to_state, env, bound)?,
+            inlined: arm.inlined,
+            uninlined,
+        })
+    }
+
+    /// The instance `to_state` goes to, as a state without arguments.
+    fn arm_target(
+        &mut self,
+        to_state: &ToState,
+        env: &Env,
+        bound: Option<(&str, &Symbol)>,
+    ) -> Option<ToState> {
+        Some(match self.target(to_state, env, bound)? {
+            Target::Halt => ToState::Halt {
+                span: to_state_span(to_state),
+            },
+            Target::Instance(index) => ToState::State {
+                name: self.names[index].clone(),
+                state_args: Vec::new(),
+                symbol_args: Vec::new(),
+            },
+        })
+    }
+
+    fn target(
+        &mut self,
+        to_state: &ToState,
+        env: &Env,
+        bound: Option<(&str, &Symbol)>,
+    ) -> Option<Target> {
+        match to_state {
+            ToState::State {
+                name,
+                state_args,
+                symbol_args,
+            } => {
+                if let Some(&target) = env.states.get(name.name) {
+                    return Some(target);
+                }
+
+                let states = state_args
+                    .iter()
+                    .map(|arg| self.target(arg, env, bound))
+                    .collect::<Option<Vec<_>>>()?;
+                let symbols = symbol_args
+                    .iter()
+                    .map(|arg| match arg {
+                        Pattern::Symbol(symbol) => Some(symbol.clone()),
+                        Pattern::Name(name) => lookup(name, env, bound),
+                    })
+                    .collect::<Option<Vec<_>>>()?;
+
+                let instance = Instance {
+                    name: name.name,
+                    states,
+                    symbols: symbols.iter().map(|symbol| symbol.symbol.clone()).collect(),
+                };
+                self.instance(instance, symbols)
+            }
+            ToState::Halt { .. } => Some(Target::Halt),
+        }
+    }
+
+    fn mangle(&self, instance: &Instance) -> &'static str {
+        if instance.states.is_empty() && instance.symbols.is_empty() {
+            return instance.name;
+        }
+
+        let mut name = format!("{}(", instance.name);
+        for (i, target) in instance.states.iter().enumerate() {
+            if i > 0 {
+                name.push_str(", ");
+            }
+            match target {
+                Target::Halt => name.push('!'),
+                // long argument names would make names grow exponentially
+                // with nesting depth
+                Target::Instance(index) if self.names[*index].name.len() > MAX_ARG_NAME_LEN => {
+                    name.push_str(&format!("#{index}"));
+                }
+                Target::Instance(index) => name.push_str(self.names[*index].name),
+            }
+        }
+        if !instance.symbols.is_empty() {
+            name.push_str("; ");
+            for (i, symbol) in instance.symbols.iter().enumerate() {
+                if i > 0 {
+                    name.push_str(", ");
+                }
+                name.push_str(&format!("'{symbol}'"));
+            }
+        }
+        name.push(')');
+
+        Box::leak(name.into_boxed_str())
+    }
+}
+
+fn lookup(name: &Name, env: &Env, bound: Option<(&str, &Symbol)>) -> Option<Symbol> {
+    if let Some(symbol) = env.symbols.get(name.name) {
+        Some(symbol.clone())
+    } else {
+        bound
+            .filter(|&(bound, _)| bound == name.name)
+            .map(|(_, symbol)| symbol.clone())
+    }
+}
+
+fn uses_bound(to_state: &ToState, bound: &str, env: &Env) -> bool {
+    match to_state {
+        ToState::State {
+            state_args,
+            symbol_args,
+            ..
+        } => {
+            symbol_args.iter().any(|arg| {
+                matches!(arg, Pattern::Name(name)
+                    if name.name == bound && !env.symbols.contains_key(name.name))
+            }) || state_args.iter().any(|arg| uses_bound(arg, bound, env))
+        }
+        ToState::Halt { .. } => false,
+    }
+}
+
+fn collect_symbols(to_state: &ToState, alphabet: &mut Vec<Symbol>) {
+    if let ToState::State {
+        state_args,
+        symbol_args,
+        ..
+    } = to_state
+    {
+        for arg in symbol_args {
+            if let Pattern::Symbol(symbol) = arg {
+                alphabet.push(symbol.clone());
+            }
+        }
+        for arg in state_args {
+            collect_symbols(arg, alphabet);
+        }
+    }
+}
+
+fn to_state_span(to_state: &ToState) -> Span {
+    match to_state {
+        ToState::State { name, .. } => name.span,
+        ToState::Halt { span } => *span,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::testing;
+
+    fn specialize(code: &'static str, tape: &'static str, limit: usize) -> Compiled {
+        let tape = testing::tape(tape);
+        let mut compiled = compile(testing::unit(code), &tape, limit).unwrap();
+        compiled.tape = compiled.intern(&tape).unwrap();
+        compiled
+    }
+
+    fn names(compiled: &Compiled) -> Vec<&str> {
+        let mut names: Vec<_> = compiled.states.values().map(String::as_str).collect();
+        names.sort_unstable();
+        names
+    }
+
+    #[test]
+    fn splits_catchalls_that_pass_their_symbol_on() {
+        // `'a'` is matched before the catchall, and `'z'` is only on the tape
+        let code = "
+start {
+    'a' | > | start,
+    c   | > | put(; c),
+}
+
+put(; x) {
+    _ | < x | !,
+}
+";
+        for tape in ["", "'a' 'z'", "'a' 'a' ''"] {
+            let specialized = specialize(code, tape, 16);
+            if tape.contains("'z'") {
+                assert_eq!(names(&specialized), ["put(; '')", "put(; 'z')", "start"]);
+            }
+            let expected = testing::run(&testing::compile(code, tape), 100);
+            assert_eq!(testing::run(&specialized, 100), expected, "{tape}");
+        }
+    }
+
+    #[test]
+    fn keeps_the_first_arm_for_a_symbol() {
+        // in `f(; 'a')`, the second arm matches `'a'` again
+        let code = "
+start {
+    _ | | f(; 'a'),
+}
+
+f(; x) {
+    'a' | '1' | !,
+    x   | '2' | !,
+    _   | '3' | !,
+}
+";
+        let expected = testing::run(&testing::compile(code, "'a'"), 10);
+        assert_eq!(expected.tape, ["1"]);
+        assert_eq!(testing::run(&specialize(code, "'a'", 16), 10), expected);
+    }
+
+    #[test]
+    fn abbreviates_long_arguments() {
+        let code = "
+start {
+    _ | | wrap(wrap(wrap(!), thirty_characters_long_state)),
+}
+
+wrap(A) {
+    _ | > | A,
+}
+
+wrap(A, B) {
+    _ | > | A,
+}
+
+thirty_characters_long_state {
+    _ | | !,
+}
+";
+        let specialized = specialize(code, "", 16);
+        assert_eq!(
+            names(&specialized),
+            [
+                "start",
+                "thirty_characters_long_state",
+                "wrap(!)",
+                "wrap(#3)",
+                "wrap(wrap(!), thirty_characters_long_state)"
+            ]
+        );
+        let expected = testing::run(&testing::compile(code, ""), 10);
+        assert_eq!(testing::run(&specialized, 10), expected);
+    }
+
+    #[test]
+    fn falls_back_to_closures_past_the_limit() {
+        // `start`, `count(; '1')`, `count(; '2')` and `count(; '')`
+        let code = "
+start {
+    _ | | count(; '1'),
+}
+
+count(; x) {
+    '1' | x > | count(; '2'),
+    '2' | x > | count(; ''),
+    _   |     | !,
+}
+";
+        let closures = testing::compile(code, "'1' '2'");
+        for limit in [0, 1, 3] {
+            assert_eq!(specialize(code, "'1' '2'", limit).bytes, closures.bytes);
+        }
+        assert_eq!(names(&specialize(code, "'1' '2'", 4)).len(), 4);
+
+        // infinitely many instances are never all reachable
+        let code = "
+start {
+    _ | | grow(!),
+}
+
+grow(A) {
+    '' | '1' > | grow(grow(A)),
+    _  | <     | A,
+}
+";
+        let closures = testing::compile(code, "");
+        assert_eq!(specialize(code, "", 4096).bytes, closures.bytes);
+    }
+
+    #[test]
+    fn falls_back_to_closures_when_the_instances_dont_compile() {
+        // 41^3 instances of `d`, more states than a program can have
+        let code = "
+start { c | > | a(; c) }
+a(; x) { c | > | b(; x, c) }
+b(; x, y) { c | > | d(; x, y, c) }
+d(; x, y, z) { _ | x y z | ! }
+";
+        let tape = "'0' '1' '2' '3' '4' '5' '6' '7' '8' '9' 'a' 'b' 'c' 'd' 'e' 'f' 'g' \
+                    'h' 'i' 'j' 'k' 'l' 'm' 'n' 'o' 'p' 'q' 'r' 's' 't' 'u' 'v' 'w' 'x' \
+                    'y' 'z' 'A' 'B' 'C' 'D'";
+        let alphabet = testing::tape(tape);
+        let unit = testing::unit(code);
+        let specialized = Specializer::new(&unit, &alphabet, 100_000).run().unwrap();
+        let error = compile::compile(specialized, &alphabet).err().unwrap();
+        assert!(format!("{error:?}").contains("too many states"));
+
+        let closures = testing::compile(code, tape);
+        assert_eq!(specialize(code, tape, 100_000).bytes, closures.bytes);
+    }
+
+    #[test]
+    fn reports_errors_like_the_closure_compiler() {
+        let code = "
+start {
+    _ | | !,
+}
+
+unreachable {
+    _ | | nowhere,
+}
+";
+        let expected = compile::compile(testing::unit(code), &[]).err();
+        let error = compile(testing::unit(code), &[], 16).err();
+        assert_eq!(format!("{error:?}"), format!("{expected:?}"));
+        assert!(error.is_some());
+    }
+}
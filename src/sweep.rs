@@ -0,0 +1,371 @@
+use std::borrow::Cow;
+use std::collections::{HashMap, HashSet};
+use std::fs;
+use std::path::PathBuf;
+use std::sync::atomic::{AtomicUsize, Ordering};
+use std::sync::mpsc;
+use std::thread;
+
+use clap::Parser;
+
+use crate::bytecode as bc;
+use crate::compile::{self, Compiled};
+use crate::error::Error;
+use crate::tape::Initial;
+use crate::vm::{self, Machine};
+use crate::{ffi, inline, lex, optimize, parse, specialize, tape};
+
+#[derive(Parser, Debug)]
+#[command(name = "tml sweep", bin_name = "tml sweep")]
+pub struct Arguments {
+    /// File containing the Turing machine
+    machine: PathBuf,
+    /// Directory of initial tapes, one per file
+    tapes: PathBuf,
+
+    /// Number of worker threads [default: number of cores]
+    #[arg(short = 'j', long = "jobs", value_parser = clap::value_parser!(u32).range(1..))]
+    jobs: Option<u32>,
+
+    /// Maximum number of moves on each tape
+    #[arg(short = 'm', long = "max-moves")]
+    max_moves: Option<usize>,
+
+    /// Don't compute the decimal interpretation of the final tapes
+    #[arg(long = "hide-decimal")]
+    hide_decimal: bool,
+
+    /// Radix for the final decimal
+    #[arg(short = 'r', long = "decimal-radix", default_value_t = 2, value_parser = clap::value_parser!(u32).range(1..=36))]
+    decimal_radix: u32,
+
+    /// Digits in the final decimal
+    #[arg(short = 'd', long = "decimal-digits", value_parser = clap::value_parser!(u32).range(3..))]
+    decimal_digits: Option<u32>,
+
+    /// Start position for the final decimal
+    #[arg(short = 's', long = "decimal-start", default_value_t = 2)]
+    decimal_start: u32,
+
+    /// Stride for the final decimal
+    #[arg(short = 'S', long = "decimal-stride", default_value_t = 2, value_parser = clap::value_parser!(u32).range(1..))]
+    decimal_stride: u32,
+
+    /// Allow tab characters in machine and tape files
+    #[arg(long = "allow-tabs")]
+    allow_tabs: bool,
+
+    /// Use Rust VM
+    #[arg(long = "rust-vm")]
+    rust_vm: bool,
+
+    /// Instantiate parameterized states with their arguments at compile time
+    #[arg(long = "specialize")]
+    specialize: bool,
+
+    /// Maximum number of instances before falling back to closures
+    #[arg(long = "specialize-limit", default_value_t = 4096)]
+    specialize_limit: usize,
+
+    /// Optimization level for the bytecode, like `tml -O`
+    #[arg(short = 'O', long = "opt-level", default_value_t = 0, value_parser = clap::value_parser!(u8).range(0..=2))]
+    opt_level: u8,
+
+    /// Inline states that only go on to another state, like `tml --inline`
+    #[arg(long = "inline")]
+    inline: bool,
+
+    /// Let the tapes grow to the left of the initial cell 0 instead of halting
+    #[arg(long = "bi-infinite")]
+    bi_infinite: bool,
+
+    /// Store the tapes in pages that are only allocated when written to
+    #[arg(long = "sparse-tape", conflicts_with = "rust_vm")]
+    sparse_tape: bool,
+}
+
+/// Compiles the machine once, with the symbols of every tape in the
+/// directory, and runs it on each tape. Prints a CSV header and one line per
+/// tape, in file name order: the file name, the number of moves, the final
+/// head position, the final state and the decimal.
+pub fn run(args: Arguments) -> Result<(), Error> {
+    let tapes = read_tapes(&args)?;
+    let compiled = compile(&args, &tapes)?;
+
+    let workers = match args.jobs {
+        Some(jobs) => jobs as usize,
+        None => thread::available_parallelism().map_or(1, |n| n.get()),
+    };
+
+    println!("tape,moves,head,state,decimal");
+    let next_tape = AtomicUsize::new(0);
+    let (sender, receiver) = mpsc::channel();
+    thread::scope(|scope| {
+        for _ in 0..workers.min(tapes.len()) {
+            let sender = sender.clone();
+            let (tapes, compiled, args, next_tape) = (&tapes, &compiled, &args, &next_tape);
+            scope.spawn(move || {
+                // every tape a thread takes runs in the same C VM, so the
+                // bytecode is only decoded once per thread
+                let mut vm = None;
+                loop {
+                    let index = next_tape.fetch_add(1, Ordering::Relaxed);
+                    let Some((_, initial)) = tapes.get(index) else {
+                        break;
+                    };
+                    let cells = initial
+                        .cells(compiled)
+                        .expect("the machine is compiled with the symbols of every tape");
+                    let result = result(&mut vm, compiled, cells, args);
+                    if sender.send((index, result)).is_err() {
+                        break;
+                    }
+                }
+            });
+        }
+        drop(sender);
+
+        // results arrive in any order, but are printed in file name order
+        let mut pending = HashMap::new();
+        let mut printed = 0;
+        for (index, result) in receiver {
+            pending.insert(index, result);
+            while let Some(result) = pending.remove(&printed) {
+                println!("{},{result}", csv(&tapes[printed].0));
+                printed += 1;
+            }
+        }
+    });
+
+    Ok(())
+}
+
+/// Reads every file in the tape directory, sorted by name. All of them are
+/// read before the machine is compiled, since it needs all their symbols.
+fn read_tapes(args: &Arguments) -> Result<Vec<(String, Initial)>, Error> {
+    let dir = &args.tapes;
+    let read_error = || Error::new(format!("couldn't read directory {}", dir.display()), None);
+
+    let mut paths = Vec::new();
+    for entry in fs::read_dir(dir).map_err(|_| read_error())? {
+        let entry = entry.map_err(|_| read_error())?;
+        if entry.file_type().is_ok_and(|file_type| file_type.is_file()) {
+            paths.push(entry.path());
+        }
+    }
+    paths.sort();
+
+    paths
+        .into_iter()
+        .map(|path| {
+            let name = path.file_name().unwrap_or_default().to_string_lossy();
+            let name = name.into_owned();
+            Ok((name, Initial::read(path, args.allow_tabs)?))
+        })
+        .collect()
+}
+
+fn compile(args: &Arguments, tapes: &[(String, Initial)]) -> Result<Compiled, Error> {
+    let tokens = lex::Tokens::from_path_buf(args.machine.clone(), args.allow_tabs)?;
+    let mut unit = parse::parse(tokens)?;
+
+    // text tapes list every cell, so most symbols repeat
+    let mut seen = HashSet::new();
+    let alphabet: Vec<_> = tapes
+        .iter()
+        .flat_map(|(_, initial)| &initial.symbols)
+        .filter(|symbol| seen.insert(symbol.symbol.as_str()))
+        .cloned()
+        .collect();
+
+    if args.inline {
+        inline::inline(&mut unit);
+    }
+    let mut compiled = if args.specialize {
+        specialize::compile(unit, &alphabet, args.specialize_limit)?
+    } else {
+        compile::compile(unit, &alphabet)?
+    };
+    optimize::optimize(&mut compiled, args.opt_level);
+    Ok(compiled)
+}
+
+/// Runs the machine on `cells` and returns the CSV fields after the file
+/// name. The C VM in `vm` is created on the first tape and restarted on the
+/// ones after it.
+fn result<'a>(
+    vm: &mut Option<ffi::Vm<'a>>,
+    compiled: &'a Compiled,
+    cells: Vec<u16>,
+    args: &Arguments,
+) -> String {
+    let max_moves = args.max_moves.unwrap_or(usize::MAX);
+    let simulated = if args.rust_vm {
+        vm::simulate(&compiled.bytes, cells, max_moves, args.bi_infinite)
+    } else {
+        let vm = match vm {
+            Some(vm) => {
+                vm.restart(&cells);
+                vm
+            }
+            None => vm.insert(ffi::Vm::new(
+                &compiled.bytes,
+                &cells,
+                compiled.symbols.len(),
+                args.bi_infinite,
+                args.sparse_tape,
+                false,
+            )),
+        };
+        vm.run(max_moves);
+        vm.take_result()
+    };
+
+    let state = if simulated.final_address == bc::HALT_ADDRESS {
+        "!"
+    } else {
+        compiled.states[&simulated.final_address].as_str()
+    };
+
+    let decimal = if args.hide_decimal {
+        String::new()
+    } else {
+        tape::parse_decimal(
+            simulated.tape.symbols(simulated.origin, &compiled.symbols),
+            args.decimal_radix as usize,
+            args.decimal_digits.map(|d| d as usize),
+            args.decimal_start as usize,
+            args.decimal_stride as usize,
+        )
+        .to_string()
+    };
+
+    format!(
+        "{},{},{},{decimal}",
+        simulated.moves,
+        simulated.head_position,
+        csv(state)
+    )
+}
+
+/// Quotes a CSV field if it has to be: specialized state names have commas,
+/// and file names can have anything.
+fn csv(field: &str) -> Cow<'_, str> {
+    if field.contains([',', '"', '\n', '\r']) {
+        Cow::Owned(format!("\"{}\"", field.replace('"', "\"\"")))
+    } else {
+        Cow::Borrowed(field)
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use crate::testing::TempDir;
+
+    /// `tml sweep` on the machine and the tapes in `dir`.
+    fn sweep(dir: &TempDir, flags: &[&str]) -> Arguments {
+        let (machine, tapes) = (dir.0.join("machine.tml"), dir.0.join("tapes"));
+        let args = [
+            "tml sweep",
+            machine.to_str().unwrap(),
+            tapes.to_str().unwrap(),
+        ];
+        Arguments::parse_from(args.into_iter().chain(flags.iter().copied()))
+    }
+
+    /// The lines `run()` prints for the tapes, from one thread.
+    fn lines(args: &Arguments) -> Result<Vec<String>, Error> {
+        let tapes = read_tapes(args)?;
+        let compiled = compile(args, &tapes)?;
+        let mut vm = None;
+        let lines = tapes.iter().map(|(name, initial)| {
+            let cells = initial.cells(&compiled).unwrap();
+            format!("{},{}", csv(name), result(&mut vm, &compiled, cells, args))
+        });
+        Ok(lines.collect())
+    }
+
+    #[test]
+    fn runs_the_files_in_the_directory_in_name_order() {
+        let dir = TempDir::new("sweep-order");
+        dir.write(
+            "machine.tml",
+            "start { '' | | !, 'a' | '1' > | start, _ | > | start }",
+        );
+        assert!(lines(&sweep(&dir, &[])).is_err());
+        fs::create_dir_all(dir.0.join("tapes/not a tape")).unwrap();
+        assert_eq!(lines(&sweep(&dir, &[])).unwrap(), Vec::<String>::new());
+
+        // `'b'` and `'c'` are only on some of the tapes
+        dir.write("tapes/b.tape", "'a' 'a' 'b' 'a'");
+        dir.write("tapes/a.tape", "'c' 'a'");
+        dir.write("tapes/B.tape", "''");
+        dir.write("tapes/odd, name.tape", "'a'");
+        let args = sweep(&dir, &["-r", "16", "-S", "1", "-s", "0", "-d", "4"]);
+        // 0xc1 / 0x100, 0x11b1 / 0x10000 and 0x1 / 0x10
+        assert_eq!(
+            lines(&args).unwrap(),
+            [
+                "B.tape,1,0,!,0.0000",
+                "a.tape,3,2,!,0.7539",
+                "b.tape,5,4,!,0.0691",
+                "\"odd, name.tape\",2,1,!,0.0625",
+            ]
+        );
+
+        dir.write("tapes/c.tape", "'a");
+        assert!(lines(&args).is_err());
+    }
+
+    #[test]
+    fn restarts_the_c_vm_like_a_new_rust_vm() {
+        let dir = TempDir::new("sweep-restart");
+        // walks right over the tape, turning `'a'`s into `'1'`s, and then back
+        // left to write `'b'` before the first cell. Without `--bi-infinite`
+        // that's the first cell itself
+        let machine = "
+start {
+    ''  | | left,
+    'a' | '1' > | start,
+    _   | > | start,
+}
+
+left {
+    '' | 'b' | !,
+    _  | < | left,
+}
+";
+        dir.write("machine.tml", machine);
+        fs::create_dir_all(dir.0.join("tapes")).unwrap();
+        // the first tape leaves the most cells behind for the others
+        dir.write("tapes/1.tape", "'a' 'a' 'b' 'a' 'c' 'a'");
+        dir.write("tapes/2.tape", "'c'");
+        dir.write("tapes/3.tape", "''");
+        for flags in [
+            &[][..],
+            &["-m", "3"],
+            &["--bi-infinite"],
+            &["--specialize", "-O2"],
+            &["--inline", "--sparse-tape"],
+            &["--bi-infinite", "--sparse-tape", "-O0"],
+        ] {
+            let c = lines(&sweep(&dir, flags)).unwrap();
+            let mut flags: Vec<_> = flags
+                .iter()
+                .copied()
+                .filter(|&flag| flag != "--sparse-tape")
+                .collect();
+            flags.push("--rust-vm");
+            assert_eq!(c, lines(&sweep(&dir, &flags)).unwrap(), "{flags:?}");
+        }
+    }
+
+    #[test]
+    fn quotes_fields_that_need_it() {
+        assert_eq!(csv("a.tape"), "a.tape");
+        assert_eq!(csv("odd, name.tape"), "\"odd, name.tape\"");
+        assert_eq!(csv("say \"hi\""), "\"say \"\"hi\"\"\"");
+        assert_eq!(csv("f(A; 'x', 'y')"), "\"f(A; 'x', 'y')\"");
+    }
+}
@@ -1,106 +1,462 @@
 use std::cmp;
-use std::iter::Peekable;
+use std::fs;
+use std::io::{self, BufWriter, Write};
+use std::iter::{self, Peekable};
+use std::path::{Path, PathBuf};
 
 use unicode_segmentation::UnicodeSegmentation;
 
+use crate::compile::Compiled;
 use crate::decimal::Decimal;
+use crate::error::Error;
 use crate::int::Int;
+use crate::lex::{Span, Tokens};
+use crate::parse::{self, Symbol};
 
-const EXTRA_DIGITS: usize = 10;
+const MAGIC: &[u8; 4] = b"TMLT";
+const VERSION: u32 = 1;
 
-pub fn dump(tape: &[&str], terminal_width: usize) {
-    if tape.is_empty() {
-        println!("┬──┬──┬");
-        println!("│  │  │");
-        println!("┴──┴──┴");
+/// The symbols of an initial tape, which are the alphabet to compile the
+/// machine with. Binary tapes only have a table of their symbols, and their
+/// cells are indices into it.
+///
+/// Binary tapes have no quotes or spaces to lex, so big tapes load much
+/// faster. All integers are stored little endian:
+///
+/// ```text
+/// "TMLT" (u32 version) (u32 symbol count) string* (u8 bytes per cell)
+/// (u64 cell count) (cell count x (u8|u16) symbol index)
+///
+/// string: (u32 len) (len x u8 UTF-8)
+/// ```
+///
+/// Cells take one byte if there are at most 256 symbols.
+pub struct Initial {
+    pub symbols: Vec<Symbol>,
+    pub cells: Option<Vec<u16>>,
+}
+
+impl Initial {
+    /// Reads a tape file in the text or the binary format.
+    pub fn read(path: PathBuf, allow_tabs: bool) -> Result<Self, Error> {
+        let path: &'static Path = Box::leak(Box::new(path));
+        let read_error = || Error::new(format!("couldn't read file {}", path.display()), None);
+        let bytes = fs::read(path).map_err(|_| read_error())?;
+
+        if !bytes.starts_with(MAGIC) {
+            let code = String::from_utf8(bytes).map_err(|_| read_error())?;
+            let tokens = Tokens::new(Box::leak(code.into_boxed_str()), path, allow_tabs)?;
+            return Ok(Initial {
+                symbols: parse::parse_tape(tokens)?,
+                cells: None,
+            });
+        }
+
+        let (symbols, cells) = Reader { bytes: &bytes[4..] }
+            .tape()
+            .ok_or_else(|| Error::new(format!("invalid binary tape {}", path.display()), None))?;
+        // there's no source to point to, so errors about a symbol point to the
+        // start of the file
+        let span = Span {
+            text: "",
+            prefix: "",
+            suffix: "",
+            line: 0,
+            column: 0,
+            path,
+        };
+        Ok(Initial {
+            symbols: symbols
+                .into_iter()
+                .map(|symbol| Symbol { symbol, span })
+                .collect(),
+            cells: Some(cells),
+        })
+    }
+
+    /// The cells of the tape in the symbols of `compiled`, which was compiled
+    /// with the symbols of this tape and possibly others.
+    pub fn cells(&self, compiled: &Compiled) -> Result<Vec<u16>, Error> {
+        let symbols = compiled.intern(&self.symbols)?;
+        Ok(match &self.cells {
+            Some(cells) => cells.iter().map(|&cell| symbols[cell as usize]).collect(),
+            None => symbols,
+        })
+    }
+}
+
+/// Writes `cells` as a binary tape, with the whole symbol table.
+pub fn write_binary(
+    path: &Path,
+    cells: impl ExactSizeIterator<Item = u16>,
+    symbols: &[String],
+) -> Result<(), Error> {
+    let narrow = symbols.len() <= 256;
+    let mut bytes = Vec::with_capacity(64 + (2 - narrow as usize) * cells.len());
+    bytes.extend(MAGIC);
+    bytes.extend(VERSION.to_le_bytes());
+    bytes.extend((symbols.len() as u32).to_le_bytes());
+    for symbol in symbols {
+        bytes.extend((symbol.len() as u32).to_le_bytes());
+        bytes.extend(symbol.as_bytes());
+    }
+    bytes.push(if narrow { 1 } else { 2 });
+    bytes.extend((cells.len() as u64).to_le_bytes());
+    for cell in cells {
+        if narrow {
+            bytes.push(cell as u8);
+        } else {
+            bytes.extend(cell.to_le_bytes());
+        }
+    }
+
+    fs::write(path, bytes)
+        .map_err(|_| Error::new(format!("couldn't write file {}", path.display()), None))
+}
+
+/// Prints `cells` in boxes, as many as fit in `terminal_width` per line.
+pub fn dump(cells: impl Iterator<Item = u16>, symbols: &[String], terminal_width: usize) {
+    // the widths and box borders only depend on the symbol, so they're worked
+    // out once for every symbol instead of for every cell
+    let widths: Vec<_> = symbols
+        .iter()
+        .map(|symbol| symbol.graphemes(true).count())
+        .collect();
+    let top: Vec<_> = widths
+        .iter()
+        .map(|&width| format!("{}┬", "─".repeat(2 + width)))
+        .collect();
+    let bottom: Vec<_> = widths
+        .iter()
+        .map(|&width| format!("{}┴", "─".repeat(2 + width)))
+        .collect();
+
+    let mut out = BufWriter::new(io::stdout().lock());
+    let mut cells = cells.peekable();
+    if cells.peek().is_none() {
+        let _ = writeln!(out, "┬──┬──┬\n│  │  │\n┴──┴──┴");
+    }
+
+    let mut line = Vec::new();
+    while cells.peek().is_some() {
+        next_line(&mut cells, &widths, terminal_width, &mut line);
+        let _ = print_line(&mut out, &line, symbols, &top, &bottom);
     }
+    let _ = writeln!(out);
+}
+
+/// Prints `cells` as a tape file, as many symbols as fit in `terminal_width`
+/// per line, so the final tape can be the initial tape of another run.
+pub fn dump_compact(cells: impl Iterator<Item = u16>, symbols: &[String], terminal_width: usize) {
+    let quoted: Vec<_> = symbols
+        .iter()
+        .map(|symbol| format!("'{}'", symbol.replace('\\', "\\\\").replace('\'', "\\'")))
+        .collect();
+    let widths: Vec<_> = quoted
+        .iter()
+        .map(|symbol| symbol.graphemes(true).count())
+        .collect();
 
-    let mut symbols = tape.iter().copied().peekable();
-    while symbols.peek().is_some() {
-        let line = next_line(&mut symbols, terminal_width);
-        print_line(&line);
+    let mut out = BufWriter::new(io::stdout().lock());
+    let mut len = 0;
+    for cell in cells {
+        let cell = cell as usize;
+        if len > 0 && len + 1 + widths[cell] > terminal_width {
+            let _ = writeln!(out);
+            len = 0;
+        } else if len > 0 {
+            let _ = write!(out, " ");
+            len += 1;
+        }
+        let _ = write!(out, "{}", quoted[cell]);
+        len += widths[cell];
     }
-    println!();
+    let _ = writeln!(out, "\n");
 }
 
-fn next_line<'a>(
-    symbols: &mut Peekable<impl Iterator<Item = &'a str>>,
+fn next_line(
+    cells: &mut Peekable<impl Iterator<Item = u16>>,
+    widths: &[usize],
     width: usize,
-) -> Vec<&'a str> {
+    line: &mut Vec<u16>,
+) {
+    line.clear();
     let mut len = 1;
-    let mut line = Vec::new();
     while line.is_empty()
-        || symbols
+        || cells
             .peek()
-            .map_or(false, |s| len + s.graphemes(true).count() + 3 <= width)
+            .map_or(false, |&cell| len + widths[cell as usize] + 3 <= width)
     {
-        let symbol = symbols.next().unwrap();
-        line.push(symbol);
-        len += symbol.graphemes(true).count() + 3;
+        let cell = cells.next().unwrap();
+        line.push(cell);
+        len += widths[cell as usize] + 3;
     }
-    line
 }
 
-fn print_line(symbols: &[&str]) {
-    print!("┬");
-    for symbol in symbols {
-        print!("{}┬", "─".repeat(2 + symbol.graphemes(true).count()));
+fn print_line(
+    out: &mut impl Write,
+    cells: &[u16],
+    symbols: &[String],
+    top: &[String],
+    bottom: &[String],
+) -> io::Result<()> {
+    write!(out, "┬")?;
+    for &cell in cells {
+        write!(out, "{}", top[cell as usize])?;
     }
-    println!();
+    writeln!(out)?;
 
-    print!("│");
-    for symbol in symbols {
-        print!(" {symbol} │");
+    write!(out, "│")?;
+    for &cell in cells {
+        write!(out, " {} │", symbols[cell as usize])?;
     }
-    println!();
+    writeln!(out)?;
 
-    print!("┴");
-    for symbol in symbols {
-        print!("{}┴", "─".repeat(2 + symbol.graphemes(true).count()));
+    write!(out, "┴")?;
+    for &cell in cells {
+        write!(out, "{}", bottom[cell as usize])?;
     }
-    println!();
+    writeln!(out)
 }
 
-pub fn parse_decimal(
-    tape: &[&str],
+pub fn parse_decimal<'a>(
+    tape: impl Iterator<Item = &'a str>,
     radix: usize,
     digits: Option<usize>,
     start: usize,
     stride: usize,
 ) -> Decimal {
     let symbols: Vec<_> = tape
-        .iter()
-        .copied()
         .skip(start)
         .step_by(stride)
         .map_while(|symbol| to_char_radix(symbol, radix))
         .collect();
 
-    let digits = if let Some(digits) = digits {
-        digits
-    } else {
-        let len = symbols.len() as f64;
-        let radix = radix as f64;
-        cmp::max(3, (len * radix.log(10.0)).ceil() as usize)
+    let digits = digits.unwrap_or_else(|| default_digits(symbols.len(), radix));
+
+    if symbols.is_empty() {
+        return Decimal::zero(digits);
+    }
+
+    // the tape is `numerator / radix^n`, so its first `digits` decimal digits
+    // are `numerator * 10^digits / radix^n`, rounded down
+    let numerator = to_int(&symbols, radix);
+    let denominator = Int::from(radix as u64).pow(symbols.len() as u64);
+    let scaled = &numerator * &Int::from(10).pow(digits as u64);
+    Decimal::new(scaled.divmod(&denominator).0, digits)
+}
+
+/// Enough decimal digits to represent `len` base `radix` digits.
+fn default_digits(len: usize, radix: usize) -> usize {
+    let len = len as f64;
+    let radix = radix as f64;
+    cmp::max(3, (len * radix.log(10.0)).ceil() as usize)
+}
+
+/// Works out the decimal digits of the tape while the machine is running.
+///
+/// A machine usually revises the digit it's working on, so the last digit
+/// cell is ignored until the one after it is written, and digit cells are
+/// assumed not to change after that. Only the decimal digits that can't
+/// change however the tape continues are returned.
+pub struct DigitStream {
+    radix: usize,
+    digits: Option<usize>,
+    start: usize,
+    stride: usize,
+    cells: usize,
+    emitted: usize,
+    // digit cells so far are in `[low, low + width) / denominator` once the
+    // emitted digits are taken away, which is `10^emitted / radix^cells` wide.
+    // The factors of 2 and 5 `width` and `denominator` share are divided out
+    // of all three, so with radix 10 only the digits still to come are kept.
+    low: Int,
+    width: Int,
+    denominator: Int,
+    // factors of 2 and 5 in `width`, or in `denominator` if negative
+    twos: i64,
+    fives: i64,
+}
+
+impl DigitStream {
+    pub fn new(radix: usize, digits: Option<usize>, start: usize, stride: usize) -> DigitStream {
+        DigitStream {
+            radix,
+            digits,
+            start,
+            stride,
+            cells: 0,
+            emitted: 0,
+            low: Int::zero(),
+            width: Int::one(),
+            denominator: Int::one(),
+            twos: 0,
+            fives: 0,
+        }
+    }
+
+    /// Reads the digit cells written since the last update, where `cell`
+    /// returns the symbol in a cell, and returns the new decimal digits.
+    pub fn update<'a>(&mut self, cell: impl Fn(usize) -> &'a str) -> String {
+        let mut symbols = Vec::new();
+        while let Some(symbol) = to_char_radix(
+            cell(self.start + (self.cells + symbols.len()) * self.stride),
+            self.radix,
+        ) {
+            symbols.push(symbol);
+        }
+        symbols.pop();
+        if !symbols.is_empty() {
+            self.read(&symbols);
+        }
+
+        let limit = self
+            .digits
+            .unwrap_or_else(|| default_digits(self.cells, self.radix));
+        // a digit is only final once the interval fits in it, so there are at
+        // most `log10(denominator / width)` of them
+        let bits = self.denominator.bits() as f64 - self.width.bits() as f64 + 1.0;
+        let most = (bits * 2f64.log10()).ceil().max(0.0) as usize;
+        let len = cmp::min(limit.saturating_sub(self.emitted), most);
+        if len == 0 {
+            return String::new();
+        }
+
+        // the next `len` digits of the bottom and the top of the interval,
+        // which is open at the top
+        let scale = Int::from(10).pow(len as u64);
+        let (bottom, rem) = (&self.low * &scale).divmod(&self.denominator);
+        let over = &(&rem + &(&self.width * &scale)) - &Int::one();
+        let over = over.divmod(&self.denominator).0;
+        let bottom_digits = bottom.to_decimal(len);
+        let top_digits = add_decimal(&bottom_digits, &over);
+        let n = bottom_digits
+            .bytes()
+            .zip(top_digits.bytes())
+            .take_while(|(bottom, top)| bottom == top)
+            .count();
+        if n == 0 {
+            return String::new();
+        }
+
+        // `low * 10^n` less the new digits times `denominator` is the other
+        // digits times `denominator`, plus `rem`, over `10^(len - n)`
+        let tail = bottom.divmod(&Int::from(10).pow((len - n) as u64)).1;
+        let low = &(&tail * &self.denominator) + &rem;
+        self.low = low.divmod(&Int::from(10).pow((len - n) as u64)).0;
+        self.take(n);
+        bottom_digits[..n].to_string()
+    }
+
+    /// Narrows the interval down to the digit cells `symbols`.
+    fn read(&mut self, symbols: &[char]) {
+        let len = symbols.len() as i64;
+        let radix_twos = self.radix.trailing_zeros() as i64;
+        let radix_fives = factors_of_5(self.radix as u64);
+        let (twos, fives) = (radix_twos * len, radix_fives * len);
+        let (common_twos, common_fives) = (self.twos.clamp(0, twos), self.fives.clamp(0, fives));
+
+        // `radix^len` without the factors `width` shares with it
+        let other = (self.radix >> radix_twos) as u64 / 5u64.pow(radix_fives as u32);
+        let scale = scale(
+            &Int::from(other).pow(len as u64),
+            twos - common_twos,
+            fives - common_fives,
+        );
+        self.width = divide(&self.width, common_twos, common_fives);
+        self.low = &(&self.low * &scale) + &(&self.width * &to_int(symbols, self.radix));
+        self.denominator = &self.denominator * &scale;
+        self.twos -= twos;
+        self.fives -= fives;
+        self.cells += symbols.len();
+    }
+
+    /// Moves `n` digits from the interval to the emitted ones, once `low` is
+    /// `low * 10^n` less the digits times `denominator`.
+    fn take(&mut self, n: usize) {
+        let n = n as i64;
+        let (twos, fives) = ((-self.twos).clamp(0, n), (-self.fives).clamp(0, n));
+        self.low = divide(&self.low, twos, fives);
+        self.denominator = divide(&self.denominator, twos, fives);
+        self.width = scale(&self.width, n - twos, n - fives);
+        self.twos += n;
+        self.fives += n;
+        self.emitted += n as usize;
+    }
+}
+
+/// `int * 2^twos * 5^fives`.
+fn scale(int: &Int, twos: i64, fives: i64) -> Int {
+    let int = match fives {
+        0 => int.clone(),
+        _ => int * &Int::from(5).pow(fives as u64),
     };
+    &int << twos as u64
+}
 
-    if tape.is_empty() {
-        Decimal::zero(digits)
-    } else {
-        let mut decimal = Decimal::zero(digits + EXTRA_DIGITS);
-        let mut power = Int::from(radix);
-        let radix = Int::from(radix);
-
-        for symbol in symbols {
-            let digit = Int::from_hex_digit(symbol);
-            let coeff = power.inverse(digits + EXTRA_DIGITS);
-            let term = &coeff * &digit;
-            decimal = &decimal + &term;
-            power = &radix * &power;
+/// `int / (2^twos * 5^fives)`, which has to be exact.
+fn divide(int: &Int, twos: i64, fives: i64) -> Int {
+    let int = int >> twos as u64;
+    match fives {
+        0 => int,
+        _ => int.divmod(&Int::from(5).pow(fives as u64)).0,
+    }
+}
+
+/// The number of factors of 5 in `n`.
+fn factors_of_5(mut n: u64) -> i64 {
+    let mut fives = 0;
+    while n % 5 == 0 {
+        n /= 5;
+        fives += 1;
+    }
+    fives
+}
+
+/// `digits` plus `int`, in as many digits, where `int` is small enough that
+/// the sum doesn't overflow.
+fn add_decimal(digits: &str, int: &Int) -> String {
+    // `int` is less than `2^bits`, so it has at most this many digits
+    let width = (int.bits() as f64 * 2f64.log10()).ceil() as usize + 1;
+    let width = cmp::min(width, digits.len());
+    let int = int.to_decimal(width);
+
+    let mut sum = digits.as_bytes().to_vec();
+    let mut carry = 0;
+    let addends = int.bytes().rev().chain(iter::repeat(b'0'));
+    for (digit, addend) in sum.iter_mut().rev().zip(addends) {
+        let total = (*digit - b'0') + (addend - b'0') + carry;
+        *digit = b'0' + total % 10;
+        carry = total / 10;
+    }
+    assert_eq!(carry, 0, "the sum has more than {} digits", digits.len());
+    String::from_utf8(sum).unwrap()
+}
+
+/// The base `radix` digits `symbols` as a number, read a limb at a time.
+fn to_int(symbols: &[char], radix: usize) -> Int {
+    let mut int = Int::zero();
+    for chunk in symbols.chunks(digits_per_limb(radix)) {
+        let mut scale = 1;
+        let mut value = 0;
+        for &symbol in chunk {
+            scale *= radix as u64;
+            value = value * radix as u64 + symbol.to_digit(radix as u32).unwrap() as u64;
         }
+        int.mul_add_small(scale, value);
+    }
+    int
+}
 
-        decimal.trim(EXTRA_DIGITS)
+/// The number of base `radix` digits that fit in a `u64` at once.
+fn digits_per_limb(radix: usize) -> usize {
+    let mut n = 0;
+    let mut scale = 1u64;
+    while let Some(next) = scale.checked_mul(radix as u64) {
+        scale = next;
+        n += 1;
     }
+    n
 }
 
 fn to_char_radix(symbol: &str, radix: usize) -> Option<char> {
@@ -110,3 +466,143 @@ fn to_char_radix(symbol: &str, radix: usize) -> Option<char> {
         None
     }
 }
+
+struct Reader<'a> {
+    bytes: &'a [u8],
+}
+
+impl<'a> Reader<'a> {
+    fn tape(&mut self) -> Option<(Vec<String>, Vec<u16>)> {
+        if self.u32()? != VERSION {
+            return None;
+        }
+
+        let symbol_count = self.u32()?;
+        let symbols: Vec<_> = (0..symbol_count)
+            .map(|_| {
+                let len = self.u32()?.try_into().ok()?;
+                String::from_utf8(self.take(len)?.to_vec()).ok()
+            })
+            .collect::<Option<_>>()?;
+
+        let width = self.take(1)?[0];
+        let len: usize = self.u64()?.try_into().ok()?;
+        let cells: Vec<_> = match width {
+            1 => self.take(len)?.iter().map(|&cell| cell as u16).collect(),
+            2 => self
+                .take(len.checked_mul(2)?)?
+                .chunks(2)
+                .map(|bytes| u16::from_le_bytes([bytes[0], bytes[1]]))
+                .collect(),
+            _ => return None,
+        };
+
+        let valid =
+            self.bytes.is_empty() && cells.iter().all(|&cell| (cell as usize) < symbols.len());
+        valid.then_some((symbols, cells))
+    }
+
+    fn take(&mut self, n: usize) -> Option<&'a [u8]> {
+        if self.bytes.len() < n {
+            return None;
+        }
+        let (taken, rest) = self.bytes.split_at(n);
+        self.bytes = rest;
+        Some(taken)
+    }
+
+    fn u32(&mut self) -> Option<u32> {
+        Some(u32::from_le_bytes(self.take(4)?.try_into().ok()?))
+    }
+
+    fn u64(&mut self) -> Option<u64> {
+        Some(u64::from_le_bytes(self.take(8)?.try_into().ok()?))
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn decimal(tape: &str, radix: usize, digits: Option<usize>) -> String {
+        let tape: Vec<_> = tape.split(' ').filter(|s| !s.is_empty()).collect();
+        parse_decimal(tape.into_iter(), radix, digits, 0, 1).to_string()
+    }
+
+    #[test]
+    fn reads_digits_across_limbs() {
+        // more digits than `digits_per_limb(10)`, so the tape is read in chunks
+        let digits: String = (0..60)
+            .map(|i| (b'0' + (i * 3 % 10) as u8) as char)
+            .collect();
+        let tape: Vec<_> = digits.chars().map(String::from).collect();
+        assert_eq!(decimal(&tape.join(" "), 10, None), format!("0.{digits}"));
+        // `radix^n` has to fit in a limb too
+        assert_eq!(digits_per_limb(10), 19);
+        assert_eq!(digits_per_limb(2), 63);
+        assert_eq!(digits_per_limb(36), 12);
+    }
+
+    #[test]
+    fn rounds_down() {
+        assert_eq!(decimal("2", 3, None), "0.666");
+        // 1/3 - 1/(3 * 2^200), which only differs from 1/3 in the last digit
+        let bits = "0 1 ".repeat(100);
+        assert_eq!(decimal(&bits, 2, None), format!("0.{}1", "3".repeat(60)));
+        assert_eq!(decimal("8", 16, Some(10)), "0.5000000000");
+        assert_eq!(decimal("z", 36, Some(5)), "0.97222");
+    }
+
+    #[test]
+    fn stops_at_the_first_symbol_that_isnt_a_digit() {
+        assert_eq!(decimal("", 10, None), "0.000");
+        assert_eq!(decimal("x 1", 10, None), "0.000");
+        assert_eq!(decimal("1 2 x 9", 10, None), "0.120");
+        assert_eq!(decimal("1 10 9", 10, None), "0.100");
+        assert_eq!(decimal("1 2", 2, None), "0.500");
+
+        let tape = ["a", "1", "b", "5", "c", "z", "7"];
+        assert_eq!(
+            parse_decimal(tape.into_iter(), 10, None, 1, 2).to_string(),
+            "0.150"
+        );
+    }
+
+    /// Streams `tape` in updates of `step` cells and returns the digits.
+    fn stream(tape: &[&str], radix: usize, digits: Option<usize>, step: usize) -> String {
+        let mut stream = DigitStream::new(radix, digits, 0, 1);
+        let mut streamed = String::new();
+        for len in (0..=tape.len()).step_by(step).chain([tape.len()]) {
+            streamed += &stream.update(|i| if i < len { tape[i] } else { "_" });
+        }
+        streamed
+    }
+
+    #[test]
+    fn streams_the_digits_the_rest_of_the_tape_cant_change() {
+        // the last cell could still change, so the 7 stays back
+        assert_eq!(stream(&["2", "5", "7"], 10, None, 1), "25");
+        assert_eq!(stream(&["2", "5", "7"], 10, Some(1), 1), "2");
+        // 0.0101... in binary only approaches 1/3, so every digit is known
+        let bits: Vec<_> = ["0", "1"].repeat(10);
+        assert_eq!(stream(&bits, 2, None, 3), "33333");
+        // but 0.10011001... approaches 0.6 from below, so whether the first
+        // digit is a 5 or a 6 depends on the cells still to come
+        let bits: Vec<_> = ["1", "0", "0", "1"].repeat(50);
+        assert_eq!(stream(&bits, 2, None, 7), "");
+        assert_eq!(stream(&["1", "0", "1", "0", "0", "0"], 2, None, 1), "6");
+    }
+
+    #[test]
+    fn streams_long_tapes() {
+        // updating a cell at a time used to take quadratic time
+        let tape: Vec<_> = (0..100_000u64)
+            .map(|i| ["0", "1", "2"][(i * i % 7 % 3) as usize])
+            .collect();
+        let streamed = stream(&tape, 3, None, 1_000);
+        let decimal =
+            parse_decimal(tape[..tape.len() - 1].iter().copied(), 3, None, 0, 1).to_string();
+        assert!(streamed.len() > 47_000);
+        assert_eq!(streamed, decimal[2..streamed.len() + 2]);
+    }
+}
@@ -0,0 +1,127 @@
+//! Machines and tapes from strings for the unit tests, compiled and run like
+//! `tml` does.
+
+use std::fs;
+use std::path::{Path, PathBuf};
+
+use crate::bytecode as bc;
+use crate::checkpoint::Checkpoint;
+use crate::compile::{self, Compiled};
+use crate::parse::{self, State, Symbol};
+use crate::vm::{Machine, Simulated};
+use crate::{ffi, lex, vm};
+
+pub fn unit(code: &'static str) -> Vec<State> {
+    let tokens = lex::Tokens::new(code, Path::new("test.tml"), false).unwrap();
+    parse::parse(tokens).unwrap()
+}
+
+/// The symbols on the tape in `code`, where an empty tape is like running
+/// without a tape file.
+pub fn tape(code: &'static str) -> Vec<Symbol> {
+    if code.is_empty() {
+        return Vec::new();
+    }
+    let tokens = lex::Tokens::new(code, Path::new("test.tape"), false).unwrap();
+    parse::parse_tape(tokens).unwrap()
+}
+
+/// Compiles the machine in `code` without any options, on the tape `tape`.
+pub fn compile(code: &'static str, tape: &'static str) -> Compiled {
+    let tape = self::tape(tape);
+    let mut compiled = compile::compile(unit(code), &tape).unwrap();
+    compiled.tape = compiled.intern(&tape).unwrap();
+    compiled
+}
+
+/// How a run ended, in the symbols and state names of the machine.
+#[derive(Debug, PartialEq, Eq)]
+pub struct Outcome {
+    pub tape: Vec<String>,
+    pub origin: usize,
+    pub head: isize,
+    pub state: String,
+    pub moves: usize,
+}
+
+impl Outcome {
+    pub fn new(simulated: &Simulated, compiled: &Compiled) -> Self {
+        let state = match simulated.final_address {
+            bc::HALT_ADDRESS => "!".to_string(),
+            address => compiled.states[&address].clone(),
+        };
+        let tape = simulated.tape.symbols(0, &compiled.symbols);
+        Outcome {
+            tape: tape.map(String::from).collect(),
+            origin: simulated.origin,
+            head: simulated.head_position,
+            state,
+            moves: simulated.moves,
+        }
+    }
+}
+
+/// `compiled` before its first move, in the Rust VM and in the C VM.
+pub fn vms(compiled: &Compiled, bi_infinite: bool) -> (vm::Vm<'_>, ffi::Vm<'_>) {
+    let (bytes, tape) = (&compiled.bytes, &compiled.tape);
+    let symbols = compiled.symbols.len();
+    let rust = vm::Vm::new(bytes, tape.clone(), bi_infinite, false);
+    (
+        rust,
+        ffi::Vm::new(bytes, tape, symbols, bi_infinite, false, false),
+    )
+}
+
+/// The run `checkpoint` was made of, in the Rust VM and in the C VM.
+pub fn restore<'a>(compiled: &'a Compiled, checkpoint: &Checkpoint) -> (vm::Vm<'a>, ffi::Vm<'a>) {
+    let (bytes, symbols) = (&compiled.bytes, compiled.symbols.len());
+    let rust = vm::Vm::restore(bytes, checkpoint, false);
+    (
+        rust,
+        ffi::Vm::restore(bytes, checkpoint, symbols, false, false),
+    )
+}
+
+/// Finishes the same run in both VMs, which have to have ended the same way.
+pub fn finish(compiled: &Compiled, (rust, c): (vm::Vm, ffi::Vm)) -> Outcome {
+    let outcome = Outcome::new(&rust.finish(), compiled);
+    assert_eq!(
+        outcome,
+        Outcome::new(&c.finish(), compiled),
+        "the VMs disagree"
+    );
+    outcome
+}
+
+/// Runs `compiled` for at most `max_moves` moves in both VMs.
+pub fn run(compiled: &Compiled, max_moves: usize) -> Outcome {
+    let (mut rust, mut c) = vms(compiled, false);
+    rust.run(max_moves);
+    c.run(max_moves);
+    finish(compiled, (rust, c))
+}
+
+/// A directory for a test's files in the temporary directory, removed when
+/// the test is done.
+pub struct TempDir(pub PathBuf);
+
+impl TempDir {
+    pub fn new(name: &str) -> Self {
+        let path = std::env::temp_dir().join(format!("tml-test-{}-{name}", std::process::id()));
+        fs::create_dir_all(&path).unwrap();
+        TempDir(path)
+    }
+
+    /// Writes `contents` to the file `name` in the directory.
+    pub fn write(&self, name: &str, contents: impl AsRef<[u8]>) -> PathBuf {
+        let path = self.0.join(name);
+        fs::write(&path, contents).unwrap();
+        path
+    }
+}
+
+impl Drop for TempDir {
+    fn drop(&mut self) {
+        let _ = fs::remove_dir_all(&self.0);
+    }
+}
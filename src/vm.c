@@ -28,31 +28,115 @@
 #define COMPARE_VAL 17
 #define OTHER 18
 #define HALT 19
+#define DISPATCH_TABLE 20
+#define SCAN_LEFT_WHILE 21
+#define SCAN_RIGHT_WHILE 22
+#define SCAN_LEFT_UNTIL 23
+#define SCAN_RIGHT_UNTIL 24
+#define INLINED 25
+
+#define NO_ARM 0xffff
+#define HALT_ADDRESS 6
 
 #define INTIAL_TAPE_CAPACITY 256
 #define TAPE_GROWTH_FACTOR 2
-#define STATE_STACK_CAPACITY 1024
+#define TAPE_PAGE_SHIFT 12
+#define TAPE_PAGE_SIZE (1 << TAPE_PAGE_SHIFT)
+#define INITIAL_PAGE_BUCKET_COUNT 64
+
+#define POOL_SLAB_SIZE 65536
+#define POOL_ALIGN 8
+#define MAX_STATE_SIZE                                                         \
+  (sizeof(State) + 255 * (sizeof(State *) + sizeof(uint16_t)))
+#define POOL_CLASSES (MAX_STATE_SIZE / POOL_ALIGN + 2)
+#define INITIAL_BUCKET_COUNT 1024
+
+// with NARROW_CELLS, tape cells are stored in one byte instead of two, for
+// machines with at most 256 symbols
+#ifdef NARROW_CELLS
+typedef uint8_t Cell;
+#else
+typedef uint16_t Cell;
+#endif
+
+// several builds are linked into tml, so every build but one renames the
+// functions it exports by appending VM_SUFFIX
+#ifdef VM_SUFFIX
+#define VM_CONCAT(name, suffix) name##suffix
+#define VM_EXPAND(name, suffix) VM_CONCAT(name, suffix)
+#define VM_NAME(name) VM_EXPAND(name, VM_SUFFIX)
+
+#define create_vm VM_NAME(create_vm)
+#define init_tape VM_NAME(init_tape)
+#define init_bytes VM_NAME(init_bytes)
+#define run VM_NAME(run)
+#define make_state VM_NAME(make_state)
+#define retain_state VM_NAME(retain_state)
+#define release_state VM_NAME(release_state)
+#define print_state VM_NAME(print_state)
+#define set_state VM_NAME(set_state)
+#define set_tape_head_position VM_NAME(set_tape_head_position)
+#define set_tape_origin VM_NAME(set_tape_origin)
+#define set_bi_infinite VM_NAME(set_bi_infinite)
+#define set_sparse VM_NAME(set_sparse)
+#define set_move_count VM_NAME(set_move_count)
+#define set_inlined_move_count VM_NAME(set_inlined_move_count)
+#define set_watch_cell VM_NAME(set_watch_cell)
+#define get_final_address VM_NAME(get_final_address)
+#define get_states VM_NAME(get_states)
+#define get_state_count VM_NAME(get_state_count)
+#define get_symbols VM_NAME(get_symbols)
+#define get_symbol_count VM_NAME(get_symbol_count)
+#define get_state_address VM_NAME(get_state_address)
+#define get_state_children VM_NAME(get_state_children)
+#define get_state_child_count VM_NAME(get_state_child_count)
+#define get_state_symbols VM_NAME(get_state_symbols)
+#define get_state_symbol_count VM_NAME(get_state_symbol_count)
+#define copy_tape VM_NAME(copy_tape)
+#define take_tape VM_NAME(take_tape)
+#define free_tape VM_NAME(free_tape)
+#define get_tape_len VM_NAME(get_tape_len)
+#define get_tape_head_position VM_NAME(get_tape_head_position)
+#define get_tape_origin VM_NAME(get_tape_origin)
+#define get_cell VM_NAME(get_cell)
+#define insert_cells VM_NAME(insert_cells)
+#define get_bi_infinite VM_NAME(get_bi_infinite)
+#define get_move_count VM_NAME(get_move_count)
+#define get_inlined_move_count VM_NAME(get_inlined_move_count)
+#define restart VM_NAME(restart)
+#define cleanup VM_NAME(cleanup)
+#endif
+
+// with PROFILING, the VM counts moves, matched arms and allocated states by
+// bytecode address, see `init_profile()`. Other builds have no counters
+#ifdef PROFILING
+#define PROFILE_COUNT(counters, address, n) ((counters)[(address)] += (n))
+#else
+#define PROFILE_COUNT(counters, address, n) ((void)0)
+#endif
 
 #define ControlFlow bool
 #define STOP true
 #define CONTINUE false
 
+typedef enum { SCAN_DONE, SCAN_EDGE, SCAN_BUDGET } ScanResult;
+
 #ifdef DEBUG
-void debug_free(void *p) {
+static void debug_free(void *p) {
   printf("free %p\n", p);
   free(p);
 }
-void *debug_malloc(size_t s) {
+static void *debug_malloc(size_t s) {
   void *p = malloc(s);
   printf("alloc %p\n", p);
   return p;
 }
-void *debug_calloc(size_t n, size_t s) {
+static void *debug_calloc(size_t n, size_t s) {
   void *p = calloc(n, s);
   printf("alloc %p\n", p);
   return p;
 }
-void *debug_realloc(void *p, size_t s) {
+static void *debug_realloc(void *p, size_t s) {
   printf("free %p\n", p);
   p = realloc(p, s);
   printf("alloc %p\n", p);
@@ -71,72 +155,366 @@ void *debug_realloc(void *p, size_t s) {
 #endif
 
 typedef struct State {
+  uint32_t refs;
+  uint32_t address;
+  uint32_t hash;
+  uint8_t state_count;
+  uint8_t symbol_count;
+  struct State *next;
+  struct State *states[];
+} State;
+
+// the bytecode is translated once into `Instr`s with their operands decoded
+// and their jumps resolved, see `init_bytes()`
+typedef struct Instr {
+  uint8_t op;
+  // argument index, state count for MAKE_STATE, or n for LEFT_N and RIGHT_N
+  uint8_t arg;
+  // symbol for *_VAL, table length for DISPATCH_TABLE, stride for scans, or
+  // the number of inlined states for INLINED
+  uint16_t value;
+  // state address for MAKE_STATE and FINAL_STATE, set length for scans
+  uint32_t address;
+  union {
+    // COMPARE_*: the arm to try if the symbol doesn't match
+    struct Instr *next_arm;
+    // FINAL_STATE: the first instruction of the state. INLINED: where the arm
+    // went before inlining
+    struct Instr *target;
+    // DISPATCH_TABLE: the arm for each symbol below `value`, then the
+    // default arm, or NULL where there is none
+    struct Instr **arms;
+    // SCAN_*: the symbols to scan over or until
+    uint16_t *set;
+  };
+#ifdef PROFILING
+  // bytecode address
+  uint32_t offset;
+#endif
+} Instr;
+
+// how far the head can move from where an instruction is reached, for the
+// argument-free fast path in `run_simple()`
+typedef struct Extent {
+  // the leftmost and rightmost cells the head reaches, relative to the head
+  int32_t low;
+  int32_t high;
+  // for the start of a right-hand side, whether it only moves and writes
+  // constants. For an arm, whether every arm from it on can run in
+  // `run_simple()`
+  bool simple;
+} Extent;
+
+typedef struct Page {
+  struct Page *next;
+  int64_t index;
+  Cell cells[TAPE_PAGE_SIZE];
+} Page;
+
+typedef struct Block {
+  struct Block *next;
+} Block;
+
+typedef struct Slab {
+  struct Slab *next;
+} Slab;
+
+typedef struct VmContext {
+  // tape
+  Cell *tape;
+  Cell *tape_end;
+  Cell *tape_head;
+  // cells added to the left of the initial cell 0 in bi-infinite mode
+  size_t tape_origin;
+  bool bi_infinite;
+
+  // sparse mode: the tape is split into pages that are only allocated once
+  // something is written to them, and `tape` and `tape_end` are the current
+  // page. Positions count from the initial cell 0, and the current page is
+  // empty (`tape == tape_end`) if it isn't allocated
+  bool sparse;
+  int64_t page_index;
+  Cell no_cells;
+  Page **pages;
+  size_t page_bucket_count;
+  size_t page_count;
+  int64_t min_page;
+  int64_t max_page;
+
+  // the run stops after a move writes a non-blank symbol to `watch`, which
+  // points to the cell `watch_position` cells right of the initial cell 0 if
+  // that cell is in the current buffer (or page), and is NULL otherwise
+  bool watching;
+  size_t watch_position;
+  Cell *watch;
+
+  // current state, and the state the machine starts in for `restart()`
   uint32_t address;
-  struct State *states;
+  uint32_t start_address;
+  State *states[256];
   size_t state_count;
-  uint16_t *symbols;
+  uint16_t symbols[256];
   size_t symbol_count;
-} State;
 
-// tape
-uint16_t *tape;
-uint16_t *tape_end;
-uint16_t *tape_head;
+  // stacks, as deep as the bytecode needs them, see `max_depths()`
+  State **state_stack;
+  State **state_stack_top;
+  uint16_t *symbol_stack;
+  uint16_t *symbol_stack_top;
+
+  // code: `entries` maps bytecode addresses to instructions
+  Instr *code;
+  Instr **entries;
+  Extent *extents;
+  Instr **arm_tables;
+  uint16_t *scan_sets;
+  Instr *pc;
 
-// current state
-uint32_t address;
-State states[256];
-size_t state_count;
-uint16_t symbols[256];
-size_t symbol_count;
+  // misc
+  size_t max_moves;
+  size_t moves;
+  // moves of states inlined with `--inline`, which count as moves without
+  // being run
+  size_t inlined_moves;
 
-// stacks
-State state_stack[STATE_STACK_CAPACITY];
-State *state_stack_top = &state_stack[0];
-uint16_t symbol_stack[256];
-uint16_t *symbol_stack_top = &symbol_stack[0];
+  // pool: size-class free lists carved out of slabs, released in `cleanup()`
+  Block *free_lists[POOL_CLASSES];
+  Slab *slabs;
+  uint8_t *slab_top;
+  uint8_t *slab_end;
 
-// bytes
-uint8_t *bytes_start;
-uint8_t *ip;
+  // interned states: every live `State` is unique up to address and arguments
+  State **buckets;
+  size_t bucket_count;
+  size_t interned_count;
+
+#ifdef PROFILING
+  // profile: one counter per bytecode address
+  size_t profile_len;
+  uint64_t *state_moves;
+  uint64_t *scan_moves;
+  uint64_t *arm_matches;
+  uint64_t *allocations;
+#endif
+} VmContext;
+
+static size_t pool_class(size_t size) {
+  if (size < sizeof(Block)) {
+    size = sizeof(Block);
+  }
+  return (size + POOL_ALIGN - 1) / POOL_ALIGN;
+}
 
-// misc
-size_t max_moves;
-size_t moves;
-uint16_t bound;
+static void *pool_alloc(VmContext *vm, size_t size) {
+  size_t class = pool_class(size);
+  Block *block = vm->free_lists[class];
+  if (block) {
+    vm->free_lists[class] = block->next;
+    return block;
+  }
+
+  size_t block_size = class * POOL_ALIGN;
+  if (vm->slab_end - vm->slab_top < (long)block_size) {
+    size_t slab_size = sizeof(Slab) + POOL_SLAB_SIZE;
+    Slab *slab = MALLOC(slab_size);
+    slab->next = vm->slabs;
+    vm->slabs = slab;
+    vm->slab_top = (uint8_t *)slab + sizeof(Slab);
+    vm->slab_end = (uint8_t *)slab + slab_size;
+  }
+
+  void *p = vm->slab_top;
+  vm->slab_top += block_size;
+  return p;
+}
+
+static void pool_free(VmContext *vm, void *p, size_t size) {
+  size_t class = pool_class(size);
+  Block *block = p;
+  block->next = vm->free_lists[class];
+  vm->free_lists[class] = block;
+}
+
+static void pool_reset(VmContext *vm) {
+  while (vm->slabs) {
+    Slab *next = vm->slabs->next;
+    FREE(vm->slabs);
+    vm->slabs = next;
+  }
+  memset(vm->free_lists, 0, sizeof(vm->free_lists));
+  vm->slab_top = NULL;
+  vm->slab_end = NULL;
+}
+
+// states without arguments aren't allocated; they're stored as tagged
+// addresses instead
+static bool is_leaf(State *state) { return (uintptr_t)state & 1; }
+
+static State *leaf_state(uint32_t address) {
+  return (State *)(((uintptr_t)address << 1) | 1);
+}
+
+static uint32_t leaf_address(State *state) { return (uintptr_t)state >> 1; }
+
+void retain_state(State *state) {
+  if (!is_leaf(state)) {
+    state->refs++;
+  }
+}
 
-void free_state(State *state) {
-  if (state->state_count) {
-    for (size_t i = 0; i < state->state_count; i++) {
-      free_state(&state->states[i]);
+static size_t state_size(size_t state_count, size_t symbol_count) {
+  return sizeof(State) + state_count * sizeof(State *) +
+         symbol_count * sizeof(uint16_t);
+}
+
+static uint16_t *state_symbols(State *state) {
+  return (uint16_t *)&state->states[state->state_count];
+}
+
+static uint32_t hash_state(uint32_t address, State **states,
+                           size_t state_count, uint16_t *symbols,
+                           size_t symbol_count) {
+  uint64_t hash = 0xcbf29ce484222325 ^ address;
+  for (size_t i = 0; i < state_count; i++) {
+    hash = (hash ^ (uintptr_t)states[i]) * 0x100000001b3;
+  }
+  for (size_t i = 0; i < symbol_count; i++) {
+    hash = (hash ^ symbols[i]) * 0x100000001b3;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccd;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static void init_buckets(VmContext *vm) {
+  vm->bucket_count = INITIAL_BUCKET_COUNT;
+  vm->buckets = CALLOC(vm->bucket_count, sizeof(State *));
+  vm->interned_count = 0;
+}
+
+static void grow_buckets(VmContext *vm) {
+  size_t old_count = vm->bucket_count;
+  State **old_buckets = vm->buckets;
+
+  vm->bucket_count *= 2;
+  vm->buckets = CALLOC(vm->bucket_count, sizeof(State *));
+  for (size_t i = 0; i < old_count; i++) {
+    State *state = old_buckets[i];
+    while (state) {
+      State *next = state->next;
+      State **bucket = &vm->buckets[state->hash & (vm->bucket_count - 1)];
+      state->next = *bucket;
+      *bucket = state;
+      state = next;
     }
-    FREE(state->states);
   }
-  if (state->symbol_count) {
-    FREE(state->symbols);
+  FREE(old_buckets);
+}
+
+static void unlink_state(VmContext *vm, State *state) {
+  State **link = &vm->buckets[state->hash & (vm->bucket_count - 1)];
+  while (*link != state) {
+    link = &(*link)->next;
+  }
+  *link = state->next;
+  vm->interned_count--;
+}
+
+static bool state_equals(State *state, uint32_t hash, uint32_t address,
+                         State **states, size_t state_count,
+                         uint16_t *symbols, size_t symbol_count) {
+  if (state->hash != hash || state->address != address ||
+      state->state_count != state_count ||
+      state->symbol_count != symbol_count) {
+    return false;
+  }
+  for (size_t i = 0; i < state_count; i++) {
+    if (state->states[i] != states[i]) {
+      return false;
+    }
+  }
+  uint16_t *state_symbols_ = state_symbols(state);
+  for (size_t i = 0; i < symbol_count; i++) {
+    if (state_symbols_[i] != symbols[i]) {
+      return false;
+    }
   }
+  return true;
 }
 
-State clone_state(State *state) {
-  State cloned;
-  cloned.address = state->address;
-  cloned.state_count = state->state_count;
-  cloned.symbol_count = state->symbol_count;
-  if (cloned.state_count) {
-    cloned.states = MALLOC(cloned.state_count * sizeof(State));
-    for (size_t i = 0; i < cloned.state_count; i++) {
-      cloned.states[i] = clone_state(&state->states[i]);
+// takes ownership of the references in `states`
+State *make_state(VmContext *vm, uint32_t address, State **states,
+                  size_t state_count, uint16_t *symbols, size_t symbol_count) {
+  if (!state_count && !symbol_count) {
+    return leaf_state(address);
+  }
+
+  uint32_t hash =
+      hash_state(address, states, state_count, symbols, symbol_count);
+  State **bucket = &vm->buckets[hash & (vm->bucket_count - 1)];
+
+  for (State *state = *bucket; state; state = state->next) {
+    if (state_equals(state, hash, address, states, state_count, symbols,
+                     symbol_count)) {
+      state->refs++;
+      for (size_t i = 0; i < state_count; i++) {
+        if (!is_leaf(states[i])) {
+          states[i]->refs--;
+        }
+      }
+      return state;
     }
   }
-  if (cloned.symbol_count) {
-    cloned.symbols = MALLOC(cloned.symbol_count * sizeof(uint16_t));
-    memcpy(cloned.symbols, state->symbols,
-           cloned.symbol_count * sizeof(uint16_t));
+
+  State *state = pool_alloc(vm, state_size(state_count, symbol_count));
+  PROFILE_COUNT(vm->allocations, address, 1);
+  state->refs = 1;
+  state->address = address;
+  state->hash = hash;
+  state->state_count = state_count;
+  state->symbol_count = symbol_count;
+  memcpy(state->states, states, state_count * sizeof(State *));
+  memcpy(state_symbols(state), symbols, symbol_count * sizeof(uint16_t));
+  state->next = *bucket;
+  *bucket = state;
+
+  if (++vm->interned_count > vm->bucket_count) {
+    grow_buckets(vm);
+  }
+  return state;
+}
+
+// dead states are chained through `next` so deep nesting can't overflow the C
+// stack
+void release_state(VmContext *vm, State *state) {
+  if (is_leaf(state) || --state->refs) {
+    return;
+  }
+
+  unlink_state(vm, state);
+  state->next = NULL;
+  while (state) {
+    State *dead = state;
+    state = state->next;
+    for (size_t i = 0; i < dead->state_count; i++) {
+      State *child = dead->states[i];
+      if (!is_leaf(child) && !--child->refs) {
+        unlink_state(vm, child);
+        child->next = state;
+        state = child;
+      }
+    }
+    pool_free(vm, dead, state_size(dead->state_count, dead->symbol_count));
   }
-  return cloned;
 }
 
 void print_state(State *state) {
+  if (is_leaf(state)) {
+    printf("State(0x%08x)", leaf_address(state));
+    return;
+  }
+
   printf("State(0x%08x", state->address);
   for (size_t i = 0; i < state->state_count; i++) {
     if (i) {
@@ -144,413 +522,1384 @@ void print_state(State *state) {
     } else {
       printf("; ");
     }
-    print_state(&state->states[i]);
+    print_state(state->states[i]);
   }
   if (state->symbol_count) {
+    uint16_t *symbols = state_symbols(state);
     for (size_t i = 0; i < state->symbol_count; i++) {
       if (i) {
         printf(", ");
       } else {
         printf("; ");
       }
-      printf("%hu", state->symbols[i]);
+      printf("%hu", symbols[i]);
     }
   }
   printf(")");
 }
 
-void init_tape(uint16_t *symbols, size_t len) {
+VmContext *create_vm() {
+  VmContext *vm = CALLOC(1, sizeof(VmContext));
+  init_buckets(vm);
+  return vm;
+}
+
+static size_t page_bucket(VmContext *vm, int64_t index) {
+  uint64_t hash = (uint64_t)index * 0x9e3779b97f4a7c15;
+  return (hash >> 32) & (vm->page_bucket_count - 1);
+}
+
+static Page *find_page(VmContext *vm, int64_t index) {
+  Page *page = vm->pages[page_bucket(vm, index)];
+  while (page && page->index != index) {
+    page = page->next;
+  }
+  return page;
+}
+
+static void grow_pages(VmContext *vm) {
+  size_t old_count = vm->page_bucket_count;
+  Page **old_pages = vm->pages;
+
+  vm->page_bucket_count *= 2;
+  vm->pages = CALLOC(vm->page_bucket_count, sizeof(Page *));
+  for (size_t i = 0; i < old_count; i++) {
+    Page *page = old_pages[i];
+    while (page) {
+      Page *next = page->next;
+      Page **bucket = &vm->pages[page_bucket(vm, page->index)];
+      page->next = *bucket;
+      *bucket = page;
+      page = next;
+    }
+  }
+  FREE(old_pages);
+}
+
+static Page *add_page(VmContext *vm, int64_t index) {
+  if (vm->page_count >= vm->page_bucket_count) {
+    grow_pages(vm);
+  }
+
+  Page *page = CALLOC(1, sizeof(Page));
+  Page **bucket = &vm->pages[page_bucket(vm, index)];
+  page->index = index;
+  page->next = *bucket;
+  *bucket = page;
+
+  if (vm->page_count == 0 || index < vm->min_page) {
+    vm->min_page = index;
+  }
+  if (vm->page_count == 0 || index > vm->max_page) {
+    vm->max_page = index;
+  }
+  vm->page_count++;
+  return page;
+}
+
+static int64_t sparse_position(VmContext *vm) {
+  return vm->page_index * TAPE_PAGE_SIZE + (vm->tape_head - vm->tape);
+}
+
+static void update_watch(VmContext *vm) {
+  vm->watch = NULL;
+  if (!vm->watching) {
+    return;
+  }
+
+  int64_t index = vm->tape_origin + vm->watch_position;
+  if (vm->sparse) {
+    index -= vm->page_index * TAPE_PAGE_SIZE;
+  }
+  if (index >= 0 && index < vm->tape_end - vm->tape) {
+    vm->watch = &vm->tape[index];
+  }
+}
+
+// makes the page containing `position` the current page
+static void seek(VmContext *vm, int64_t position) {
+  // shifting rounds down, so negative positions land in negative pages
+  vm->page_index = position >> TAPE_PAGE_SHIFT;
+  Page *page = find_page(vm, vm->page_index);
+  if (page) {
+    vm->tape = page->cells;
+    vm->tape_end = &page->cells[TAPE_PAGE_SIZE];
+  } else {
+    vm->tape = &vm->no_cells;
+    vm->tape_end = &vm->no_cells;
+  }
+  vm->tape_head = vm->tape + (position - vm->page_index * TAPE_PAGE_SIZE);
+  update_watch(vm);
+}
+
+static void init_sparse_tape(VmContext *vm, uint16_t *symbols, size_t len) {
+  vm->page_bucket_count = INITIAL_PAGE_BUCKET_COUNT;
+  vm->pages = CALLOC(vm->page_bucket_count, sizeof(Page *));
+  for (size_t i = 0; i < len; i++) {
+    if (symbols[i]) {
+      Page *page = find_page(vm, i >> TAPE_PAGE_SHIFT);
+      if (!page) {
+        page = add_page(vm, i >> TAPE_PAGE_SHIFT);
+      }
+      page->cells[i & (TAPE_PAGE_SIZE - 1)] = symbols[i];
+    }
+  }
+  seek(vm, 0);
+}
+
+// the low end of the tape `copy_tape()` returns in sparse mode
+static int64_t sparse_low(VmContext *vm) {
+  int64_t low = sparse_position(vm);
+  if (low > 0) {
+    low = 0;
+  }
+  if (vm->page_count && vm->min_page * TAPE_PAGE_SIZE < low) {
+    low = vm->min_page * TAPE_PAGE_SIZE;
+  }
+  return low;
+}
+
+static size_t sparse_len(VmContext *vm) {
+  if (vm->page_count == 0) {
+    return 0;
+  }
+  return (vm->max_page + 1) * TAPE_PAGE_SIZE - sparse_low(vm);
+}
+
+void init_tape(VmContext *vm, uint16_t *symbols, size_t len) {
+  if (vm->sparse) {
+    init_sparse_tape(vm, symbols, len);
+    return;
+  }
+
   if (len < INTIAL_TAPE_CAPACITY) {
-    tape = CALLOC(INTIAL_TAPE_CAPACITY, sizeof(uint16_t));
-    tape_end = &tape[INTIAL_TAPE_CAPACITY];
+    vm->tape = CALLOC(INTIAL_TAPE_CAPACITY, sizeof(Cell));
+    vm->tape_end = &vm->tape[INTIAL_TAPE_CAPACITY];
   } else {
-    tape = CALLOC(len, sizeof(uint16_t));
-    tape_end = &tape[len];
+    vm->tape = CALLOC(len, sizeof(Cell));
+    vm->tape_end = &vm->tape[len];
+  }
+  vm->tape_head = vm->tape;
+  for (size_t i = 0; i < len; i++) {
+    vm->tape[i] = symbols[i];
   }
-  tape_head = tape;
-  memcpy(tape, symbols, len * sizeof(uint16_t));
 }
 
-ControlFlow tape_left(size_t n) {
-  if (tape_head - tape < (long)n) {
-    tape_head = tape;
+// grows the tape to the left so the head can move `n` cells left. The tape
+// at least doubles each time, so every cell is copied O(1) times amortized
+static void grow_tape_left(VmContext *vm, size_t n) {
+  size_t head_offset = vm->tape_head - vm->tape;
+  size_t old_len = vm->tape_end - vm->tape;
+  size_t extra = TAPE_GROWTH_FACTOR * (n - head_offset);
+  if (extra < old_len) {
+    extra = old_len;
+  }
+
+  Cell *tape = CALLOC(old_len + extra, sizeof(Cell));
+  memcpy(&tape[extra], vm->tape, old_len * sizeof(Cell));
+  FREE(vm->tape);
+
+  vm->tape = tape;
+  vm->tape_end = &tape[old_len + extra];
+  vm->tape_head = &tape[extra + head_offset];
+  vm->tape_origin += extra;
+  update_watch(vm);
+}
+
+// only called when the head leaves the current page
+static ControlFlow sparse_tape_left(VmContext *vm, size_t n) {
+  int64_t position = sparse_position(vm) - n;
+  if (position < 0 && !vm->bi_infinite) {
+    seek(vm, 0);
     return STOP;
-  } else {
-    tape_head -= n;
-    return CONTINUE;
   }
+  seek(vm, position);
+  return CONTINUE;
+}
+
+static ControlFlow tape_left(VmContext *vm, size_t n) {
+  if (vm->tape_head - vm->tape < (long)n) {
+    if (vm->sparse) {
+      return sparse_tape_left(vm, n);
+    } else if (!vm->bi_infinite) {
+      vm->tape_head = vm->tape;
+      return STOP;
+    }
+    grow_tape_left(vm, n);
+  }
+  vm->tape_head -= n;
+  return CONTINUE;
 }
 
-void tape_right(size_t n) { tape_head += n; }
+static void tape_right(VmContext *vm, size_t n) { vm->tape_head += n; }
 
-uint16_t read_tape() {
-  if (tape_head >= tape_end) {
+// only called when the head is outside the current page
+static uint16_t sparse_read_tape(VmContext *vm) {
+  int64_t position = sparse_position(vm);
+  if (vm->tape == vm->tape_end &&
+      position >> TAPE_PAGE_SHIFT == vm->page_index) {
     return 0;
+  }
+  seek(vm, position);
+  return vm->tape_head < vm->tape_end ? *vm->tape_head : 0;
+}
+
+// only called when the head is outside the current page
+static void sparse_write_tape(VmContext *vm, uint16_t value) {
+  int64_t position = sparse_position(vm);
+  seek(vm, position);
+  if (vm->tape_head >= vm->tape_end) {
+    if (!value) {
+      return;
+    }
+    add_page(vm, vm->page_index);
+    seek(vm, position);
+  }
+  *vm->tape_head = value;
+}
+
+static uint16_t read_tape(VmContext *vm) {
+  if (vm->tape_head >= vm->tape_end) {
+    return vm->sparse ? sparse_read_tape(vm) : 0;
   } else {
-    return *tape_head;
+    return *vm->tape_head;
   }
 }
 
-void write_tape(uint16_t value) {
-  if (tape_head < tape_end) {
-    *tape_head = value;
+static void write_tape(VmContext *vm, uint16_t value) {
+  if (vm->tape_head < vm->tape_end) {
+    *vm->tape_head = value;
+  } else if (vm->sparse) {
+    sparse_write_tape(vm, value);
   } else {
     if (value) {
-      size_t head_offset = tape_head - tape;
-      size_t old_len = tape_end - tape;
+      size_t head_offset = vm->tape_head - vm->tape;
+      size_t old_len = vm->tape_end - vm->tape;
       size_t new_len = TAPE_GROWTH_FACTOR * head_offset;
 
-      tape = REALLOC(tape, new_len * sizeof(uint16_t));
-      memset(&tape[old_len], 0, (new_len - old_len) * sizeof(uint16_t));
-      tape_head = &tape[head_offset];
-      tape_end = &tape[new_len];
+      vm->tape = REALLOC(vm->tape, new_len * sizeof(Cell));
+      memset(&vm->tape[old_len], 0, (new_len - old_len) * sizeof(Cell));
+      vm->tape_head = &vm->tape[head_offset];
+      vm->tape_end = &vm->tape[new_len];
+      update_watch(vm);
 
-      *tape_head = value;
+      *vm->tape_head = value;
     }
   }
+
+  if (vm->tape_head == vm->watch && value) {
+    // `run_general()` counts the current move and stops
+    vm->max_moves = vm->moves + 1;
+  }
 }
 
-uint8_t next() { return *ip++; }
+static uint16_t read_u16(uint8_t *bytes) { return bytes[0] | (bytes[1] << 8); }
 
-uint16_t next_u16() {
-  uint16_t low = next();
-  uint16_t high = next();
-  return low | (high << 8);
+static uint32_t read_u32(uint8_t *bytes) {
+  return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+         ((uint32_t)bytes[3] << 24);
 }
 
-uint32_t next_u32() {
-  uint32_t a = next();
-  uint32_t b = next();
-  uint32_t c = next();
-  uint32_t d = next();
-  return a | (b << 8) | (c << 16) | (d << 24);
+static void go_to(VmContext *vm, uint32_t address) {
+  vm->pc = vm->entries[address];
 }
 
-void go_to(uint32_t address) { ip = bytes_start + address; }
+static void push_symbol(VmContext *vm, uint16_t value) {
+  *vm->symbol_stack_top = value;
+  vm->symbol_stack_top++;
+}
 
-void skip(uint16_t skip) { ip += skip; }
+static void push_state(VmContext *vm, State *state) {
+  *vm->state_stack_top = state;
+  vm->state_stack_top++;
+}
 
-void push_symbol(uint16_t value) {
-  *symbol_stack_top = value;
-  symbol_stack_top++;
+static void make_state_op(VmContext *vm, Instr *instr) {
+  vm->state_stack_top -= instr->arg;
+  State *state = make_state(vm, instr->address, vm->state_stack_top,
+                            instr->arg, vm->symbol_stack,
+                            vm->symbol_stack_top - vm->symbol_stack);
+  vm->symbol_stack_top = vm->symbol_stack;
+  push_state(vm, state);
 }
 
-void push_state(State state) {
-  *state_stack_top = state;
-  state_stack_top++;
+// the final ops return the first instruction of the next state
+static Instr *final_state_op(VmContext *vm, Instr *instr) {
+  vm->address = instr->address;
+  vm->state_count = vm->state_stack_top - vm->state_stack;
+  vm->symbol_count = vm->symbol_stack_top - vm->symbol_stack;
+
+  // states rarely have more than a few arguments, so plain loops beat calls
+  // to memcpy
+  for (size_t i = 0; i < vm->state_count; i++) {
+    vm->states[i] = vm->state_stack[i];
+  }
+  vm->state_stack_top = vm->state_stack;
+  for (size_t i = 0; i < vm->symbol_count; i++) {
+    vm->symbols[i] = vm->symbol_stack[i];
+  }
+  vm->symbol_stack_top = vm->symbol_stack;
+
+  return instr->target;
 }
 
-ControlFlow run_rhs() {
-#ifdef USE_COMPUTED_GOTO
-  static void *dispatch_table[] = {
-      &&do_left,       &&do_right,        &&do_left_n,      &&do_right_n,
-      &&do_write_arg,  &&do_write_val,    &&do_write_bound, &&do_symbol_arg,
-      &&do_symbol_val, &&do_symbol_bound, &&do_take_arg,    &&do_clone_arg,
-      &&do_free_arg,   &&do_make_state,   &&do_final_state, &&do_final_arg,
-  };
-#define DISPATCH() goto *dispatch_table[next()]
+static Instr *final_arg_op(VmContext *vm, Instr *instr) {
+  State *state = vm->states[instr->arg];
+  if (is_leaf(state)) {
+    vm->address = leaf_address(state);
+    vm->state_count = 0;
+    vm->symbol_count = 0;
+    return vm->entries[vm->address];
+  }
 
-  DISPATCH();
-  while (true) {
-  do_left:
-    if (tape_left(1) == STOP) {
-      return STOP;
+  vm->address = state->address;
+  vm->state_count = state->state_count;
+  vm->symbol_count = state->symbol_count;
+  for (size_t i = 0; i < vm->state_count; i++) {
+    vm->states[i] = state->states[i];
+  }
+  uint16_t *symbols = state_symbols(state);
+  for (size_t i = 0; i < vm->symbol_count; i++) {
+    vm->symbols[i] = symbols[i];
+  }
+
+  if (state->refs == 1) {
+    unlink_state(vm, state);
+    pool_free(vm, state, state_size(vm->state_count, vm->symbol_count));
+  } else {
+    state->refs--;
+    for (size_t i = 0; i < vm->state_count; i++) {
+      retain_state(vm->states[i]);
+    }
+  }
+
+  return vm->entries[vm->address];
+}
+
+static bool in_set(uint16_t *set, uint32_t count, uint16_t symbol) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (set[i] == symbol) {
+      return true;
     }
+  }
+  return false;
+}
+
+// runs the arms that only move and loop back to the current state, counting
+// one move per iteration
+static ScanResult scan(VmContext *vm, Instr *instr, bool left, bool until) {
+  uint16_t stride = instr->value;
+  uint32_t count = instr->address;
+  uint16_t *set = instr->set;
+
+  size_t budget = vm->max_moves - vm->moves;
+  size_t n = 0;
+  // cells within the buffer are read straight from it, and steps that stay
+  // within it can't reach the edge
+  Cell *head = vm->tape_head;
+  if (left) {
+    while (n < budget && head - vm->tape >= stride && head < vm->tape_end &&
+           in_set(set, count, *head) != until) {
+      head -= stride;
+      n++;
+    }
+  } else {
+    while (n < budget && head < vm->tape_end &&
+           in_set(set, count, *head) != until) {
+      head += stride;
+      n++;
+    }
+  }
+  vm->tape_head = head;
+  while (n < budget && in_set(set, count, read_tape(vm)) != until) {
+    if (!left) {
+      tape_right(vm, stride);
+    } else if (tape_left(vm, stride) == STOP) {
+      vm->moves += n;
+      PROFILE_COUNT(vm->state_moves, vm->address, n);
+      PROFILE_COUNT(vm->scan_moves, vm->address, n);
+      return SCAN_EDGE;
+    }
+    n++;
+  }
+
+  PROFILE_COUNT(vm->scan_moves, vm->address, n);
+  if (n == budget) {
+    // the final move is counted by `run_general()`
+    vm->moves += n - 1;
+    PROFILE_COUNT(vm->state_moves, vm->address, n - 1);
+    go_to(vm, vm->address);
+    return SCAN_BUDGET;
+  }
+  vm->moves += n;
+  PROFILE_COUNT(vm->state_moves, vm->address, n);
+  vm->pc = instr + 1;
+  return SCAN_DONE;
+}
+
+// `run_general()` keeps the head, the move count and the limit in locals, and
+// stores them back around the helpers that use the ones in the VM: growing
+// or paging the tape, scans and writes to the watched cell
+#define SAVE()                                                                 \
+  vm->tape_head = head;                                                        \
+  vm->moves = moves;                                                           \
+  vm->max_moves = max_moves
+#define LOAD()                                                                 \
+  tape = vm->tape;                                                             \
+  tape_end = vm->tape_end;                                                     \
+  watch = vm->watch;                                                           \
+  head = vm->tape_head;                                                        \
+  moves = vm->moves;                                                           \
+  max_moves = vm->max_moves
+
+#define READ(symbol)                                                           \
+  if (head < tape_end) {                                                       \
+    symbol = *head;                                                            \
+  } else {                                                                     \
+    SAVE();                                                                    \
+    symbol = read_tape(vm);                                                    \
+    LOAD();                                                                    \
+  }
+#define WRITE(symbol)                                                          \
+  if (head < tape_end) {                                                       \
+    *head = (symbol);                                                          \
+    if (head == watch && (symbol)) {                                           \
+      max_moves = moves + 1;                                                   \
+    }                                                                          \
+  } else {                                                                     \
+    SAVE();                                                                    \
+    write_tape(vm, (symbol));                                                  \
+    LOAD();                                                                    \
+  }
+#define MOVE_LEFT(n)                                                           \
+  if (head - tape >= (long)(n)) {                                              \
+    head -= (n);                                                               \
+  } else {                                                                     \
+    SAVE();                                                                    \
+    ControlFlow flow = tape_left(vm, (n));                                     \
+    LOAD();                                                                    \
+    if (flow == STOP) {                                                        \
+      goto stop;                                                               \
+    }                                                                          \
+  }
+
+// runs moves that need the general path, until the machine halts,
+// `max_moves` is reached or the next state can run in `run_simple()`. Makes
+// at least one move unless it halts
+static ControlFlow run_general(VmContext *vm) {
+  Cell *tape, *tape_end, *watch, *head;
+  size_t moves, max_moves;
+  LOAD();
+#ifndef PROFILING
+  Extent *extents = vm->extents;
+  Instr *code = vm->code;
+#endif
+  Instr *instr = vm->pc;
+  uint16_t symbol;
+  uint16_t bound = 0;
+
+  while (moves < max_moves) {
+#ifdef PROFILING
+    uint32_t address = vm->address;
+#endif
+    while (true) {
+      switch (instr->op) {
+      case COMPARE_ARG:
+        READ(symbol);
+        if (symbol == vm->symbols[instr->arg]) {
+          instr++;
+          goto rhs;
+        }
+        instr = instr->next_arm;
+        break;
+      case COMPARE_VAL:
+        READ(symbol);
+        if (symbol == instr->value) {
+          instr++;
+          goto rhs;
+        }
+        instr = instr->next_arm;
+        break;
+      case OTHER:
+        READ(bound);
+        instr++;
+        goto rhs;
+      case HALT:
+        goto stop;
+      case DISPATCH_TABLE: {
+        READ(symbol);
+        Instr *arm = instr->arms[symbol < instr->value ? symbol : instr->value];
+        if (!arm) {
+          goto stop;
+        }
+        bound = symbol;
+        instr = arm;
+        goto rhs;
+      }
+      case SCAN_LEFT_WHILE:
+      case SCAN_RIGHT_WHILE:
+      case SCAN_LEFT_UNTIL:
+      case SCAN_RIGHT_UNTIL: {
+        uint8_t op = instr->op;
+        SAVE();
+        vm->pc = instr;
+        ScanResult result =
+            scan(vm, instr, op == SCAN_LEFT_WHILE || op == SCAN_LEFT_UNTIL,
+                 op == SCAN_LEFT_UNTIL || op == SCAN_RIGHT_UNTIL);
+        LOAD();
+        instr = vm->pc;
+        if (result == SCAN_EDGE) {
+          goto stop;
+        } else if (result == SCAN_BUDGET) {
+          // the scan made every move but the last one of its budget
+          moves++;
+          goto moved;
+        }
+        break;
+      }
+      }
+    }
+
+  rhs:
+    PROFILE_COUNT(vm->arm_matches, instr->offset, 1);
+#ifdef USE_COMPUTED_GOTO
+    static void *dispatch_table[] = {
+        &&do_left,       &&do_right,        &&do_left_n,      &&do_right_n,
+        &&do_write_arg,  &&do_write_val,    &&do_write_bound, &&do_symbol_arg,
+        &&do_symbol_val, &&do_symbol_bound, &&do_take_arg,    &&do_clone_arg,
+        &&do_free_arg,   &&do_make_state,   &&do_final_state, &&do_final_arg,
+        [INLINED] = &&do_inlined,
+    };
+#define DISPATCH() goto *dispatch_table[instr->op]
+#define NEXT()                                                                 \
+  instr++;                                                                     \
+  DISPATCH()
+
     DISPATCH();
+  do_left:
+    MOVE_LEFT(1);
+    NEXT();
   do_right:
-    tape_right(1);
-    DISPATCH();
+    head++;
+    NEXT();
   do_left_n:
-    if (tape_left(next()) == STOP) {
-      return STOP;
-    }
-    DISPATCH();
+    MOVE_LEFT(instr->arg);
+    NEXT();
   do_right_n:
-    tape_right(next());
-    DISPATCH();
+    head += instr->arg;
+    NEXT();
   do_write_arg:
-    write_tape(symbols[next()]);
-    DISPATCH();
+    WRITE(vm->symbols[instr->arg]);
+    NEXT();
   do_write_val:
-    write_tape(next_u16());
-    DISPATCH();
+    WRITE(instr->value);
+    NEXT();
   do_write_bound:
-    write_tape(bound);
-    DISPATCH();
+    WRITE(bound);
+    NEXT();
   do_symbol_arg:
-    push_symbol(symbols[next()]);
-    DISPATCH();
+    push_symbol(vm, vm->symbols[instr->arg]);
+    NEXT();
   do_symbol_val:
-    push_symbol(next_u16());
-    DISPATCH();
+    push_symbol(vm, instr->value);
+    NEXT();
   do_symbol_bound:
-    push_symbol(bound);
-    DISPATCH();
+    push_symbol(vm, bound);
+    NEXT();
   do_take_arg:
-    push_state(states[next()]);
-    DISPATCH();
-  do_clone_arg:
-    push_state(clone_state(&states[next()]));
-    DISPATCH();
+    push_state(vm, vm->states[instr->arg]);
+    NEXT();
+  do_clone_arg : {
+    State *state = vm->states[instr->arg];
+    retain_state(state);
+    push_state(vm, state);
+    NEXT();
+  }
   do_free_arg:
-    free_state(&states[next()]);
-    DISPATCH();
-  do_make_state : {
-    uint8_t args = next();
-    uint32_t address = next_u32();
-
-    State state;
-    state.address = address;
-    state.state_count = args;
-    state.symbol_count = symbol_stack_top - symbol_stack;
-
-    if (state.state_count) {
-      state_stack_top -= args;
-      state.states = MALLOC(args * sizeof(State));
-      memcpy(state.states, state_stack_top, args * sizeof(State));
+    release_state(vm, vm->states[instr->arg]);
+    NEXT();
+  do_make_state:
+    make_state_op(vm, instr);
+    NEXT();
+  do_inlined:
+    if (moves + 1 + instr->value > max_moves) {
+      // go where the arm went before inlining, so the run still stops at the
+      // limit
+      instr = instr->target;
+      DISPATCH();
     }
-    if (state.symbol_count) {
-      state.symbols = MALLOC(state.symbol_count * sizeof(uint16_t));
-      memcpy(state.symbols, symbol_stack,
-             state.symbol_count * sizeof(uint16_t));
-      symbol_stack_top = symbol_stack;
+    moves += instr->value;
+    vm->inlined_moves += instr->value;
+    NEXT();
+  do_final_state:
+    moves++;
+    instr = final_state_op(vm, instr);
+    goto moved;
+  do_final_arg:
+    moves++;
+    instr = final_arg_op(vm, instr);
+    goto moved;
+#else
+    for (;; instr++) {
+      switch (instr->op) {
+      case LEFT: {
+        MOVE_LEFT(1);
+        break;
+      }
+      case RIGHT: {
+        head++;
+        break;
+      }
+      case LEFT_N: {
+        MOVE_LEFT(instr->arg);
+        break;
+      }
+      case RIGHT_N: {
+        head += instr->arg;
+        break;
+      }
+      case WRITE_ARG: {
+        WRITE(vm->symbols[instr->arg]);
+        break;
+      }
+      case WRITE_VAL: {
+        WRITE(instr->value);
+        break;
+      }
+      case WRITE_BOUND: {
+        WRITE(bound);
+        break;
+      }
+      case SYMBOL_ARG: {
+        push_symbol(vm, vm->symbols[instr->arg]);
+        break;
+      }
+      case SYMBOL_VAL: {
+        push_symbol(vm, instr->value);
+        break;
+      }
+      case SYMBOL_BOUND: {
+        push_symbol(vm, bound);
+        break;
+      }
+      case TAKE_ARG: {
+        push_state(vm, vm->states[instr->arg]);
+        break;
+      }
+      case CLONE_ARG: {
+        State *state = vm->states[instr->arg];
+        retain_state(state);
+        push_state(vm, state);
+        break;
+      }
+      case FREE_ARG: {
+        release_state(vm, vm->states[instr->arg]);
+        break;
+      }
+      case MAKE_STATE: {
+        make_state_op(vm, instr);
+        break;
+      }
+      case INLINED: {
+        if (moves + 1 + instr->value > max_moves) {
+          // `instr++` takes it to the first instruction there
+          instr = instr->target - 1;
+        } else {
+          moves += instr->value;
+          vm->inlined_moves += instr->value;
+        }
+        break;
+      }
+      case FINAL_STATE: {
+        moves++;
+        instr = final_state_op(vm, instr);
+        goto moved;
+      }
+      case FINAL_ARG: {
+        moves++;
+        instr = final_arg_op(vm, instr);
+        goto moved;
+      }
+      }
     }
+#endif
 
-    push_state(state);
-    DISPATCH();
+  moved:
+    PROFILE_COUNT(vm->state_moves, address, 1);
+#ifndef PROFILING
+    if (extents[instr - code].simple) {
+      break;
+    }
+#endif
   }
-  do_final_state : {
-    address = next_u32();
-    state_count = state_stack_top - state_stack;
-    symbol_count = symbol_stack_top - symbol_stack;
 
-    if (state_count) {
-      memcpy(states, state_stack, state_count * sizeof(State));
-      state_stack_top = state_stack;
-    }
-    if (symbol_count) {
-      memcpy(symbols, symbol_stack, symbol_count * sizeof(uint16_t));
-      symbol_stack_top = symbol_stack;
-    }
+  SAVE();
+  vm->pc = instr;
+  return CONTINUE;
 
-    go_to(address);
-    return CONTINUE;
-  }
-  do_final_arg : {
-    uint8_t arg_index = next();
-    State state = states[arg_index];
-    address = state.address;
-    state_count = state.state_count;
-    if (state_count) {
-      memcpy(states, &state.states[0], state.state_count * sizeof(State));
-      FREE(state.states);
-    }
-    symbol_count = state.symbol_count;
-    if (symbol_count) {
-      memcpy(symbols, &state.symbols[0], state.symbol_count * sizeof(uint8_t));
-      FREE(state.symbols);
-    }
+stop:
+  SAVE();
+  vm->pc = instr;
+  return STOP;
+}
 
-    go_to(address);
-    return CONTINUE;
-  }
+// the length of the encoded instruction at `bytes`
+static size_t encoded_len(uint8_t *bytes) {
+  switch (bytes[0]) {
+  case LEFT_N:
+  case RIGHT_N:
+  case WRITE_ARG:
+  case SYMBOL_ARG:
+  case TAKE_ARG:
+  case CLONE_ARG:
+  case FREE_ARG:
+  case FINAL_ARG:
+    return 2;
+  case WRITE_VAL:
+  case SYMBOL_VAL:
+    return 3;
+  case COMPARE_ARG:
+  case INLINED:
+    return 4;
+  case COMPARE_VAL:
+  case FINAL_STATE:
+    return 5;
+  case MAKE_STATE:
+    return 6;
+  case DISPATCH_TABLE:
+    return 7 + 2 * read_u16(&bytes[3]);
+  case SCAN_LEFT_WHILE:
+  case SCAN_RIGHT_WHILE:
+  case SCAN_LEFT_UNTIL:
+  case SCAN_RIGHT_UNTIL:
+    return 5 + 2 * read_u16(&bytes[3]);
+  default:
+    return 1;
   }
-#else
-  while (true) {
-    switch (next()) {
-    case LEFT: {
-      if (tape_left(1) == STOP) {
-        return STOP;
-      }
+}
+
+// the deepest the state and the symbol stack get. Right-hand sides push the
+// arguments of the states they make in straight-line code, starting with both
+// stacks empty, and MAKE_STATE takes all the symbols on the stack, so one walk
+// over the bytecode finds them and the stacks never need to grow while running
+static void max_depths(uint8_t *bytes, size_t len, size_t *max_states,
+                       size_t *max_symbols) {
+  size_t states = 0;
+  size_t symbols = 0;
+  *max_states = *max_symbols = 1;
+  for (size_t offset = HALT_ADDRESS; offset < len;) {
+    uint8_t *encoded = &bytes[offset];
+    switch (encoded[0]) {
+    case SYMBOL_ARG:
+    case SYMBOL_VAL:
+    case SYMBOL_BOUND:
+      symbols++;
       break;
-    }
-    case RIGHT: {
-      tape_right(1);
+    case TAKE_ARG:
+    case CLONE_ARG:
+      states++;
       break;
-    }
-    case LEFT_N: {
-      if (tape_left(next()) == STOP) {
-        return STOP;
-      }
+    case MAKE_STATE:
+      states = states - encoded[1] + 1;
+      symbols = 0;
       break;
-    }
-    case RIGHT_N: {
-      tape_right(next());
+    case FINAL_STATE:
+    case FINAL_ARG:
+      states = symbols = 0;
       break;
     }
-    case WRITE_ARG: {
-      uint8_t arg_index = next();
-      write_tape(symbols[arg_index]);
-      break;
+    if (states > *max_states) {
+      *max_states = states;
     }
-    case WRITE_VAL: {
-      uint16_t value = next_u16();
-      write_tape(value);
-      break;
+    if (symbols > *max_symbols) {
+      *max_symbols = symbols;
     }
-    case WRITE_BOUND: {
-      write_tape(bound);
-      break;
+    offset += encoded_len(encoded);
+  }
+}
+
+// decodes everything but the jumps, which need `entries` to be complete
+static void decode(Instr *instr, uint8_t *bytes, Instr ***arms,
+                   uint16_t **set) {
+  instr->op = bytes[0];
+  switch (bytes[0]) {
+  case LEFT_N:
+  case RIGHT_N:
+  case WRITE_ARG:
+  case SYMBOL_ARG:
+  case TAKE_ARG:
+  case CLONE_ARG:
+  case FREE_ARG:
+  case FINAL_ARG:
+  case COMPARE_ARG:
+    instr->arg = bytes[1];
+    break;
+  case INLINED:
+    instr->value = bytes[1];
+    break;
+  case WRITE_VAL:
+  case SYMBOL_VAL:
+  case COMPARE_VAL:
+    instr->value = read_u16(&bytes[1]);
+    break;
+  case MAKE_STATE:
+    instr->arg = bytes[1];
+    instr->address = read_u32(&bytes[2]);
+    break;
+  case FINAL_STATE:
+    instr->address = read_u32(&bytes[1]);
+    break;
+  case DISPATCH_TABLE:
+    instr->value = read_u16(&bytes[3]);
+    instr->arms = *arms;
+    *arms += instr->value + 1;
+    break;
+  case SCAN_LEFT_WHILE:
+  case SCAN_RIGHT_WHILE:
+  case SCAN_LEFT_UNTIL:
+  case SCAN_RIGHT_UNTIL:
+    instr->value = read_u16(&bytes[1]);
+    instr->address = read_u16(&bytes[3]);
+    instr->set = *set;
+    for (uint32_t i = 0; i < instr->address; i++) {
+      instr->set[i] = read_u16(&bytes[5 + 2 * i]);
     }
-    case SYMBOL_ARG: {
-      uint8_t arg_index = next();
-      push_symbol(symbols[arg_index]);
-      break;
+    *set += instr->address;
+    break;
+  }
+}
+
+static void resolve(VmContext *vm, Instr *instr, uint8_t *bytes,
+                    size_t offset) {
+  switch (bytes[0]) {
+  case COMPARE_ARG:
+  case COMPARE_VAL: {
+    size_t len = encoded_len(bytes);
+    instr->next_arm = vm->entries[offset + len + read_u16(&bytes[len - 2])];
+    break;
+  }
+  case FINAL_STATE:
+    instr->target = vm->entries[instr->address];
+    break;
+  case INLINED:
+    instr->target = vm->entries[offset + 4 + read_u16(&bytes[2])];
+    break;
+  case DISPATCH_TABLE: {
+    // the arms follow the table, and the table holds the default arm first
+    size_t base = offset + encoded_len(bytes);
+    for (uint16_t i = 0; i <= instr->value; i++) {
+      uint16_t arm = read_u16(&bytes[5 + 2 * ((i + 1) % (instr->value + 1))]);
+      instr->arms[i] = arm == NO_ARM ? NULL : vm->entries[base + arm];
     }
-    case SYMBOL_VAL: {
-      uint16_t value = next_u16();
-      push_symbol(value);
-      break;
+    break;
+  }
+  }
+}
+
+// the extent of `code[i]`, from the extents of the instructions after it
+static Extent measure(VmContext *vm, size_t i) {
+  Instr *instr = &vm->code[i];
+  Extent next = {0, 0, false};
+  if (instr->op <= WRITE_BOUND) {
+    next = vm->extents[i + 1];
+  }
+
+  Extent extent = {0, 0, false};
+  switch (instr->op) {
+  case LEFT:
+  case LEFT_N:
+    extent.simple = next.simple;
+    extent.low = next.low - (instr->op == LEFT ? 1 : instr->arg);
+    extent.high = next.high - (instr->op == LEFT ? 1 : instr->arg);
+    break;
+  case RIGHT:
+  case RIGHT_N:
+    extent.simple = next.simple;
+    extent.low = next.low + (instr->op == RIGHT ? 1 : instr->arg);
+    extent.high = next.high + (instr->op == RIGHT ? 1 : instr->arg);
+    break;
+  case WRITE_VAL:
+  case WRITE_BOUND:
+    extent.simple = next.simple;
+    extent.low = next.low;
+    extent.high = next.high;
+    break;
+  case FINAL_STATE:
+  case HALT:
+    extent.simple = true;
+    break;
+  case INLINED:
+    // neither target moves the head
+    extent.simple = vm->extents[i + 1].simple &&
+                    vm->extents[instr->target - vm->code].simple;
+    break;
+  case COMPARE_VAL:
+    extent.simple = vm->extents[i + 1].simple &&
+                    vm->extents[instr->next_arm - vm->code].simple;
+    break;
+  case OTHER:
+    extent.simple = vm->extents[i + 1].simple;
+    break;
+  case DISPATCH_TABLE:
+    extent.simple = true;
+    for (uint16_t j = 0; j <= instr->value; j++) {
+      Instr *arm = instr->arms[j];
+      if (arm && !vm->extents[arm - vm->code].simple) {
+        extent.simple = false;
+      }
     }
-    case SYMBOL_BOUND: {
-      push_symbol(bound);
-      break;
+    break;
+  }
+
+  // the cell under the head is read before anything moves
+  if (extent.low > 0) {
+    extent.low = 0;
+  }
+  if (extent.high < 0) {
+    extent.high = 0;
+  }
+  return extent;
+}
+
+// translates the bytecode into `Instr`s, so operands are only decoded once
+// and jumps go straight to their targets
+void init_bytes(VmContext *vm, uint8_t *bytes, size_t len) {
+  size_t instr_count = 0;
+  size_t arm_count = 0;
+  size_t set_len = 0;
+  for (size_t offset = HALT_ADDRESS; offset < len;) {
+    uint8_t *encoded = &bytes[offset];
+    if (encoded[0] == DISPATCH_TABLE) {
+      arm_count += read_u16(&encoded[3]) + 1;
+    } else if (encoded[0] >= SCAN_LEFT_WHILE && encoded[0] != INLINED) {
+      set_len += read_u16(&encoded[3]);
     }
-    case TAKE_ARG: {
-      uint8_t arg_index = next();
-      push_state(states[arg_index]);
-      break;
+    instr_count++;
+    offset += encoded_len(encoded);
+  }
+
+  vm->code = CALLOC(instr_count, sizeof(Instr));
+  vm->entries = CALLOC(len, sizeof(Instr *));
+  vm->arm_tables = CALLOC(arm_count + 1, sizeof(Instr *));
+  vm->scan_sets = CALLOC(set_len + 1, sizeof(uint16_t));
+
+  Instr *instr = vm->code;
+  Instr **arms = vm->arm_tables;
+  uint16_t *set = vm->scan_sets;
+  for (size_t offset = HALT_ADDRESS; offset < len;) {
+    vm->entries[offset] = instr;
+    decode(instr, &bytes[offset], &arms, &set);
+#ifdef PROFILING
+    instr->offset = offset;
+#endif
+    instr++;
+    offset += encoded_len(&bytes[offset]);
+  }
+
+  instr = vm->code;
+  for (size_t offset = HALT_ADDRESS; offset < len;) {
+    resolve(vm, instr, &bytes[offset], offset);
+    instr++;
+    offset += encoded_len(&bytes[offset]);
+  }
+
+  // jumps within a state only go forward
+  vm->extents = CALLOC(instr_count, sizeof(Extent));
+  for (size_t i = instr_count; i-- > 0;) {
+    vm->extents[i] = measure(vm, i);
+  }
+
+  size_t max_states, max_symbols;
+  max_depths(bytes, len, &max_states, &max_symbols);
+  vm->state_stack = MALLOC(max_states * sizeof(State *));
+  vm->state_stack_top = vm->state_stack;
+  vm->symbol_stack = MALLOC(max_symbols * sizeof(uint16_t));
+  vm->symbol_stack_top = vm->symbol_stack;
+
+  vm->state_count = 0;
+  vm->symbol_count = 0;
+  vm->start_address = read_u32(&bytes[2]);
+  vm->address = vm->start_address;
+  go_to(vm, vm->address);
+}
+
+#ifndef PROFILING
+// runs states whose arms only move and write constants, which includes every
+// state of most specialized machines, with the head and the move count in
+// locals. Each arm checks once that it stays within the tape instead of on
+// every instruction. Returns when the next move needs the general path
+static void run_simple(VmContext *vm) {
+  Instr *code = vm->code;
+  Extent *extents = vm->extents;
+  Cell *tape = vm->tape;
+  Cell *tape_end = vm->tape_end;
+  Cell *watch = vm->watch;
+  Cell *head = vm->tape_head;
+  size_t moves = vm->moves;
+  size_t inlined_moves = vm->inlined_moves;
+  size_t max_moves = vm->max_moves;
+  Instr *state = vm->pc;
+  uint32_t address = vm->address;
+
+  while (moves < max_moves && head < tape_end) {
+    uint16_t symbol = *head;
+    Instr *instr = state;
+    while (instr->op == COMPARE_VAL && instr->value != symbol) {
+      instr = instr->next_arm;
     }
-    case CLONE_ARG: {
-      uint8_t arg_index = next();
-      push_state(clone_state(&states[arg_index]));
+    if (instr->op == HALT) {
       break;
+    } else if (instr->op == DISPATCH_TABLE) {
+      instr = instr->arms[symbol < instr->value ? symbol : instr->value];
+      if (!instr) {
+        break;
+      }
+    } else {
+      instr++;
     }
-    case FREE_ARG: {
-      uint8_t arg_index = next();
-      free_state(&states[arg_index]);
+
+    Extent *extent = &extents[instr - code];
+    if (head - tape < -extent->low || tape_end - head <= extent->high) {
       break;
     }
-    case MAKE_STATE: {
-      uint8_t args = next();
-      uint32_t address = next_u32();
-
-      State state;
-      state.address = address;
-      state.state_count = args;
-      state.symbol_count = symbol_stack_top - symbol_stack;
-
-      if (state.state_count) {
-        state_stack_top -= args;
-        state.states = MALLOC(args * sizeof(State));
-        memcpy(state.states, state_stack_top, args * sizeof(State));
+    for (; instr->op != FINAL_STATE; instr++) {
+      switch (instr->op) {
+      case LEFT:
+        head--;
+        break;
+      case RIGHT:
+        head++;
+        break;
+      case LEFT_N:
+        head -= instr->arg;
+        break;
+      case RIGHT_N:
+        head += instr->arg;
+        break;
+      case WRITE_VAL:
+      case WRITE_BOUND: {
+        uint16_t value = instr->op == WRITE_VAL ? instr->value : symbol;
+        *head = value;
+        if (head == watch && value) {
+          max_moves = moves + 1;
+        }
+        break;
       }
-      if (state.symbol_count) {
-        state.symbols = MALLOC(state.symbol_count * sizeof(uint16_t));
-        memcpy(state.symbols, symbol_stack,
-               state.symbol_count * sizeof(uint16_t));
-        symbol_stack_top = symbol_stack;
+      case INLINED:
+        if (moves + 1 + instr->value > max_moves) {
+          instr = instr->target - 1;
+        } else {
+          moves += instr->value;
+          inlined_moves += instr->value;
+        }
+        break;
       }
+    }
 
-      push_state(state);
+    moves++;
+    address = instr->address;
+    state = instr->target;
+    if (!extents[state - code].simple) {
       break;
     }
-    case FINAL_STATE: {
-      address = next_u32();
-      state_count = state_stack_top - state_stack;
-      symbol_count = symbol_stack_top - symbol_stack;
+  }
 
-      if (state_count) {
-        memcpy(states, state_stack, state_count * sizeof(State));
-        state_stack_top = state_stack;
-      }
-      if (symbol_count) {
-        memcpy(symbols, symbol_stack, symbol_count * sizeof(uint16_t));
-        symbol_stack_top = symbol_stack;
-      }
+  if (moves != vm->moves) {
+    vm->tape_head = head;
+    vm->moves = moves;
+    vm->inlined_moves = inlined_moves;
+    vm->max_moves = max_moves;
+    vm->address = address;
+    vm->state_count = 0;
+    vm->symbol_count = 0;
+    vm->pc = state;
+  }
+}
+#endif
 
-      go_to(address);
-      return CONTINUE;
-    }
-    case FINAL_ARG: {
-      uint8_t arg_index = next();
-      State state = states[arg_index];
-      address = state.address;
-      state_count = state.state_count;
-      if (state_count) {
-        memcpy(states, &state.states[0], state.state_count * sizeof(State));
-        FREE(state.states);
-      }
-      symbol_count = state.symbol_count;
-      if (symbol_count) {
-        memcpy(symbols, &state.symbols[0],
-               state.symbol_count * sizeof(uint8_t));
-        FREE(state.symbols);
+// runs until the machine halts or `max_moves` moves have been made in total,
+// so a run can be continued by calling this again with a bigger limit
+void run(VmContext *vm, size_t max_moves) {
+  vm->max_moves = max_moves;
+
+  while (vm->moves < vm->max_moves) {
+#ifndef PROFILING
+    if (vm->extents[vm->pc - vm->code].simple) {
+      run_simple(vm);
+      if (vm->moves >= vm->max_moves) {
+        break;
       }
-      go_to(address);
-      return CONTINUE;
     }
+#endif
+    if (run_general(vm) == STOP) {
+      break;
     }
   }
+}
+
+#ifdef PROFILING
+// allocates the counters for bytecode of `len` bytes. Must be called before
+// any state is made
+void init_profile(VmContext *vm, size_t len) {
+  vm->profile_len = len;
+  vm->state_moves = CALLOC(len, sizeof(uint64_t));
+  vm->scan_moves = CALLOC(len, sizeof(uint64_t));
+  vm->arm_matches = CALLOC(len, sizeof(uint64_t));
+  vm->allocations = CALLOC(len, sizeof(uint64_t));
+}
+
+// copies the counters into four arrays of `len` counters each
+void copy_profile(VmContext *vm, uint64_t *state_moves, uint64_t *scan_moves,
+                  uint64_t *arm_matches, uint64_t *allocations) {
+  size_t size = vm->profile_len * sizeof(uint64_t);
+  memcpy(state_moves, vm->state_moves, size);
+  memcpy(scan_moves, vm->scan_moves, size);
+  memcpy(arm_matches, vm->arm_matches, size);
+  memcpy(allocations, vm->allocations, size);
+}
 #endif
+
+// takes ownership of the references in `states`
+void set_state(VmContext *vm, uint32_t address, State **states,
+               size_t state_count, uint16_t *symbols, size_t symbol_count) {
+  vm->address = address;
+  vm->state_count = state_count;
+  vm->symbol_count = symbol_count;
+  memcpy(vm->states, states, state_count * sizeof(State *));
+  memcpy(vm->symbols, symbols, symbol_count * sizeof(uint16_t));
+  go_to(vm, address);
 }
 
-ControlFlow run_move() {
-  while (true) {
-    switch (next()) {
-    case COMPARE_ARG: {
-      uint8_t arg_index = next();
-      if (read_tape() == symbols[arg_index]) {
-        next_u16();
-        return run_rhs();
-      } else {
-        skip(next_u16());
-      }
-      break;
+void set_tape_head_position(VmContext *vm, size_t position) {
+  if (vm->sparse) {
+    seek(vm, position);
+  } else {
+    vm->tape_head = vm->tape + position;
+  }
+}
+
+void set_tape_origin(VmContext *vm, size_t origin) { vm->tape_origin = origin; }
+
+void set_bi_infinite(VmContext *vm, bool bi_infinite) {
+  vm->bi_infinite = bi_infinite;
+}
+
+// must be called before `init_tape()`
+void set_sparse(VmContext *vm, bool sparse) { vm->sparse = sparse; }
+
+void set_move_count(VmContext *vm, size_t moves) { vm->moves = moves; }
+
+void set_inlined_move_count(VmContext *vm, size_t moves) {
+  vm->inlined_moves = moves;
+}
+
+void set_watch_cell(VmContext *vm, size_t position) {
+  vm->watching = true;
+  vm->watch_position = position;
+  update_watch(vm);
+}
+
+uint32_t get_final_address(VmContext *vm) { return vm->address; }
+
+State **get_states(VmContext *vm) { return vm->states; }
+
+size_t get_state_count(VmContext *vm) { return vm->state_count; }
+
+uint16_t *get_symbols(VmContext *vm) { return vm->symbols; }
+
+size_t get_symbol_count(VmContext *vm) { return vm->symbol_count; }
+
+uint32_t get_state_address(State *state) {
+  return is_leaf(state) ? leaf_address(state) : state->address;
+}
+
+State **get_state_children(State *state) {
+  return is_leaf(state) ? NULL : state->states;
+}
+
+size_t get_state_child_count(State *state) {
+  return is_leaf(state) ? 0 : state->state_count;
+}
+
+uint16_t *get_state_symbols(State *state) {
+  return is_leaf(state) ? NULL : state_symbols(state);
+}
+
+size_t get_state_symbol_count(State *state) {
+  return is_leaf(state) ? 0 : state->symbol_count;
+}
+
+// widens the tape into `symbols`, which has room for `get_tape_len()` cells.
+// In sparse mode, the pages are laid out in one contiguous tape
+void copy_tape(VmContext *vm, uint16_t *symbols) {
+  if (!vm->sparse) {
+    for (Cell *cell = vm->tape; cell < vm->tape_end; cell++) {
+      *symbols++ = *cell;
     }
-    case COMPARE_VAL: {
-      if (next_u16() == read_tape()) {
-        next_u16();
-        return run_rhs();
-      } else {
-        skip(next_u16());
+    return;
+  }
+
+  int64_t low = sparse_low(vm);
+  memset(symbols, 0, sparse_len(vm) * sizeof(uint16_t));
+  for (size_t i = 0; i < vm->page_bucket_count; i++) {
+    for (Page *page = vm->pages[i]; page; page = page->next) {
+      uint16_t *start = &symbols[page->index * TAPE_PAGE_SIZE - low];
+      for (size_t j = 0; j < TAPE_PAGE_SIZE; j++) {
+        start[j] = page->cells[j];
       }
-      break;
-    }
-    case OTHER: {
-      bound = read_tape();
-      return run_rhs();
-    }
-    case HALT: {
-      return STOP;
-    }
     }
   }
 }
 
-void run(uint8_t *bytes, size_t max_moves_) {
-  bytes_start = bytes;
-  ip = bytes;
-  max_moves = max_moves_;
-  moves = 0;
+// hands the tape over to the caller, who frees it with `free_tape()`, so it
+// doesn't have to be copied. The tape is left empty. Sparse tapes aren't
+// contiguous, so they're never handed over and NULL is returned instead
+void *take_tape(VmContext *vm) {
+  if (vm->sparse) {
+    return NULL;
+  }
+  Cell *tape = vm->tape;
+  vm->tape = vm->tape_end = vm->tape_head = NULL;
+  vm->tape_origin = 0;
+  return tape;
+}
 
-  next_u16();
-  state_count = 0;
-  symbol_count = 0;
-  address = next_u32();
-  go_to(address);
+void free_tape(void *tape) { FREE(tape); }
 
-  while (moves < max_moves) {
-    if (run_move() == STOP) {
-      break;
-    }
-    moves++;
+size_t get_tape_len(VmContext *vm) {
+  return vm->sparse ? sparse_len(vm) : (size_t)(vm->tape_end - vm->tape);
+}
+
+size_t get_tape_head_position(VmContext *vm) {
+  if (vm->sparse) {
+    return sparse_position(vm) - sparse_low(vm);
   }
+  return vm->tape_head - vm->tape;
 }
 
-uint32_t get_final_address() { return address; }
+size_t get_tape_origin(VmContext *vm) {
+  if (vm->sparse) {
+    return vm->tape_origin - sparse_low(vm);
+  }
+  return vm->tape_origin;
+}
 
-uint16_t *get_tape() { return tape; }
+// the symbol in the cell `position` cells to the right of the initial cell 0
+uint16_t get_cell(VmContext *vm, int64_t position) {
+  int64_t index = vm->tape_origin + position;
+  if (vm->sparse) {
+    Page *page = find_page(vm, index >> TAPE_PAGE_SHIFT);
+    return page ? page->cells[index & (TAPE_PAGE_SIZE - 1)] : 0;
+  }
+  return index >= 0 && index < vm->tape_end - vm->tape ? vm->tape[index] : 0;
+}
 
-size_t get_tape_len() { return tape_end - tape; }
+// inserts `copies` copies of the `len` cells in `pattern` before the cell
+// `position` cells right of the initial cell 0, moving the cells after it
+// right, or with `left`, the cells before it left. The head moves with the
+// cells around it. Not supported in sparse mode
+void insert_cells(VmContext *vm, int64_t position, uint16_t *pattern,
+                  size_t len, size_t copies, bool left) {
+  int64_t index = vm->tape_origin + position;
+  size_t head_offset = vm->tape_head - vm->tape;
+  if (index < 0) {
+    grow_tape_left(vm, head_offset - index);
+    index = vm->tape_origin + position;
+    head_offset = vm->tape_head - vm->tape;
+  }
 
-size_t get_tape_head_position() { return tape_head - tape; }
+  size_t start = index;
+  size_t inserted = len * copies;
+  size_t old_len = vm->tape_end - vm->tape;
+  size_t new_len = (start > old_len ? start : old_len) + inserted;
+  Cell *tape = REALLOC(vm->tape, new_len * sizeof(Cell));
+  if (start < old_len) {
+    memmove(&tape[start + inserted], &tape[start],
+            (old_len - start) * sizeof(Cell));
+  } else {
+    memset(&tape[old_len], 0, (start - old_len) * sizeof(Cell));
+  }
+  for (size_t i = 0; i < len; i++) {
+    tape[start + i] = pattern[i];
+  }
+  // every copy doubles the cells copied so far
+  for (size_t done = len; done < inserted;) {
+    size_t n = done < inserted - done ? done : inserted - done;
+    memcpy(&tape[start + done], &tape[start], n * sizeof(Cell));
+    done += n;
+  }
 
-size_t get_move_count() { return moves; }
+  vm->tape = tape;
+  vm->tape_end = &tape[new_len];
+  vm->tape_head = &tape[head_offset + (head_offset >= start ? inserted : 0)];
+  if (left) {
+    vm->tape_origin += inserted;
+  }
+  update_watch(vm);
+}
 
-void cleanup() {
-  FREE(tape);
-  for (size_t i = 0; i < state_count; i++) {
-    free_state(&states[i]);
+bool get_bi_infinite(VmContext *vm) { return vm->bi_infinite; }
+
+size_t get_move_count(VmContext *vm) { return vm->moves; }
+
+size_t get_inlined_move_count(VmContext *vm) { return vm->inlined_moves; }
+
+// frees the tape, or every page of a sparse tape
+static void free_cells(VmContext *vm) {
+  if (vm->sparse) {
+    for (size_t i = 0; i < vm->page_bucket_count; i++) {
+      while (vm->pages[i]) {
+        Page *next = vm->pages[i]->next;
+        FREE(vm->pages[i]);
+        vm->pages[i] = next;
+      }
+    }
+    FREE(vm->pages);
+    vm->page_count = 0;
+  } else {
+    FREE(vm->tape);
   }
 }
+
+// runs the machine again from its start state on a new tape, keeping the
+// decoded bytecode, so one context can run many tapes. Every state is freed
+// at once with the pool, and the watched cell is cleared
+void restart(VmContext *vm, uint16_t *symbols, size_t len) {
+  free_cells(vm);
+  vm->tape_origin = 0;
+  vm->watching = false;
+  vm->watch = NULL;
+  init_tape(vm, symbols, len);
+
+  pool_reset(vm);
+  FREE(vm->buckets);
+  init_buckets(vm);
+  vm->state_stack_top = vm->state_stack;
+  vm->symbol_stack_top = vm->symbol_stack;
+  vm->state_count = 0;
+  vm->symbol_count = 0;
+  vm->moves = 0;
+  vm->inlined_moves = 0;
+  vm->address = vm->start_address;
+  go_to(vm, vm->address);
+}
+
+void cleanup(VmContext *vm) {
+  free_cells(vm);
+  FREE(vm->buckets);
+  FREE(vm->state_stack);
+  FREE(vm->symbol_stack);
+  FREE(vm->code);
+  FREE(vm->entries);
+  FREE(vm->extents);
+  FREE(vm->arm_tables);
+  FREE(vm->scan_sets);
+  pool_reset(vm);
+#ifdef PROFILING
+  FREE(vm->state_moves);
+  FREE(vm->scan_moves);
+  FREE(vm->arm_matches);
+  FREE(vm->allocations);
+#endif
+  FREE(vm);
+}
@@ -1,76 +1,372 @@
-use std::ops::ControlFlow;
+use std::ops::{ControlFlow, Range};
+use std::rc::Rc;
 
 use crate::bytecode as bc;
+use crate::checkpoint::{self, Checkpoint};
+use crate::ffi;
+use crate::profile::{self, Profile};
 
 const EXTRA_RESIZE_ROOM: usize = 256;
 
 pub struct Simulated {
-    pub tape: Vec<u16>,
-    pub head_position: usize,
+    pub tape: Cells,
+    /// Index of the initial cell 0 in `tape`
+    pub origin: usize,
+    /// Relative to the initial cell 0
+    pub head_position: isize,
     pub final_address: u32,
     pub moves: usize,
+    /// Moves of states inlined with `--inline`, which the VM counted without
+    /// running them. After `--resume`, this includes the ones before the
+    /// checkpoint
+    pub inlined: usize,
 }
 
-#[derive(Debug, Clone)]
-struct State {
-    address: u32,
-    states: Vec<State>,
-    symbols: Vec<u16>,
+impl Simulated {
+    /// Trims the blank cells at both ends of `tape`, but never cells to the
+    /// right of `origin`.
+    pub fn new(tape: Buffer, origin: usize, head: usize, final_address: u32, moves: usize) -> Self {
+        let blank = (0..origin).take_while(|&i| tape.get(i) == 0).count();
+        let mut end = tape.len().max(origin);
+        while end > origin && tape.get(end - 1) == 0 {
+            end -= 1;
+        }
+
+        Simulated {
+            tape: Cells {
+                buffer: tape,
+                range: blank..end,
+            },
+            origin: origin - blank,
+            head_position: head as isize - origin as isize,
+            final_address,
+            moves,
+            inlined: 0,
+        }
+    }
 }
 
-pub fn simulate(bytes: &[u8], tape: Vec<u16>, max_moves: usize) -> Simulated {
-    let mut bytes = Bytes { bytes, ip: 2 };
-    bytes.goto();
-    let address = bytes.ip as u32;
+/// The tape a VM ended with, in the buffer it ran the machine in, so a big
+/// tape isn't copied out of the C VM.
+pub enum Buffer {
+    Owned(Vec<u16>),
+    Wide(ffi::Tape<u16>),
+    Narrow(ffi::Tape<u8>),
+}
 
-    let mut vm = Vm {
-        bytes,
-        tape: Tape { tape, head: 0 },
-        state: State {
-            address,
-            states: Vec::new(),
-            symbols: Vec::new(),
-        },
-        state_stack: Vec::new(),
-        symbol_stack: Vec::new(),
-        bound: 0,
-        moves: 0,
-        max_moves,
-    };
+impl Buffer {
+    fn len(&self) -> usize {
+        match self {
+            Buffer::Owned(cells) => cells.len(),
+            Buffer::Wide(cells) => cells.len(),
+            Buffer::Narrow(cells) => cells.len(),
+        }
+    }
 
-    vm.run();
+    /// Cells after the end of the buffer are blank.
+    fn get(&self, index: usize) -> u16 {
+        match self {
+            Buffer::Owned(cells) => cells.get(index).copied().unwrap_or(0),
+            Buffer::Wide(cells) => cells.get(index).copied().unwrap_or(0),
+            Buffer::Narrow(cells) => cells.get(index).map_or(0, |&cell| cell as u16),
+        }
+    }
+}
 
-    let mut tape = vm.tape.tape;
-    while let Some(0) = tape.last() {
-        tape.pop();
+/// The cells in `range` of a `Buffer`.
+pub struct Cells {
+    buffer: Buffer,
+    range: Range<usize>,
+}
+
+impl Cells {
+    pub fn len(&self) -> usize {
+        self.range.len()
+    }
+
+    pub fn is_empty(&self) -> bool {
+        self.range.is_empty()
+    }
+
+    pub fn get(&self, index: usize) -> u16 {
+        self.buffer.get(self.range.start + index)
+    }
+
+    pub fn iter(&self, range: Range<usize>) -> impl ExactSizeIterator<Item = u16> + '_ {
+        range.map(move |i| self.get(i))
     }
 
-    Simulated {
-        tape,
-        head_position: vm.tape.head,
-        final_address: vm.state.address,
-        moves: vm.moves,
+    /// The symbols in the cells from `start` on.
+    pub fn symbols<'a>(
+        &'a self,
+        start: usize,
+        symbols: &'a [String],
+    ) -> impl Iterator<Item = &'a str> + 'a {
+        (start.min(self.len())..self.len()).map(move |i| symbols[self.get(i) as usize].as_str())
     }
 }
 
-struct Vm<'a> {
+#[derive(Debug, Clone)]
+struct State {
+    address: u32,
+    states: Vec<Rc<State>>,
+    symbols: Vec<u16>,
+}
+
+/// A machine in one of the VMs that can be run in steps and checkpointed.
+pub trait Machine {
+    /// Runs until the machine halts or has made `max_moves` moves in total.
+    fn run(&mut self, max_moves: usize);
+    fn moves(&self) -> usize;
+    /// The symbol in the cell `position` cells to the right of the initial
+    /// cell 0.
+    fn cell(&self, position: isize) -> u16;
+    /// The cells that can be non-blank, relative to the initial cell 0.
+    fn written(&self) -> Range<isize>;
+    /// The position of the head, relative to the initial cell 0.
+    fn head(&self) -> isize;
+    /// The address of the current state, if it has no arguments.
+    fn address(&self) -> Option<u32>;
+    /// Inserts `copies` copies of `pattern` before the cell `position`,
+    /// moving the cells right of it further right, or with `left`, the cells
+    /// left of it further left. The head moves with the cells around it.
+    /// Also counts `moves` more moves, for skipping ahead in a cycle.
+    fn insert_cells(
+        &mut self,
+        position: isize,
+        pattern: &[u16],
+        copies: usize,
+        left: bool,
+        moves: usize,
+    );
+    /// The counters, if the machine was created with profiling on.
+    fn profile(&self) -> Option<Profile>;
+    /// Stops runs after any move that writes a non-blank symbol to the cell
+    /// `position`, like `cell()` counts it.
+    fn watch_cell(&mut self, position: usize);
+    fn checkpoint(&self, hash: u64, halted: bool) -> Checkpoint;
+    fn finish(self) -> Simulated;
+}
+
+pub fn simulate(bytes: &[u8], tape: Vec<u16>, max_moves: usize, bi_infinite: bool) -> Simulated {
+    let mut vm = Vm::new(bytes, tape, bi_infinite, false);
+    vm.run(max_moves);
+    vm.finish()
+}
+
+pub struct Vm<'a> {
     bytes: Bytes<'a>,
     tape: Tape,
     state: State,
-    state_stack: Vec<State>,
+    state_stack: Vec<Rc<State>>,
     symbol_stack: Vec<u16>,
     bound: u16,
     moves: usize,
+    /// See `Simulated::inlined`
+    inlined: usize,
     max_moves: usize,
+    /// The run stops after a move writes a non-blank symbol to this cell
+    watch: Option<usize>,
+    profile: Option<Box<Profile>>,
+}
+
+impl<'a> Vm<'a> {
+    /// With `profile`, the `Vm` counts moves, matched arms and allocated
+    /// states.
+    pub fn new(bytes: &'a [u8], tape: Vec<u16>, bi_infinite: bool, profile: bool) -> Self {
+        let mut bytes = Bytes { bytes, ip: 2 };
+        bytes.goto();
+        let address = bytes.ip as u32;
+
+        Vm {
+            bytes,
+            tape: Tape {
+                tape,
+                head: 0,
+                origin: 0,
+                bi_infinite,
+            },
+            state: State {
+                address,
+                states: Vec::new(),
+                symbols: Vec::new(),
+            },
+            state_stack: Vec::new(),
+            symbol_stack: Vec::new(),
+            bound: 0,
+            moves: 0,
+            inlined: 0,
+            max_moves: 0,
+            watch: None,
+            profile: profile.then(Box::default),
+        }
+    }
+
+    pub fn restore(bytes: &'a [u8], checkpoint: &Checkpoint, profile: bool) -> Self {
+        let mut states: Vec<Rc<State>> = Vec::with_capacity(checkpoint.states.len());
+        for node in &checkpoint.states {
+            let children = node
+                .states
+                .iter()
+                .map(|&index| Rc::clone(&states[index as usize]))
+                .collect();
+            states.push(Rc::new(State {
+                address: node.address,
+                states: children,
+                symbols: node.symbols.clone(),
+            }));
+        }
+        let state = states.pop().expect("checkpoint without a state");
+        drop(states);
+
+        let mut vm = Vm::new(
+            bytes,
+            checkpoint.tape.clone(),
+            checkpoint.bi_infinite,
+            profile,
+        );
+        vm.state = Rc::try_unwrap(state).unwrap_or_else(|state| (*state).clone());
+        vm.bytes.ip = vm.state.address as usize;
+        vm.tape.head = checkpoint.head_position;
+        vm.tape.origin = checkpoint.origin;
+        vm.moves = checkpoint.moves;
+        vm.inlined = checkpoint.inlined;
+        vm
+    }
+}
+
+impl Machine for Vm<'_> {
+    fn run(&mut self, max_moves: usize) {
+        self.max_moves = max_moves;
+        let _ = self.run_moves();
+    }
+
+    fn moves(&self) -> usize {
+        self.moves
+    }
+
+    fn cell(&self, position: isize) -> u16 {
+        usize::try_from(self.tape.origin as isize + position)
+            .ok()
+            .and_then(|index| self.tape.tape.get(index).copied())
+            .unwrap_or_default()
+    }
+
+    fn written(&self) -> Range<isize> {
+        let origin = self.tape.origin as isize;
+        -origin..self.tape.tape.len() as isize - origin
+    }
+
+    fn head(&self) -> isize {
+        self.tape.head as isize - self.tape.origin as isize
+    }
+
+    fn address(&self) -> Option<u32> {
+        let State {
+            address,
+            states,
+            symbols,
+        } = &self.state;
+        (states.is_empty() && symbols.is_empty()).then_some(*address)
+    }
+
+    fn insert_cells(
+        &mut self,
+        position: isize,
+        pattern: &[u16],
+        copies: usize,
+        left: bool,
+        moves: usize,
+    ) {
+        let tape = &mut self.tape;
+        if let Ok(n) = usize::try_from(-(tape.origin as isize + position)) {
+            if n > 0 {
+                tape.grow_left(n);
+            }
+        }
+        let index = (tape.origin as isize + position) as usize;
+        if tape.tape.len() < index {
+            tape.tape.resize(index, 0);
+        }
+
+        let inserted = pattern.len() * copies;
+        let cells = pattern.iter().copied().cycle().take(inserted);
+        tape.tape.splice(index..index, cells);
+        if tape.head >= index {
+            tape.head += inserted;
+        }
+        if left {
+            tape.origin += inserted;
+        }
+        self.moves += moves;
+    }
+
+    fn watch_cell(&mut self, position: usize) {
+        self.watch = Some(position);
+    }
+
+    fn profile(&self) -> Option<Profile> {
+        self.profile.as_deref().cloned()
+    }
+
+    fn checkpoint(&self, hash: u64, halted: bool) -> Checkpoint {
+        let root = (
+            self.state.address,
+            self.state.states.iter().map(|state| &**state).collect(),
+            self.state.symbols.clone(),
+        );
+        let states = checkpoint::flatten(
+            root,
+            |state: &State| state as *const State as usize,
+            |state| {
+                let children = state.states.iter().map(|state| &**state).collect();
+                (state.address, children, state.symbols.clone())
+            },
+        );
+
+        let mut tape = self.tape.tape.clone();
+        while let Some(0) = tape.last() {
+            tape.pop();
+        }
+
+        Checkpoint {
+            hash,
+            moves: self.moves,
+            inlined: self.inlined,
+            halted,
+            head_position: self.tape.head,
+            origin: self.tape.origin,
+            bi_infinite: self.tape.bi_infinite,
+            tape,
+            states,
+        }
+    }
+
+    fn finish(self) -> Simulated {
+        Simulated {
+            inlined: self.inlined,
+            ..Simulated::new(
+                Buffer::Owned(self.tape.tape),
+                self.tape.origin,
+                self.tape.head,
+                self.state.address,
+                self.moves,
+            )
+        }
+    }
 }
 
 impl Vm<'_> {
-    fn run(&mut self) -> ControlFlow<()> {
+    fn run_moves(&mut self) -> ControlFlow<()> {
         loop {
-            if self.moves == self.max_moves {
+            if self.moves >= self.max_moves {
                 return ControlFlow::Break(());
             }
+            let address = self.state.address;
             self.run_move()?;
+            if let Some(profile) = &mut self.profile {
+                profile::count(&mut profile.moves, address, 1);
+            }
             self.moves += 1;
         }
     }
@@ -102,27 +398,109 @@ impl Vm<'_> {
                     return ControlFlow::Continue(());
                 }
                 bc::HALT => return ControlFlow::Break(()),
+                bc::DISPATCH_TABLE => {
+                    self.bytes.next_u16();
+                    let len = self.bytes.next_u16();
+                    let default = self.bytes.next_u16();
+                    let symbol = self.tape.read();
+                    let offset = if symbol < len {
+                        self.bytes.peek_u16(2 * symbol as usize)
+                    } else {
+                        default
+                    };
+                    if offset == bc::NO_ARM {
+                        return ControlFlow::Break(());
+                    }
+                    self.bound = symbol;
+                    self.bytes.ip += 2 * len as usize + offset as usize;
+                    self.rhs()?;
+                    return ControlFlow::Continue(());
+                }
+                op @ (bc::SCAN_LEFT_WHILE
+                | bc::SCAN_RIGHT_WHILE
+                | bc::SCAN_LEFT_UNTIL
+                | bc::SCAN_RIGHT_UNTIL) => {
+                    let left = matches!(op, bc::SCAN_LEFT_WHILE | bc::SCAN_LEFT_UNTIL);
+                    let until = matches!(op, bc::SCAN_LEFT_UNTIL | bc::SCAN_RIGHT_UNTIL);
+                    if let Some(flow) = self.scan(left, until) {
+                        return flow;
+                    }
+                }
                 _ => panic!("invalid bytecode"),
             }
         }
     }
 
+    /// Runs the looping arms of the current state, one move per iteration.
+    /// Returns `None` if the arms after the scan should run.
+    fn scan(&mut self, left: bool, until: bool) -> Option<ControlFlow<()>> {
+        let stride = self.bytes.next_u16() as usize;
+        let count = self.bytes.next_u16() as usize;
+        let set: Vec<_> = (0..count).map(|_| self.bytes.next_u16()).collect();
+
+        let budget = self.max_moves - self.moves;
+        let mut n = 0;
+        while n < budget && set.contains(&self.tape.read()) != until {
+            if left {
+                if self.tape.left(stride).is_break() {
+                    self.moves += n;
+                    self.count_scan(n, n);
+                    return Some(ControlFlow::Break(()));
+                }
+            } else {
+                self.tape.head += stride;
+            }
+            n += 1;
+        }
+
+        if n == budget {
+            // the final move is counted by `run`
+            self.moves += n - 1;
+            self.count_scan(n, n - 1);
+            self.bytes.ip = self.state.address as usize;
+            Some(ControlFlow::Continue(()))
+        } else {
+            self.moves += n;
+            self.count_scan(n, n);
+            None
+        }
+    }
+
+    fn count_scan(&mut self, scanned: usize, moves: usize) {
+        if let Some(profile) = &mut self.profile {
+            profile::count(&mut profile.scans, self.state.address, scanned);
+            profile::count(&mut profile.moves, self.state.address, moves);
+        }
+    }
+
+    fn write(&mut self, value: u16) {
+        self.tape.write(value);
+        if value != 0 && self.watch.map(|p| self.tape.origin + p) == Some(self.tape.head) {
+            // `run_moves()` counts the current move and stops
+            self.max_moves = self.moves + 1;
+        }
+    }
+
     fn rhs(&mut self) -> ControlFlow<()> {
+        if let Some(profile) = &mut self.profile {
+            profile::count(&mut profile.arms, self.bytes.ip as u32, 1);
+        }
+
         loop {
             match self.bytes.next() {
                 bc::LEFT => self.tape.left(1)?,
                 bc::RIGHT => self.tape.right(1),
-                bc::LEFT_N => self.tape.left(self.bytes.next())?,
-                bc::RIGHT_N => self.tape.right(self.bytes.next()),
+                bc::LEFT_N => self.tape.left(self.bytes.next() as usize)?,
+                bc::RIGHT_N => self.tape.right(self.bytes.next() as usize),
                 bc::WRITE_ARG => {
                     let arg_index = self.bytes.next() as usize;
-                    self.tape.write(self.state.symbols[arg_index]);
+                    self.write(self.state.symbols[arg_index]);
                 }
                 bc::WRITE_VAL => {
                     let value = self.bytes.next_u16();
-                    self.tape.write(value);
+                    self.write(value);
                 }
-                bc::WRITE_BOUND => self.tape.write(self.bound),
+                bc::WRITE_BOUND => self.write(self.bound),
                 bc::SYMBOL_ARG => {
                     let arg_index = self.bytes.next() as usize;
                     self.symbol_stack.push(self.state.symbols[arg_index]);
@@ -134,36 +512,55 @@ impl Vm<'_> {
                 bc::SYMBOL_BOUND => self.symbol_stack.push(self.bound),
                 bc::TAKE_ARG | bc::CLONE_ARG => {
                     let arg_index = self.bytes.next() as usize;
-                    self.state_stack.push(self.state.states[arg_index].clone());
+                    self.state_stack
+                        .push(Rc::clone(&self.state.states[arg_index]));
                 }
                 bc::FREE_ARG => {
                     self.bytes.next();
                 }
+                bc::INLINED => {
+                    let n = self.bytes.next() as usize;
+                    let skip = self.bytes.next_u16() as usize;
+                    if self.moves + 1 + n > self.max_moves {
+                        // go where the arm went before inlining, so the run
+                        // still stops at the limit
+                        self.bytes.ip += skip;
+                    } else {
+                        self.moves += n;
+                        self.inlined += n;
+                    }
+                }
                 bc::MAKE_STATE => {
                     let end = self.state_stack.len() - self.bytes.next() as usize;
-                    let states = self.state_stack.drain(end..).collect();
+                    let states: Vec<_> = self.state_stack.drain(end..).collect();
                     let symbols = std::mem::take(&mut self.symbol_stack);
                     let address = self.bytes.next_u32();
-                    self.state_stack.push(State {
+                    if let Some(profile) = &mut self.profile {
+                        // like in vm.c, states without arguments aren't allocated
+                        if !states.is_empty() || !symbols.is_empty() {
+                            profile::count(&mut profile.allocations, address, 1);
+                        }
+                    }
+                    self.state_stack.push(Rc::new(State {
                         address,
                         states,
                         symbols,
-                    });
+                    }));
                 }
                 bc::FINAL_STATE => {
-                    let states = std::mem::take(&mut self.state_stack);
-                    let symbols = std::mem::take(&mut self.symbol_stack);
-                    let address = self.bytes.goto();
-                    self.state = State {
-                        address,
-                        states,
-                        symbols,
-                    };
+                    // the stacks become the arguments, and the old arguments
+                    // the stacks, so neither is allocated again every move
+                    self.state.address = self.bytes.goto();
+                    std::mem::swap(&mut self.state.states, &mut self.state_stack);
+                    std::mem::swap(&mut self.state.symbols, &mut self.symbol_stack);
+                    self.state_stack.clear();
+                    self.symbol_stack.clear();
                     return ControlFlow::Continue(());
                 }
                 bc::FINAL_ARG => {
                     let arg_index = self.bytes.next() as usize;
-                    self.state = self.state.states[arg_index].clone();
+                    let state = self.state.states.swap_remove(arg_index);
+                    self.state = Rc::try_unwrap(state).unwrap_or_else(|state| (*state).clone());
                     self.bytes.ip = self.state.address as usize;
                     return ControlFlow::Continue(());
                 }
@@ -176,21 +573,39 @@ impl Vm<'_> {
 struct Tape {
     tape: Vec<u16>,
     head: usize,
+    /// Cells added to the left of the initial cell 0 in bi-infinite mode
+    origin: usize,
+    bi_infinite: bool,
 }
 
 impl Tape {
-    fn left(&mut self, n: u8) -> ControlFlow<()> {
-        if let Some(head) = self.head.checked_sub(n as usize) {
+    fn left(&mut self, n: usize) -> ControlFlow<()> {
+        if let Some(head) = self.head.checked_sub(n) {
             self.head = head;
             ControlFlow::Continue(())
+        } else if self.bi_infinite {
+            self.grow_left(n - self.head);
+            self.head -= n;
+            ControlFlow::Continue(())
         } else {
             self.head = 0;
             ControlFlow::Break(())
         }
     }
 
-    fn right(&mut self, n: u8) {
-        self.head += n as usize;
+    /// Adds at least `n` cells to the left. The tape at least doubles each
+    /// time, so every cell is copied O(1) times amortized.
+    fn grow_left(&mut self, n: usize) {
+        let extra = (2 * n).max(self.tape.len()).max(EXTRA_RESIZE_ROOM);
+        let mut tape = vec![0; extra + self.tape.len()];
+        tape[extra..].copy_from_slice(&self.tape);
+        self.tape = tape;
+        self.head += extra;
+        self.origin += extra;
+    }
+
+    fn right(&mut self, n: usize) {
+        self.head += n;
     }
 
     fn read(&self) -> u16 {
@@ -235,6 +650,15 @@ impl Bytes<'_> {
         u16::from_le_bytes(bytes)
     }
 
+    fn peek_u16(&self, offset: usize) -> u16 {
+        let location = self.ip + offset;
+        let bytes = self
+            .bytes
+            .get(location..location + 2)
+            .expect("invalid bytecode");
+        u16::from_le_bytes([bytes[0], bytes[1]])
+    }
+
     fn next_u32(&mut self) -> u32 {
         let bytes = [self.next(), self.next(), self.next(), self.next()];
         u32::from_le_bytes(bytes)
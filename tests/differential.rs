@@ -0,0 +1,31 @@
+//! A short run of the differential benchmark, so `cargo test` compares every
+//! mode and VM on a few random machines.
+
+use std::thread;
+
+// only `compare()` is used, the rest of the benchmark is its `main()`
+#[allow(dead_code)]
+#[path = "../benches/differential.rs"]
+mod differential;
+
+/// Few enough machines to run in a debug build
+const MACHINES: usize = 20;
+const SEED: u64 = 1;
+/// The stack of a main thread, since the Rust VM drops nested states
+/// recursively
+const STACK_SIZE: usize = 8 << 20;
+
+#[test]
+fn modes_and_vms_agree() {
+    let comparison = thread::Builder::new()
+        .stack_size(STACK_SIZE)
+        .spawn(|| differential::compare(MACHINES, SEED))
+        .unwrap()
+        .join()
+        .unwrap();
+    for mismatch in &comparison.mismatches {
+        mismatch.print();
+    }
+    assert!(comparison.mismatches.is_empty());
+    assert!(comparison.runs > 0);
+}